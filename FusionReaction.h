@@ -7,33 +7,605 @@
 #include <TMath.h>
 #include <TRandom3.h>
 #include <TFile.h>
-#include <TGenPhaseSpace.h>
 #include <TLorentzVector.h>
+#include <THnSparse.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <memory>
+#include <deque>
 #include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 using namespace std;
 
-// Particle structure for multi-particle reactions
-struct Particle {
+// Maximum number of reaction products, and of decay products in one decay channel
+const int kMaxProducts = 10;
+const int kMaxDecayDaughters = 10;
+
+// Reaction product species: configuration only, fixed once the masses are looked up
+struct Species {
     int A;          // Mass number
     int Z;          // Atomic number
-    double mass;    // Mass in MeV/c^2
-    double energy;  // Kinetic energy
-    double theta;   // Polar angle (radians) - CM frame
-    double phi;     // Azimuthal angle (radians)
-    double momentum; // Momentum magnitude
-    double px, py, pz; // Momentum components
-    double theta_lab; // Lab frame polar angle
-    double energy_lab; // Lab frame energy
-    double momentum_lab; // Lab frame momentum magnitude
-    double px_lab, py_lab, pz_lab; // Lab frame momentum components
-    double excitation_energy; // Excitation energy in MeV (0.0 for ground state)
+    double mass;    // Ground-state mass in MeV/c^2 (from the mass table)
+    double excitation_energy;  // Configured excitation energy in MeV (0.0 for ground state)
     string name;    // Particle name
 };
 
+// Product kinematics of the current event only, one array per quantity over the products (Lab
+// frame; the phase space is generated in the Lab frame). GenerateProducts and MeasureProducts
+// work one event at a time; a block of events x products exists only as PhaseSpaceBatch
+// (float_batch). The 4-vectors are in the event record.
+struct ProductKinematics {
+    double excitation_energy[kMaxProducts];  // Excitation energy of this event (MeV)
+    double energy[kMaxProducts];    // Kinetic plus excitation energy (MeV)
+    double momentum[kMaxProducts];  // Momentum magnitude (MeV/c)
+    double theta[kMaxProducts];     // Polar angle (radians)
+    double phi[kMaxProducts];       // Azimuthal angle (radians)
+};
+
+// Lab frame 4-momentum (MeV)
+struct FourVector {
+    double px, py, pz, E;
+};
+
+// Kinetic energy as p^2 / (E + m): no cancellation between E and m for heavy, slow nuclei
+inline double KineticEnergy(const FourVector& v, double m) {
+    return (v.px * v.px + v.py * v.py + v.pz * v.pz) / (v.E + m);
+}
+
+// Batched kernels over contiguous arrays (FusionReaction_Vector.cpp): momentum magnitude,
+// polar and azimuthal angles in degrees, sin/cos, boosts by a common beta, and Box-Muller
+// Gaussians from pairs of uniforms. SIMD polynomial approximations with bounded error;
+// AVX-512, AVX2 or scalar is picked at run time.
+void VectorSinCos(int n, const double* x, double* s, double* c);
+void VectorSinCos(int n, const float* x, float* s, float* c);
+void VectorAngles(int n, const double* px, const double* py, const double* pz, double* p, double* theta_deg, double* phi_deg);
+void VectorAngles(int n, const float* px, const float* py, const float* pz, float* p, float* theta_deg, float* phi_deg);
+void VectorBoost(int n, double* px, double* py, double* pz, double* E, double bx, double by, double bz);
+void VectorGaussian(int n, const double* u1, const double* u2, double* g1, double* g2);
+const char* VectorISA();
+bool SetVectorISA(const string& name);
+
+// Heap allocations made by the calling thread so far, for the allocation check. The library does
+// not count allocations itself; the check program (check_allocations.C, make check) replaces the
+// global operator new and installs its counter here.
+typedef long long (*AllocationCounter)();
+void SetAllocationCounter(AllocationCounter counter);
+
+// Capacity of the per-event decay tree buffer (products + all decay products)
+const int kMaxDecayEntries = 64;
+
+// One decay channel of a decay node
+struct DecayChannel {
+    double branching;   // Relative branching ratio (normalized by the node total)
+    int first_slot;     // First decay slot of the daughters (index into decay_A, decay_Z, ...)
+    int n_daughters;    // Number of daughters
+    bool closed_warned; // Closed-channel warning already printed
+};
+
+// Per-event 4-vector sums shared by all reconstructed observables
+struct EventSums {
+    bool final_valid;    // Final-state sum computed for this event
+    double W_initial;    // Initial invariant mass (MeV)
+    double W_final;      // Final-state invariant mass (MeV)
+    double final_E;      // Final-state total energy (MeV)
+    double final_p;      // Final-state total momentum magnitude (MeV/c)
+    bool decay_valid;    // Decay product sum computed for this event
+    bool decay_present;  // Selected parent decayed in this event
+    double decay_E;      // Summed decay product energy (MeV)
+    double decay_mass;   // Decay product invariant mass (MeV/c^2)
+};
+
+// Decay node: a product or decay product that decays through one of several channels
+struct DecayNode {
+    int parent_product;         // Product index of the parent (-1 if parent is a decay product)
+    int parent_slot;            // Decay slot of the parent (-1 if parent is a product)
+    double total_branching;     // Sum of channel branching ratios
+    vector<DecayChannel> channels;
+};
+
+// One particle of the per-event decay tree
+struct DecayTreeEntry {
+    int product;        // Product index (-1 for decay products)
+    int slot;           // Decay slot (-1 for reaction products)
+    int parent;         // Parent entry (-1 for reaction products)
+    int channel;        // Channel taken in this event (-1 if it did not decay)
+    int first_daughter; // First daughter entry
+    int n_daughters;    // Number of daughter entries
+    double mass;        // Ground-state mass (MeV/c^2)
+    double excitation_energy; // Excitation energy (MeV)
+};
+
+// Events buffered per block for the batched reconstruction kernels
+const int kEventBlockSize = 256;
+
+// Events before the allocation check starts counting (make check): the first blocks may
+// still size buffers
+const int kAllocationWarmupEvents = 2 * kEventBlockSize;
+
+// Missing-mass reconstruction for one set of detected products
+struct MissingMassSet {
+    string label;               // Detected product names joined by '+'
+    vector<int> detected;       // Detected product indices
+    vector<int> undetected;     // Remaining product indices (the missing system)
+    double detected_mass;       // Ground-state mass sum of the detected products (MeV/c^2)
+    double reference_mass;      // Ground-state mass sum of the missing system (MeV/c^2)
+    
+    // Block buffers (kEventBlockSize entries, allocated once)
+    int n_block;
+    vector<double> beam_T;                // Beam kinetic energy used for the event (MeV)
+    vector<double> E, px, py, pz;         // Measured detected 4-momentum sum (MeV)
+    vector<double> Ex_true;               // True excitation energy of the missing system (MeV)
+    vector<double> mass, Ex, Q;           // Kernel outputs
+    
+    TH1D* his_mass;
+    TH1D* his_Ex;
+    TH1D* his_Q;
+    TH1D* his_Ex_difference;
+};
+
+// Declared observable histograms (histogram_<n> in the parameter file). Every expression is
+// compiled once at setup into a range of ObservableOps (postfix order) in one flat list, evaluated on a
+// fixed-size stack every event (FusionReaction_Observables.cpp).
+enum ObservableCode {
+    kObsConst,                                                      // Constant (value)
+    kObsEnergy, kObsTheta, kObsPhi, kObsMomentum, kObsExcitation,   // One particle
+    kObsMass, kObsMissingMass,                                      // Particle list
+    kObsBeamEnergy,                                                 // Beam energy of the event
+    kObsNeg, kObsNot, kObsSqrt, kObsAbs,                            // Unary
+    kObsAdd, kObsSub, kObsMul, kObsDiv,                             // Binary
+    kObsLess, kObsGreater, kObsLessEqual, kObsGreaterEqual, kObsEqual, kObsNotEqual,
+    kObsAnd, kObsOr
+};
+
+struct ObservableOp {
+    int code;         // ObservableCode
+    bool truth;       // Particle quantities from the true instead of the measured 4-vectors
+    int first, last;  // Particles: observable_members[first .. last)
+    double value;     // Constant
+};
+
+// Stack depth available to a compiled expression
+const int kMaxObservableStack = 32;
+
+struct ObservableHistogram {
+    string name;
+    string x_expression, y_expression, cut;  // Empty y_expression: 1D; empty cut: all events
+    int nx, ny;
+    double x_min, x_max, y_min, y_max;
+    
+    // Compiled ops: x [x_ops, y_ops), y [y_ops, cut_ops), cut [cut_ops, end_ops)
+    int x_ops, y_ops, cut_ops, end_ops;
+    
+    TH1D* his_1d;
+    TH2F* his_2d;
+};
+
+// Run constants of a configured reaction, built once by PrepareReaction() after the masses and
+// the excited-state configuration are known. The event loop only reads it; it is never modified
+// after construction, so threads simulating the same reaction can share one instance.
+struct PreparedReaction {
+    double M_beam, M_target;   // Ground-state masses (MeV/c^2)
+    double M0, M0_squared;     // M_beam + M_target and its square
+    double Q_value;            // Ground-state reaction Q-value (MeV)
+    double nominal_beam_T;     // Analysis beam energy: mean energy at mid-target (MeV)
+    
+    // Excitation of each product: fixed energy, or a table of states with cumulative branching
+    vector<double> fixed_excitation;              // [product]
+    vector<vector<double> > state_energy;         // [product][state] (empty: fixed excitation)
+    vector<vector<double> > state_cumulative;     // [product][state]
+    
+    // Decays: parent ground-state mass minus the daughter rest masses, cumulative branching
+    vector<vector<double> > decay_Q_ground;       // [node][channel] (MeV)
+    vector<vector<double> > channel_cumulative;   // [node][channel]
+    vector<double> decay_rest_mass;               // [slot] mass + excitation (MeV/c^2)
+    
+    vector<double> missing_mass_Q_offset;         // [set] M0 - detected mass (MeV)
+    
+    // Beam energy inverse CDF at equally spaced probabilities (empty: drawn from the three
+    // components every event)
+    vector<double> beam_inverse_cdf;
+    
+    double SqrtS(double beam_T) const { return sqrt(M0_squared + 2.0 * M_target * beam_T); }
+    double BeamMomentum(double beam_T) const { return sqrt(beam_T * (beam_T + 2.0 * M_beam)); }
+    // sqrt(s) - sum of ground-state product masses, using sqrt(s) - M0 = 2 M_target T / (sqrt(s) + M0)
+    double AvailableKineticEnergy(double beam_T) const {
+        return 2.0 * M_target * beam_T / (SqrtS(beam_T) + M0) + Q_value;
+    }
+};
+
+// Kinematic fit: maximum number of final-state particles per event
+const int kMaxFitParticles = 10;
+
+// Event block for the kinematic fit (allocated once, refilled every kEventBlockSize events)
+struct FitBlock {
+    int n_events;
+    int n_particles[kEventBlockSize];
+    int product[kEventBlockSize][kMaxFitParticles];   // Product index (-1 for decay products)
+    int slot[kEventBlockSize][kMaxFitParticles];      // Decay slot (-1 for products)
+    bool from_parent[kEventBlockSize][kMaxFitParticles]; // Descends from the reconstructed parent
+    double mass[kEventBlockSize][kMaxFitParticles];   // Rest mass incl. excitation (MeV/c^2)
+    double T[kEventBlockSize][kMaxFitParticles];      // Measured, then fitted kinetic energy (MeV)
+    double theta[kEventBlockSize][kMaxFitParticles];  // Measured, then fitted polar angle (rad)
+    double phi[kEventBlockSize][kMaxFitParticles];    // Measured, then fitted azimuth (rad)
+    double T_true[kEventBlockSize][kMaxFitParticles];
+    double theta_true[kEventBlockSize][kMaxFitParticles];
+    double beam_T_true[kEventBlockSize];
+    double parent_mass_true[kEventBlockSize];
+};
+
+// Sparse counts: open-addressing table (linear probing, bin -1 = empty slot) of linear bin ->
+// sum of weights. Reset() allocates the table; Add() does not allocate until it is 3/4 full.
+struct SparseCounts {
+    vector<long long> bins;   // Linear bin of each slot (-1: empty)
+    vector<double> counts;    // Counts of each slot
+    int n_filled;             // Filled slots
+    
+    void Reset(int n_slots);  // n_slots: a power of two
+    void Add(long long bin, double w);
+};
+
+// Response matrix accumulator for unfolding: sparse (Ex_true, theta_cm_true, Ex_reco, theta_cm_reco)
+// counts plus generated/accepted maps on the true (Ex, theta_cm) grid. Bins include under/overflow.
+// Each worker fills its own accumulator; Merge() adds another one.
+struct ResponseAccumulator {
+    int n_Ex, n_theta;
+    double Ex_min, Ex_max;
+    SparseCounts response;              // Linear 4D bin -> counts
+    vector<double> generated, accepted; // (n_Ex + 2) * (n_theta + 2) cells
+    
+    void Configure(int n_Ex_bins, double Ex_lo, double Ex_hi, int n_theta_bins);
+    int ExBin(double Ex) const;
+    int ThetaBin(double theta_deg) const;
+    void Fill(double Ex_true, double theta_true, bool is_accepted, double Ex_reco, double theta_reco);
+    bool SameGrid(const ResponseAccumulator& other) const;
+    void Merge(const ResponseAccumulator& other);
+    void Write() const;  // his_response, _generated, _accepted, _efficiency to the current directory
+};
+
+// Unweighted 2D histogram for mostly empty kinematic loci (E vs angle): filled cells in a
+// SparseCounts table, switched to a dense float array once the table would be larger, plus
+// the TH2 statistics. Histograms filled with identical values share one accumulator with
+// several outputs (name, title); Dense() converts an output to a TH2F when it is written.
+class SparseHist2D {
+public:
+    SparseHist2D(int nx, double x_min, double x_max, int ny, double y_min, double y_max);
+    ~SparseHist2D();
+    int AddOutput(const char* name, const char* title);
+    int FindOutput(const string& name) const;
+    int NumOutputs() const { return fNames.size(); }
+    void Fill(double x, double y);
+    void Settle();
+    double GetEntries() const { return fEntries; }
+    double MaxFilledY() const;
+    TH2F* Dense(int output);
+    void Refresh();
+    void WriteState(FILE* file) const;
+    bool ReadState(FILE* file);
+    
+private:
+    void CopyTo(TH2F* his) const;
+    
+    TAxis fXaxis, fYaxis;
+    int fCells;                      // (nx + 2) * (ny + 2), under/overflow included
+    SparseCounts fSparse;            // Filled cells while sparse
+    vector<float> fDense;            // All cells once dense (empty while sparse)
+    bool fSettled;                   // Past warm-up: dense array reserved, table does not grow
+    double fEntries;
+    double fStats[7];                // sumw, sumw2, sumwx, sumwx2, sumwy, sumwy2, sumwxy
+    vector<string> fNames, fTitles;  // Outputs
+    vector<TH2F*> fOutputs;          // Dense copies (created by the first Dense() call)
+};
+
+// Built-in nuclear masses, generated from mass.dat at build time (FusionReaction_MassTable.cpp),
+// sorted by (A, Z) with one entry per nucleus
+struct MassEntry {
+    int A;
+    int Z;
+    double mass;
+};
+extern const MassEntry kBuiltinMasses[];
+extern const int kBuiltinMassCount;
+
+// Nuclear mass table (A, Z) -> mass in MeV/c^2, loaded once and shared by all reactions;
+// entries loaded from a mass file override the built-in table
+class MassTable {
+public:
+    bool Load(const char* filename);
+    bool Find(int A, int Z, double& mass) const;
+    int Size() const { return masses.size(); }
+    static bool FindBuiltin(int A, int Z, double& mass);
+    
+private:
+    map<pair<int, int>, double> masses;
+};
+
+// Raubold-Lynch N-body phase-space generator (the TGenPhaseSpace algorithm) drawing its
+// random numbers from a caller-owned TRandom3 instead of gRandom, so reactions running
+// on different threads never share generator state
+const int kMaxPhaseSpaceParticles = 18;
+
+class PhaseSpaceGenerator {
+public:
+    PhaseSpaceGenerator();
+    bool SetDecay(const TLorentzVector& P, int nt, const double* mass);
+    bool SetDecay(const TLorentzVector& P, int nt, const double* mass, double kinetic);
+    double Generate(TRandom3* random);
+    double Generate(const double* u);
+    int NUniforms() const { return (fNt > 2 ? fNt - 2 : 0) + 2 * (fNt - 1); }  // Uniforms per event
+    TLorentzVector* GetDecay(int n) { return &fDecPro[n]; }
+    
+private:
+    int fNt;
+    double fMass[kMaxPhaseSpaceParticles];
+    double fBeta[3];
+    double fTeCmTm;
+    double fWtMax;
+    TLorentzVector fDecPro[kMaxPhaseSpaceParticles];
+};
+
+// Random variates drawn a block at a time (bulk_random = true, FusionReaction_Random.cpp):
+// uniforms straight from TRandom3::RndmArray, unit Gaussians from pairs of them through the
+// Box-Muller kernel. Handing one out is a load from the buffer instead of a virtual TRandom3 call.
+const int kBulkRandomSize = 16 * kEventBlockSize;
+
+class BulkRandom {
+public:
+    explicit BulkRandom(TRandom3* random);
+    void Reset() { fNextUniform = fNextGaus = kBulkRandomSize; }  // Discard buffered variates
+    double Rndm() {
+        if (fNextUniform == kBulkRandomSize) FillUniform();
+        return fUniform[fNextUniform++];
+    }
+    // n consecutive uniforms (n <= kBulkRandomSize)
+    const double* Rndm(int n) {
+        if (fNextUniform + n > kBulkRandomSize) FillUniform();
+        fNextUniform += n;
+        return &fUniform[fNextUniform - n];
+    }
+    double Gaus(double mean, double sigma) {
+        if (fNextGaus == kBulkRandomSize) FillGaus();
+        return mean + sigma * fGaus[fNextGaus++];
+    }
+    void WriteState(FILE* file) const;  // Buffered variates (checkpoints)
+    bool ReadState(FILE* file);
+    
+private:
+    void FillUniform();
+    void FillGaus();
+    
+    TRandom3* fRandom;
+    int fNextUniform;
+    int fNextGaus;
+    double fUniform[kBulkRandomSize];
+    double fGaus[kBulkRandomSize];
+};
+
+// Block of reaction events for the single-precision batched generator (float_batch = true).
+// Arrays are indexed [particle][event], so the kernel runs over kEventBlockSize events at a
+// time. Each particle carries its kinetic energy T next to the momentum instead of E, so the
+// heavy rest masses never enter a subtraction in Real precision.
+template <typename Real>
+struct PhaseSpaceBatch {
+    int n_events;                                         // Events in the block
+    int next;                                             // Next event to hand out
+    // Inputs, drawn per event (double where they are handed back unchanged)
+    double beam_T[kEventBlockSize];                       // Beam kinetic energy (MeV)
+    double excitation[kMaxPhaseSpaceParticles][kEventBlockSize];
+    double lab_gm1[kEventBlockSize];                      // gamma - 1 of the CM -> Lab boost
+    double lab_gb[kEventBlockSize];                       // gamma * beta of the CM -> Lab boost
+    Real kinetic[kEventBlockSize];                        // sqrt(s) - sum of masses (<= 0: no event)
+    Real mass[kMaxPhaseSpaceParticles][kEventBlockSize];  // Rest mass incl. excitation
+    Real rno[kMaxPhaseSpaceParticles][kEventBlockSize];   // Sorted uniforms, 0 and 1 at the ends
+    Real cz[kMaxPhaseSpaceParticles][kEventBlockSize];    // Rotation about z per step (cosine)
+    Real angle[kMaxPhaseSpaceParticles][kEventBlockSize]; // Rotation about y per step (rad)
+    // Work arrays
+    Real msum[kMaxPhaseSpaceParticles][kEventBlockSize];  // Sum of the first n + 1 masses
+    Real pd[kMaxPhaseSpaceParticles][kEventBlockSize];    // Two-body momenta of the splits
+    // Outputs: Lab frame momentum, kinetic energy (MeV) and angles, weight (< 0: no event)
+    Real px[kMaxPhaseSpaceParticles][kEventBlockSize];
+    Real py[kMaxPhaseSpaceParticles][kEventBlockSize];
+    Real pz[kMaxPhaseSpaceParticles][kEventBlockSize];
+    Real T[kMaxPhaseSpaceParticles][kEventBlockSize];
+    Real p[kMaxPhaseSpaceParticles][kEventBlockSize];
+    Real theta[kMaxPhaseSpaceParticles][kEventBlockSize];     // Polar angle (deg)
+    Real phi[kMaxPhaseSpaceParticles][kEventBlockSize];       // Azimuthal angle (deg)
+    Real weight[kEventBlockSize];
+};
+
+// Caller-owned structure-of-arrays event buffers for FusionReaction::GenerateEvents.
+// Per-event arrays hold one entry per event; per-particle arrays hold max_particles
+// entries per event (particle i of event e at e * max_particles + i). Lab frame, MeV;
+// the vertex is in the units of tar_res.
+struct EventBuffers {
+    int max_particles;          // Particle slots per event (>= MaxFinalStateParticles())
+    double* vertex_x;
+    double* vertex_y;
+    double* vertex_z;
+    double* weight;             // Phase-space weight (product and decay weights, <= 1)
+    int* n_particles;           // Final-state particles written for the event
+    int* pdg;                   // PDG code (2112, 2212, nuclei 100ZZZAAA0)
+    double* px;
+    double* py;
+    double* pz;
+    double* E;                  // Total energy incl. any remaining excitation
+};
+
+// Draws GenerateEvents makes for one event before giving up (an event below threshold, e.g.
+// from beam spread or straggling, is drawn again)
+const int kMaxGenerateAttempts = 1000;
+
+// PDG-style particle code of a nucleus
+int PDGCode(int A, int Z);
+
+// One particle of an exported event
+struct HepMCParticle {
+    int pdg;
+    int mother;     // Mother particle index in the event; -1 incoming (beam, target), -2 reaction vertex
+    int status;     // 1 final state, 2 decayed, 4 incoming
+    double px, py, pz, E, m;   // MeV
+};
+
+// Header of an exported event
+struct HepMCEvent {
+    int number;
+    int first_particle;   // Index of the first particle in the block
+    int n_particles;
+    double weight;
+    double x, y, z;       // Reaction vertex
+};
+
+// Streaming HepMC3 ASCII writer (without the HepMC library). The simulation thread copies
+// events into preallocated blocks; a writer thread formats and writes full blocks, through
+// gzip for file names ending in ".gz".
+class HepMCWriter {
+public:
+    HepMCWriter();
+    ~HepMCWriter();
+    bool Open(const char* filename);
+    void BeginEvent(int number, double weight, double x, double y, double z);
+    void AddParticle(int pdg, int mother, int status, double px, double py, double pz, double E, double m);
+    bool Close();
+    
+private:
+    struct Block {
+        vector<HepMCEvent> events;
+        vector<HepMCParticle> particles;
+    };
+    void Submit();
+    void WriterLoop();
+    void WriteBlock(const Block& block);
+    
+    FILE* fFile;
+    string fName;
+    pid_t fGzip;                // gzip process for .gz output (-1: plain file)
+    bool fWriteOk;              // Set by the writer thread when it closes the output
+    Block* fCurrent;
+    vector<Block*> fBlocks;     // All blocks (owned)
+    vector<Block*> fFree;       // Blocks ready to be filled
+    deque<Block*> fQueue;       // Blocks waiting for the writer thread
+    mutex fMutex;
+    condition_variable fCond;
+    thread fThread;
+    bool fDone;
+};
+
+// Truth-level event block (truth_output / truth_input, FusionReaction_Truth.cpp): generated Lab
+// frame kinematics before any resolution, kEventBlockSize events at a time. Per event, values
+// holds the weight and beam energy, then Ex, px, py, pz, E of every product and px, py, pz, E of
+// every decay entry; tree holds the number of decay tree entries, then slot, parent, channel,
+// first_daughter and n_daughters of each entry.
+struct TruthBlock {
+    int n_events;
+    vector<double> values;
+    vector<int> tree;
+};
+
+// Early stopping (stop_targets): an observable of a histogram and the relative statistical
+// precision required of it. Observables are taken along x (2D histograms summed over y).
+struct StopTarget {
+    string histogram;   // Histogram name
+    string quantity;    // "mean", "width" (standard deviation) or "count" (contents of [lo, hi])
+    double lo, hi;      // Window of "count"
+    double precision;   // Required relative precision
+};
+
+// Sums of one stop target over one reaction's events (the histogram statistics along x, as
+// from TH1::GetStats, and the contents of the count window); added up across reactions
+struct StopSums {
+    double sumw, sumw2, sumwx, sumwx2;
+    double window;
+};
+
+// Convergence check shared by all reactions of a run, possibly on different threads. Each
+// reaction publishes its sums every kEventBlockSize events; the targets are evaluated on the
+// totals, i.e. on the summed histograms of a multi-channel run.
+class ConvergenceMonitor {
+public:
+    ConvergenceMonitor(const vector<StopTarget>& targets, int n_reactions);
+    const vector<StopTarget>& Targets() const { return fTargets; }
+    bool Publish(int reaction, const vector<StopSums>& sums, int events, double fraction);
+    bool Converged() const { return fConverged; }
+    int EventLimit(int n_planned) const;
+    void PrintStatus();
+    
+private:
+    bool Evaluate(vector<double>& value, vector<double>& precision);
+    
+    mutex fMutex;
+    vector<StopTarget> fTargets;
+    vector<vector<StopSums> > fSums;  // [reaction][target]
+    vector<int> fEvents;              // Events published per reaction
+    vector<double> fFraction;         // Fraction of its planned events per reaction
+    atomic<bool> fConverged;
+    double fStopFraction;             // Largest fraction when the targets were met
+};
+
+// Same dimension, bin counts and axis limits (histograms that can be summed bin by bin)
+bool SameBinning(const TH1* a, const TH1* b);
+
+// Live monitoring (monitor_port): a small HTTP server on 127.0.0.1 serving merged snapshots
+// of every reaction's histograms and the throughput of the run. Reactions copy their histograms
+// into the snapshot at a block boundary every interval seconds; the copy is skipped if the server
+// is reading it (try_lock), so the simulation never waits for a client.
+class LiveMonitor {
+public:
+    LiveMonitor(int port, double interval, const vector<string>& names);
+    ~LiveMonitor();
+    bool Start();
+    void Stop();
+    int Port() const { return fPort; }
+    void Offer(int reaction, const vector<TH1*>& histograms, int events, int planned, bool force);
+    bool Due(int reaction) const;
+    
+private:
+    void Serve();
+    string Respond(const string& path);
+    
+    mutex fMutex;                     // Guards the snapshots and counters below
+    vector<string> fNames;            // Reaction (channel) names
+    vector<vector<TH1*> > fSnapshots; // [reaction][histogram] copies
+    vector<int> fEvents, fPlanned;    // Events done / planned at the last snapshot
+    vector<double> fTime;             // Seconds since Start() at the last snapshot
+    vector<double> fRate;             // Events per second between the last two snapshots
+    vector<double> fNextOffer;        // Worker-side: time of the next snapshot (no lock)
+    chrono::steady_clock::time_point fStart;
+    int fPort;
+    double fInterval;
+    int fSocket;
+    atomic<bool> fRunning;
+    thread fThread;
+};
+
+// Checkpoints (checkpoint_file, FusionReaction_Checkpoint.cpp): written every every_events events
+// and/or every every_seconds seconds (0: off); the time is checked every kEventBlockSize events
+class CheckpointSchedule {
+public:
+    CheckpointSchedule(int every_events = 0, double every_seconds = 0.0);
+    bool Due(int events_done);
+    
+private:
+    int fEveryEvents;
+    double fEverySeconds;
+    chrono::steady_clock::time_point fLast;
+};
+
+// Complete run state of the reactions (histograms, pending block buffers, random generator state),
+// their event counters, the channel selector of an interleaved run (may be null) and the hash of
+// the configuration. Written to filename.tmp and renamed over filename, so an interrupted job
+// always leaves a complete checkpoint. ReadCheckpoint returns false if there is none yet.
+class FusionReaction;
+bool WriteCheckpoint(const string& filename, unsigned long long config_hash, const vector<FusionReaction*>& reactions,
+                     const vector<int>& events, TRandom3* selector);
+bool ReadCheckpoint(const string& filename, unsigned long long config_hash, const vector<FusionReaction*>& reactions,
+                    vector<int>& events, TRandom3* selector);
+
 class FusionReaction {
 private:
     // Beam parameters
@@ -48,11 +620,9 @@ private:
     int A_target, Z_target;
     double M_target;
     
-    // Reaction products
-    vector<Particle> products;
-    vector<double> product_masses;
-    vector<int> product_A, product_Z;
-    vector<string> product_names;
+    // Reaction products: species and the kinematics of the current event
+    vector<Species> products;
+    ProductKinematics product_kin;
     
     // Multiple excited states configuration
     bool multiple_excited_states_enabled;
@@ -62,16 +632,127 @@ private:
     
     // Decay configuration
     bool decay_enabled;
-    int decay_product_index;  // Which product will decay
-    vector<int> decay_A, decay_Z;  // Decay products A, Z
+    int decay_product_index;  // Product whose decay is used for parent reconstruction
+    vector<int> decay_A, decay_Z;  // Decay products A, Z (one entry per decay slot)
     vector<string> decay_names;    // Decay product names
     vector<double> decay_masses;   // Decay product masses
+    vector<double> decay_excitation; // Decay product excitation energies
+    vector<int> decay_slot_node;     // Decay node of each decay slot (-1 if stable)
+    vector<int> product_decay_node;  // Decay node of each product (-1 if stable)
+    vector<DecayNode> decay_nodes;   // Decay tree configuration
+    int current_decay_node;          // Node/channel receiving AddDecayProduct()
+    int current_decay_channel;
+    
+    // Per-event decay tree (fixed capacity, filled stack-wise)
+    DecayTreeEntry decay_tree[kMaxDecayEntries];
+    int n_decay_tree;
+    bool decay_tree_overflow_warned;
+    
+    // Cached 4-vector sums of the current event
+    EventSums event_sums;
+    
+    // Event record: true and measured (resolution-applied) Lab frame 4-vectors,
+    // allocated once per product and per decay slot
+    vector<FourVector> product_p4_true, product_p4_meas;
+    vector<FourVector> decay_p4_true, decay_p4_meas;
+    
+    // Missing-mass reconstruction
+    vector<MissingMassSet> missing_mass_sets;
+    bool missing_mass_event_beam;  // Use the per-event beam energy instead of the nominal one
+    
+    // Invariant-mass combinatorics. Particles are numbered products first (0..n_products-1),
+    // then decay slots (n_products + slot), then aliases of names repeated across the channels
+    // of a node; subsets are flattened once at setup.
+    bool invariant_mass_all_pairs;
+    vector<vector<string>> invariant_mass_requests;  // Explicit subsets (particle names)
+    vector<int> combo_members;    // Flattened member list of all subsets
+    vector<int> combo_offset;     // Subset s uses combo_members[combo_offset[s] .. combo_offset[s+1])
+    vector<int> combo_slot_alias; // Alias particle of each decay slot (-1 if none)
+    vector<FourVector> combo_p4;  // Measured 4-vectors of the current event, per particle
+    vector<char> combo_present;   // Particle produced in the current event
+    
+    // Kinematic fit
+    bool enable_kinematic_fit;
+    FitBlock* fit_block;
+    bool fit_overflow_warned;
+    
+    // HepMC3 ASCII event export
+    HepMCWriter* hepmc_writer;
+    double event_weight;   // Phase-space weight of the current event
+    
+    // Single-precision batched product generation (nullptr: double precision, event by event)
+    PhaseSpaceBatch<float>* float_batch;
+    template <typename Real> void DrawPhaseSpaceBatch(PhaseSpaceBatch<Real>& batch, int n_events);
+    double NextBatchedProducts();
+    
+    // Run constants read by the event loop (set by PrepareReaction)
+    shared_ptr<const PreparedReaction> prepared;
+    
+    // Random variates: from the bulk buffers if enabled, else straight from fRandom
+    BulkRandom* bulk_random;
+    int beam_table_points;  // Points of the tabulated beam-energy distribution (0: off)
+    double RandomUniform() { return bulk_random ? bulk_random->Rndm() : fRandom->Rndm(); }
+    double RandomGaus(double mean, double sigma) {
+        return bulk_random ? bulk_random->Gaus(mean, sigma) : fRandom->Gaus(mean, sigma);
+    }
+    double PhaseSpaceWeight(PhaseSpaceGenerator& generator) {
+        return bulk_random ? generator.Generate(bulk_random->Rndm(generator.NUniforms())) : generator.Generate(fRandom);
+    }
+    double DrawBeamEnergy();
+    void BuildBeamEnergyTable(vector<double>& table) const;
+    void SetProductKinematics(int i, double px, double py, double pz, double E, double T,
+                              double p, double theta_deg, double phi_deg);
+    
+    // Truth-level files: true kinematics of the current event to / from a block
+    void StoreTruth(TruthBlock& block);
+    void RestoreTruth(const TruthBlock& block, int& value_pos, int& tree_pos);
+    void TruthLayout(vector<int>& layout) const;
+    
+    // Response mode and detector acceptance (Lab frame, applied to the response product)
+    int response_product;            // Detected product (-1: response mode off)
+    vector<int> response_undetected; // Products forming the missing system
+    double response_reference_mass;  // Ground-state mass of the missing system
+    ResponseAccumulator response_acc;
+    double acceptance_theta_min, acceptance_theta_max;  // radians
+    double acceptance_E_threshold;                      // MeV
+    
+    // Early stopping: shared monitor, this reaction's index in it and the target histograms
+    ConvergenceMonitor* convergence;
+    int convergence_index;
+    vector<TH1*> convergence_his;
+    vector<StopSums> convergence_sums;
+    bool convergence_sparse;  // A target is a sparse histogram (refreshed before publishing)
+    
+    // Live monitoring: shared monitor, this reaction's index in it and the histograms it copies
+    LiveMonitor* live_monitor;
+    int live_index;
+    vector<TH1*> live_his;
     
-    // Decay product kinematics (for display)
-    vector<double> decay_energies;
-    vector<double> decay_momenta;
-    vector<double> decay_angles;
-    vector<double> decay_angles_lab;
+    // Checkpoints written by RunSimulation: file (empty: off), configuration hash and schedule
+    string checkpoint_file;
+    unsigned long long checkpoint_hash;
+    CheckpointSchedule checkpoint_schedule;
+    
+    // Histogram registry: standard histograms on/off and the declared observables with their
+    // compiled ops, particle lists and the current event's particles (products, then the
+    // distinct decay-product names)
+    bool standard_histograms;
+    vector<ObservableHistogram> observable_histograms;
+    vector<ObservableOp> observable_ops;
+    vector<int> observable_members;
+    vector<FourVector> observable_p4_true, observable_p4_meas;
+    vector<double> observable_rest_mass, observable_excitation;
+    vector<char> observable_present;
+    vector<int> observable_slot_particle;  // Observable particle of each decay slot
+    void CompileObservable(const string& expression, const vector<string>& particles);
+    bool EvaluateObservable(int first, int last, double& value) const;
+    
+    // Allocation check: heap allocations of SimulateEvent after warm-up and the events counted
+    bool check_allocations;
+    AllocationCounter allocation_counter;
+    long long event_allocations;
+    int counted_events;
+    bool sparse_settled;  // Sparse histograms settled after the warm-up events
     
     // Original parent particle energy (before decay)
     double original_parent_energy;
@@ -97,8 +778,9 @@ private:
     // Random number generator
     TRandom3* fRandom;
     
-    // Phase space generator
-    TGenPhaseSpace* fPhaseSpace;
+    // Phase space generators (reaction and decays)
+    PhaseSpaceGenerator* fPhaseSpace;
+    PhaseSpaceGenerator* fDecayPhaseSpace;
     
 public:
     // Histograms (public for drawing)
@@ -106,8 +788,7 @@ public:
     TH2F* his_beam_pos;
     vector<TH1D*> his_product_angle;
     vector<TH1D*> his_product_energy;
-    vector<TH2F*> his_product_Evsang;
-    vector<TH2F*> his_product_theta_E_lab;  // Lab frame theta vs energy
+    vector<SparseHist2D*> his_product_E_theta;  // Outputs Evsang and theta_E_lab (same fills)
     TH2F* his_multi_momentum;
     
     // Energy reconstruction histograms
@@ -119,8 +800,22 @@ public:
     // Decay histograms
     vector<TH1D*> his_decay_angle;
     vector<TH1D*> his_decay_energy;
-    vector<TH2F*> his_decay_Evsang;
-    vector<TH2F*> his_decay_theta_E_lab;
+    vector<SparseHist2D*> his_decay_E_theta;    // Outputs Evsang and theta_E_lab (same fills)
+    vector<TH1D*> his_decay_node_channel;  // Channel taken per decay node
+    
+    // Invariant-mass histograms (one per combinatorics subset)
+    vector<TH1D*> his_invariant_mass;
+    
+    // Kinematic fit histograms
+    TH1D* his_fit_chi2;
+    TH1D* his_fit_probability;
+    TH1D* his_fit_beam_energy_difference;
+    TH1D* his_fit_parent_mass;
+    TH1D* his_fit_parent_mass_difference;
+    vector<TH1D*> his_fit_product_theta_difference;
+    vector<TH1D*> his_fit_product_energy_difference;
+    vector<TH1D*> his_fit_decay_theta_difference;
+    vector<TH1D*> his_fit_decay_energy_difference;
     
     // Parent particle reconstruction histograms
     TH1D* his_parent_energy_reconstructed;
@@ -140,13 +835,6 @@ public:
     TH1D* his_product1_energy_actual;
     TH1D* his_product1_energy_difference;
     
-    TH1D* his_product2_mass_reconstructed;
-    TH1D* his_product2_mass_actual;
-    TH1D* his_product2_mass_difference;
-    TH1D* his_product2_energy_reconstructed;
-    TH1D* his_product2_energy_actual;
-    TH1D* his_product2_energy_difference;
-    
     // Constructor and Destructor
     FusionReaction();
     ~FusionReaction();
@@ -165,8 +853,11 @@ public:
     
     // Decay configuration
     void EnableDecay(int product_index);
-    void AddDecayProduct(int A, int Z, const string& name);
+    void AddDecayProduct(int A, int Z, const string& name, double excitation_energy = 0.0);
     void DisableDecay();
+    int AddDecayNode(const string& parent_name);
+    int AddDecayChannel(int node_index, double branching);
+    void CheckDecayConservation();
     
     // Reconstruction control
     void EnableEnergyReconstruction(bool enable = true);
@@ -179,35 +870,136 @@ public:
     void SelectProductsForReconstruction(const string& product1_name, const string& product2_name);
     void SetParentParticleInfo(int A, int Z, const string& name);
     
+    // Missing-mass reconstruction
+    void AddMissingMassSet(const vector<string>& detected_names);
+    void SetMissingMassBeam(bool per_event);
+    
+    // Invariant-mass combinatorics
+    void EnableInvariantMassPairs(bool enable = true);
+    void AddInvariantMassSubset(const vector<string>& names);
+    void BuildInvariantMassSubsets();
+    vector<int> DecaySlotsNamed(const string& name, const string& context) const;
+    
+    // Kinematic fit
+    void EnableKinematicFit(bool enable = true);
+    
+    // Histogram registry: observables declared as expressions (1D or 2D, optional cut), and
+    // the standard beam/product/decay histograms
+    void AddObservableHistogram(const string& name, const string& x_expression, int nx, double x_min, double x_max,
+                                const string& cut = "");
+    void AddObservableHistogram(const string& name, const string& x_expression, int nx, double x_min, double x_max,
+                                const string& y_expression, int ny, double y_min, double y_max, const string& cut = "");
+    void EnableStandardHistograms(bool enable = true);
+    
+    // Response matrices and acceptance
+    void EnableResponse(const string& detected_name);
+    void EnableHepMCExport(const char* filename);
+    void SetResponseBinning(int n_Ex, double Ex_min, double Ex_max, int n_theta);
+    void SetAcceptance(double theta_min_deg, double theta_max_deg, double E_threshold = 0.0);
+    bool InAcceptance(const FourVector& p4, double mass) const;
+    const ResponseAccumulator* GetResponse() const { return response_product >= 0 ? &response_acc : nullptr; }
+    
+    // Single-precision batched product generation
+    void EnableFloatBatch(bool enable = true);
+    bool ValidateFloatBatch(int n_events);
+    
+    // Bulk random variates and the tabulated beam-energy distribution
+    void EnableBulkRandom(bool enable = true);
+    void SetBeamEnergyTable(int n_points);
+    
+    // Early stopping on the statistical precision of histogram observables
+    void SetConvergenceMonitor(ConvergenceMonitor* monitor, int index);
+    bool PublishConvergence(int events_done, int events_planned);
+    
+    // Live histogram snapshots for the monitoring server
+    void SetLiveMonitor(LiveMonitor* monitor, int index);
+    void PublishSnapshot(int events_done, int events_planned, bool force = false) {
+        if (!force && !live_monitor->Due(live_index)) return;
+        RefreshSparseHistograms();
+        live_monitor->Offer(live_index, live_his, events_done, events_planned, force);
+    }
+    
+    // Steady-state event loop without heap allocations (checked after warm-up; needs an
+    // allocation counter). ReportAllocations() prints the count and returns false if there were any.
+    void EnableAllocationCheck(bool enable = true);
+    bool ReportAllocations() const;
+    
+    // Checkpoint and resume: the complete run state to / from a file
+    void SetCheckpoint(const string& filename, unsigned long long config_hash, const CheckpointSchedule& schedule);
+    int ResumeCheckpoint();
+    bool Checkpointable() const { return !hepmc_writer; }  // HepMC files cannot be resumed
+    void WriteState(FILE* file);
+    bool ReadState(FILE* file);
+    
     // Mass and Histogram functions
     void InitializeHistograms();
     void ReadMassFile(const char* filename);
+    void SetMasses(const MassTable& table);
+    void SetSeed(unsigned int seed);
+    void PrepareReaction();
+    shared_ptr<const PreparedReaction> GetPreparedReaction() const { return prepared; }
     
     // Multi-body kinematics
     double CalculateQValue();
+    double DrawExcitation(int i);
     double GeneratePhaseSpace();
+    double GenerateProducts();
+    void MeasureProducts();
     void CalculateProductKinematics();
-    void TransformToLabFrame();
     
     // Particle information display
     void PrintEventInfo(int event_num);
     void PrintProductSummary();
     void PrintDecayInfo(int event_num);
     bool CheckEnergyConservation();
+    void UpdateEventSums(bool need_final, bool need_decay);
+    void ReconstructEvent();
     void ReconstructEnergy();
     void ReconstructParentEnergy();
     void ReconstructParentMass();
     void ReconstructProductProperties();
+    void AccumulateMissingMass();
+    void FlushMissingMass();
+    void ReconstructInvariantMasses();
+    void FillObservables();
+    void AccumulateKinematicFit();
+    void FlushKinematicFit();
+    void FillResponse();
+    void WriteResponse();
+    void ExportEvent(int event, double tar_x, double tar_y);
     
     // Main simulation functions
-    void RunSimulation(int n_events, bool verbose = false);
+    int RunSimulation(int n_events, bool verbose = false, int first_event = 0);
+    void SimulateEvent(int event, bool verbose = false);
+    void CompleteEvent(int event, bool verbose = false);
+    void FinishSimulation();
     void SaveResults(const char* filename);
+    void WriteResults();
+    void CollectHistograms(vector<TH1*>& out, bool with_sparse = true);
+    void RefreshSparseHistograms();
+    void SettleSparseHistograms();
     void DrawResults();
     bool CheckConservation();
     
+    // Truth-level stages: generate and save unsmeared events, then replay them with the
+    // current resolutions and reconstruction settings
+    void GenerateTruth(int n_events, const char* filename);
+    void ReplayTruth(const char* filename, bool verbose = false);
+    
     // Decay simulation functions
-    void SimulateDecay();
+    double SimulateDecay(bool measure = true);
+    bool DecayEntry(int entry_index, bool measure, double& weight);
+    void MeasureDecayProducts(int entry_index, int node_index);
+    
+    // Event generator API: true final-state events into caller-owned buffers, without
+    // histograms, console output or allocation
+    int MaxFinalStateParticles() const;
+    int GenerateEvents(int n_events, EventBuffers& buffers);
     void InitializeDecayHistograms();
+    void InitializeMissingMassHistograms();
+    void InitializeInvariantMassHistograms();
+    void InitializeFitHistograms();
+    void InitializeObservableHistograms();
     void AutoAdjustHistogramRanges();
 };
 
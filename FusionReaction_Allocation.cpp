@@ -0,0 +1,25 @@
+#include "FusionReaction.h"
+
+// Allocation counter installed by the check program (nullptr: none)
+static AllocationCounter installed_counter = nullptr;
+
+void SetAllocationCounter(AllocationCounter counter) {
+    installed_counter = counter;
+}
+
+// Count heap allocations of SimulateEvent after the first kAllocationWarmupEvents events
+void FusionReaction::EnableAllocationCheck(bool enable) {
+    if (enable && !installed_counter) {
+        cout << "ERROR: The allocation check needs an allocation counter (SetAllocationCounter)!" << endl;
+        exit(1);
+    }
+    check_allocations = enable;
+    allocation_counter = installed_counter;
+    event_allocations = 0;
+    counted_events = 0;
+}
+
+bool FusionReaction::ReportAllocations() const {
+    cout << "Heap allocations after warm-up: " << event_allocations << " in " << counted_events << " events" << endl;
+    return event_allocations == 0;
+}
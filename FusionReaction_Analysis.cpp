@@ -1,44 +1,221 @@
 #include "FusionReaction.h"
 
-// Check energy conservation
-bool FusionReaction::CheckEnergyConservation() {
-    // Use Invariant mass for both initial and final
-    // This is frame-independent and should be conserved
-    double E_beam_used = E_beam_current;
+// Compute the per-event 4-vector sums that are still missing
+// Each sum is built once per event and shared by every observable using it
+void FusionReaction::UpdateEventSums(bool need_final, bool need_decay) {
+    if (need_final && !event_sums.final_valid) {
+        // Initial invariant mass (CM total energy) from the event beam energy
+        event_sums.W_initial = prepared->SqrtS(E_beam_current);
+        
+        // Final state: sum of all product 4-momenta (Lab frame)
+        double E = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+        for (int i = 0; i < products.size(); i++) {
+            E += product_kin.energy[i] + products[i].mass;
+            px += product_p4_true[i].px;
+            py += product_p4_true[i].py;
+            pz += product_p4_true[i].pz;
+        }
+        
+        double p2 = px * px + py * py + pz * pz;
+        event_sums.final_E = E;
+        event_sums.final_p = sqrt(p2);
+        event_sums.W_final = sqrt(E * E - p2);
+        event_sums.final_valid = true;
+    }
     
-    // Calculate Initial Invariant mass (CM total energy)
-    double E_total_lab = E_beam_used + M_beam + M_target;
-    double p_beam_lab = sqrt(E_beam_used * (E_beam_used + 2 * M_beam));
-    double s = E_total_lab * E_total_lab - p_beam_lab * p_beam_lab;
-    double W_initial = sqrt(s);
+    if (need_decay && !event_sums.decay_valid) {
+        event_sums.decay_valid = true;
+        event_sums.decay_present = false;
+        if (!decay_enabled || decay_product_index < 0) return;
+        
+        // Decay of the selected parent in this event (products are the first tree entries)
+        const DecayTreeEntry& parent_entry = decay_tree[decay_product_index];
+        if (parent_entry.channel < 0) return;
+        
+        // Sum measured (resolution-applied) decay product 4-momenta
+        double E = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+        for (int k = 0; k < parent_entry.n_daughters; k++) {
+            const FourVector& p4 = decay_p4_meas[decay_tree[parent_entry.first_daughter + k].slot];
+            E += p4.E;
+            px += p4.px;
+            py += p4.py;
+            pz += p4.pz;
+        }
+        
+        event_sums.decay_E = E;
+        event_sums.decay_mass = sqrt(E * E - (px * px + py * py + pz * pz));
+        event_sums.decay_present = true;
+    }
+}
+
+// Reconstruct all enabled observables in a single pass over the event
+void FusionReaction::ReconstructEvent() {
+    bool need_decay = enable_energy_reconstruction || enable_mass_reconstruction;
+    UpdateEventSums(enable_total_energy_reconstruction, need_decay);
     
-    // Calculate Final Invariant mass (CM total energy)
-    // Sum all 4-momenta in Lab frame, then calculate invariant mass
-    double E_total_final = 0;
-    double px_total_final = 0;
-    double py_total_final = 0;
-    double pz_total_final = 0;
+    if (enable_total_energy_reconstruction) {
+        ReconstructEnergy();
+    }
+    if (enable_energy_reconstruction) {
+        ReconstructParentEnergy();
+    }
+    if (enable_mass_reconstruction) {
+        ReconstructParentMass();
+    }
+    if (enable_product_reconstruction) {
+        ReconstructProductProperties();
+    }
+    if (!missing_mass_sets.empty()) {
+        AccumulateMissingMass();
+    }
+    if (!his_invariant_mass.empty()) {
+        ReconstructInvariantMasses();
+    }
+    if (enable_kinematic_fit) {
+        AccumulateKinematicFit();
+    }
+    if (response_product >= 0) {
+        FillResponse();
+    }
+    if (!observable_histograms.empty()) {
+        FillObservables();
+    }
+}
+
+// Invariant mass of every combinatorics subset from the measured 4-vectors
+void FusionReaction::ReconstructInvariantMasses() {
+    int n_products = products.size();
+    
+    // Gather this event's particles: products always, decay products only if produced
+    for (int i = 0; i < n_products; i++) {
+        combo_p4[i] = product_p4_meas[i];
+        combo_present[i] = 1;
+    }
+    for (int i = n_products; i < combo_present.size(); i++) {
+        combo_present[i] = 0;
+    }
+    if (decay_enabled) {
+        for (int e = 0; e < n_decay_tree; e++) {
+            int slot = decay_tree[e].slot;
+            if (slot < 0) continue;
+            combo_p4[n_products + slot] = decay_p4_meas[slot];
+            combo_present[n_products + slot] = 1;
+            int alias = combo_slot_alias[slot];
+            if (alias >= 0) {
+                combo_p4[alias] = decay_p4_meas[slot];
+                combo_present[alias] = 1;
+            }
+        }
+    }
     
-    for (int i = 0; i < products.size(); i++) {
-        double E_product = products[i].energy + products[i].mass; // Total energy in Lab frame (already calculated)
+    int n_subsets = his_invariant_mass.size();
+    for (int s = 0; s < n_subsets; s++) {
+        double E = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+        bool present = true;
+        for (int k = combo_offset[s]; k < combo_offset[s + 1]; k++) {
+            int particle = combo_members[k];
+            const FourVector& v = combo_p4[particle];
+            present = present && combo_present[particle];
+            E += v.E;
+            px += v.px;
+            py += v.py;
+            pz += v.pz;
+        }
+        if (!present) continue;
         
-        // Use Lab frame momentum components (already calculated in CalculateProductKinematics)
-        double px = products[i].px;
-        double py = products[i].py;
-        double pz = products[i].pz;
+        his_invariant_mass[s]->Fill(sqrt(E * E - px * px - py * py - pz * pz));
+    }
+}
+
+// Missing mass of a block of events. Plain arrays and no branches so the loop vectorises;
+// an unphysical (negative) mass squared gives a negative signed mass instead of NaN.
+static void MissingMassKernel(int n, const double* beam_T, const double* E, const double* px,
+                              const double* py, const double* pz, double M_beam, double M0,
+                              double reference_mass, double Q_offset,
+                              double* mass, double* Ex, double* Q) {
+    #pragma omp simd
+    for (int k = 0; k < n; k++) {
+        double E_miss = beam_T[k] + M0 - E[k];
+        double pz_miss = sqrt(beam_T[k] * (beam_T[k] + 2.0 * M_beam)) - pz[k];
+        double m2 = E_miss * E_miss - px[k] * px[k] - py[k] * py[k] - pz_miss * pz_miss;
+        double m = copysign(sqrt(fabs(m2)), m2);
+        mass[k] = m;
+        Ex[k] = m - reference_mass;
+        Q[k] = Q_offset - m;
+    }
+}
+
+// Buffer the measured detected-product sums of this event for every missing-mass set
+void FusionReaction::AccumulateMissingMass() {
+    // Nominal beam: mean energy at mid-target
+    double beam_T = missing_mass_event_beam ? E_beam_current : prepared->nominal_beam_T;
+    
+    for (int s = 0; s < missing_mass_sets.size(); s++) {
+        MissingMassSet& set = missing_mass_sets[s];
+        int k = set.n_block;
         
-        E_total_final += E_product;
-        px_total_final += px;
-        py_total_final += py;
-        pz_total_final += pz;
+        double E = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+        for (int n = 0; n < set.detected.size(); n++) {
+            const FourVector& v = product_p4_meas[set.detected[n]];
+            E += v.E;
+            px += v.px;
+            py += v.py;
+            pz += v.pz;
+        }
+        set.beam_T[k] = beam_T;
+        set.E[k] = E;
+        set.px[k] = px;
+        set.py[k] = py;
+        set.pz[k] = pz;
+        
+        // True invariant mass of the missing system
+        double tE = 0.0, tpx = 0.0, tpy = 0.0, tpz = 0.0;
+        for (int n = 0; n < set.undetected.size(); n++) {
+            const FourVector& v = product_p4_true[set.undetected[n]];
+            tE += v.E;
+            tpx += v.px;
+            tpy += v.py;
+            tpz += v.pz;
+        }
+        set.Ex_true[k] = sqrt(tE * tE - tpx * tpx - tpy * tpy - tpz * tpz) - set.reference_mass;
+        
+        set.n_block = k + 1;
     }
     
-    // Calculate invariant mass of final state
-    double s_final = E_total_final * E_total_final - 
-                     (px_total_final * px_total_final + 
-                      py_total_final * py_total_final + 
-                      pz_total_final * pz_total_final);
-    double W_final = sqrt(s_final);
+    // All sets fill in step; run the kernel once the block is full
+    if (missing_mass_sets[0].n_block == kEventBlockSize) {
+        FlushMissingMass();
+    }
+}
+
+// Run the missing-mass kernel on the buffered events and fill the histograms
+void FusionReaction::FlushMissingMass() {
+    for (int s = 0; s < missing_mass_sets.size(); s++) {
+        MissingMassSet& set = missing_mass_sets[s];
+        int n = set.n_block;
+        if (n == 0) continue;
+        
+        MissingMassKernel(n, &set.beam_T[0], &set.E[0], &set.px[0], &set.py[0], &set.pz[0],
+                          prepared->M_beam, prepared->M0, set.reference_mass, prepared->missing_mass_Q_offset[s],
+                          &set.mass[0], &set.Ex[0], &set.Q[0]);
+        
+        for (int k = 0; k < n; k++) {
+            set.his_mass->Fill(set.mass[k]);
+            set.his_Ex->Fill(set.Ex[k]);
+            set.his_Q->Fill(set.Q[k]);
+            set.his_Ex_difference->Fill(set.Ex[k] - set.Ex_true[k]);
+        }
+        set.n_block = 0;
+    }
+}
+
+// Check energy conservation
+bool FusionReaction::CheckEnergyConservation() {
+    // Use Invariant mass for both initial and final
+    // This is frame-independent and should be conserved
+    UpdateEventSums(true, false);
+    double W_initial = event_sums.W_initial;
+    double W_final = event_sums.W_final;
     
     double energy_diff = abs(W_initial - W_final);
     double tolerance = 5.0; // MeV (allow for numerical precision)
@@ -52,36 +229,13 @@ bool FusionReaction::CheckEnergyConservation() {
     return true;
 }
 
-// Reconstruct energy for analysis
+// Reconstruct energy for analysis (uses the cached final-state sum)
 void FusionReaction::ReconstructEnergy() {
-    // Use Invariant mass (frame-independent)
-    double E_beam_used = E_beam_current;
-    
-    // Calculate Invariant mass (CM total energy)
-    double E_total_lab = E_beam_used + M_beam + M_target;
-    double p_beam_lab = sqrt(E_beam_used * (E_beam_used + 2 * M_beam));
-    double s = E_total_lab * E_total_lab - p_beam_lab * p_beam_lab;
-    double E_total_initial = sqrt(s);  // Invariant mass
-    
-    // Final state: calculate invariant mass from all product 4-momenta
-    double E_total_final = 0;
-    double total_px = 0, total_py = 0, total_pz = 0;
-    
-    for (int i = 0; i < products.size(); i++) {
-        double product_total_E = products[i].energy + products[i].mass;
-        E_total_final += product_total_E;
-        total_px += products[i].px;
-        total_py += products[i].py;
-        total_pz += products[i].pz;
-    }
-    
-    // Calculate invariant mass of final state
-    double s_final = E_total_final * E_total_final - 
-                     (total_px * total_px + total_py * total_py + total_pz * total_pz);
-    double E_total_final_invariant = sqrt(s_final);
+    UpdateEventSums(true, false);
     
-    // Calculate total momentum magnitude
-    double total_momentum = sqrt(total_px * total_px + total_py * total_py + total_pz * total_pz);
+    // Invariant masses (frame-independent)
+    double E_total_initial = event_sums.W_initial;
+    double E_total_final_invariant = event_sums.W_final;
     
     // Calculate energy difference (invariant masses)
     double energy_diff = E_total_initial - E_total_final_invariant;
@@ -90,51 +244,16 @@ void FusionReaction::ReconstructEnergy() {
     his_total_energy_initial->Fill(E_total_initial / 1000.0);  // Convert to GeV for display
     his_total_energy_final->Fill(E_total_final_invariant / 1000.0);  // Convert to GeV for display
     his_energy_difference->Fill(energy_diff);                   // Keep in MeV
-    his_total_momentum_mag->Fill(total_momentum / 1000.0);     // Convert to GeV/c for display
+    his_total_momentum_mag->Fill(event_sums.final_p / 1000.0);  // Convert to GeV/c for display
 }
 
+// Reconstruct parent particle energy from the cached decay product sum
 void FusionReaction::ReconstructParentEnergy() {
-    if (!decay_enabled || decay_momenta.empty()) return;
-    
-    // Reconstruct parent particle energy from decay products
-    // Method: Sum all decay product 4-momenta to get parent 4-momentum
-    
-    double parent_px = 0.0, parent_py = 0.0, parent_pz = 0.0;
-    double parent_E_total = 0.0;
-    
-    // Sum decay product momenta and energies
-    for (int i = 0; i < decay_momenta.size(); i++) {
-        // Get decay product momentum magnitude
-        double p_decay = decay_momenta[i];
-        
-        // Get decay product energy (kinetic + rest mass)
-        double E_decay_kinetic = decay_energies[i];
-        double E_decay_total = E_decay_kinetic + decay_masses[i];
-        
-        // Get decay product angles (use CM frame angles for momentum direction)
-        double theta_decay = decay_angles[i] * TMath::Pi() / 180.0;
-        double phi_decay = 0.0; // Assume phi = 0 for simplicity
-        
-        // Calculate momentum components
-        double px_decay = p_decay * sin(theta_decay) * cos(phi_decay);
-        double py_decay = p_decay * sin(theta_decay) * sin(phi_decay);
-        double pz_decay = p_decay * cos(theta_decay);
-        
-        // Sum to get parent momentum
-        parent_px += px_decay;
-        parent_py += py_decay;
-        parent_pz += pz_decay;
-        parent_E_total += E_decay_total;
-    }
-    
-    // Calculate parent particle momentum magnitude
-    double parent_p_mag = sqrt(parent_px*parent_px + parent_py*parent_py + parent_pz*parent_pz);
-    
-    // Calculate parent particle invariant mass (rest mass)
-    double parent_invariant_mass = sqrt(parent_E_total*parent_E_total - parent_p_mag*parent_p_mag);
+    UpdateEventSums(false, true);
+    if (!event_sums.decay_present) return;
     
     // Calculate parent particle kinetic energy
-    double parent_kinetic_energy = parent_E_total - parent_invariant_mass;
+    double parent_kinetic_energy = event_sums.decay_E - event_sums.decay_mass;
     
     // Get actual parent particle energy for comparison (original energy before decay)
     double actual_parent_energy = original_parent_energy;
@@ -145,45 +264,13 @@ void FusionReaction::ReconstructParentEnergy() {
     his_parent_energy_difference->Fill(actual_parent_energy - parent_kinetic_energy);
 }
 
+// Reconstruct parent particle mass from the cached decay product sum
 void FusionReaction::ReconstructParentMass() {
-    if (!decay_enabled || decay_momenta.empty()) return;
-    
-    // Reconstruct parent particle mass from decay products
-    // Method: Calculate invariant mass from decay product 4-momenta
+    UpdateEventSums(false, true);
+    if (!event_sums.decay_present) return;
     
-    double parent_px = 0.0, parent_py = 0.0, parent_pz = 0.0;
-    double parent_E_total = 0.0;
-    
-    // Sum decay product momenta and energies
-    for (int i = 0; i < decay_momenta.size(); i++) {
-        // Get decay product momentum magnitude
-        double p_decay = decay_momenta[i];
-        
-        // Get decay product energy (kinetic + rest mass)
-        double E_decay_kinetic = decay_energies[i];
-        double E_decay_total = E_decay_kinetic + decay_masses[i];
-        
-        // Get decay product angles (use CM frame angles for momentum direction)
-        double theta_decay = decay_angles[i] * TMath::Pi() / 180.0;
-        double phi_decay = 0.0; // Assume phi = 0 for simplicity
-        
-        // Calculate momentum components
-        double px_decay = p_decay * sin(theta_decay) * cos(phi_decay);
-        double py_decay = p_decay * sin(theta_decay) * sin(phi_decay);
-        double pz_decay = p_decay * cos(theta_decay);
-        
-        // Sum to get parent momentum
-        parent_px += px_decay;
-        parent_py += py_decay;
-        parent_pz += pz_decay;
-        parent_E_total += E_decay_total;
-    }
-    
-    // Calculate parent particle momentum magnitude
-    double parent_p_mag = sqrt(parent_px*parent_px + parent_py*parent_py + parent_pz*parent_pz);
-    
-    // Calculate parent particle invariant mass (rest mass)
-    double parent_mass_reconstructed = sqrt(parent_E_total*parent_E_total - parent_p_mag*parent_p_mag);
+    // Parent particle invariant mass (rest mass)
+    double parent_mass_reconstructed = event_sums.decay_mass;
     
     // Get actual parent particle mass for comparison
     double actual_parent_mass = 0.0;
@@ -201,57 +288,33 @@ void FusionReaction::ReconstructProductProperties() {
     if (!enable_product_reconstruction || selected_product1 < 0 || selected_product2 < 0) return;
     
     // Check if histograms are initialized
-    if (!his_product1_mass_reconstructed || !his_product2_mass_reconstructed) return;
+    if (!his_product1_mass_reconstructed) return;
     
     // Reconstruct parent particle from two selected products (like decay reconstruction)
     // Method: Sum 4-momenta of two products to get parent particle properties
     
     if (selected_product1 >= products.size() || selected_product2 >= products.size()) return;
     
-    Particle& p1 = products[selected_product1];
-    Particle& p2 = products[selected_product2];
-    
-    // Get measured values (with experimental resolution) - use Lab frame
-    double p1_measured = p1.momentum_lab;
-    double E1_measured = p1.energy_lab;
-    double p2_measured = p2.momentum_lab;
-    double E2_measured = p2.energy_lab;
-    
-    // Get angles for momentum components - use Lab frame angles
-    double theta1 = p1.theta_lab;
-    double phi1 = p1.phi;
-    double theta2 = p2.theta_lab;
-    double phi2 = p2.phi;
-    
-    // Calculate momentum components for both products (Lab frame)
-    double p1x = p1.px_lab;  // Use pre-calculated Lab frame momentum components
-    double p1y = p1.py_lab;
-    double p1z = p1.pz_lab;
-    
-    double p2x = p2.px_lab;
-    double p2y = p2.py_lab;
-    double p2z = p2.pz_lab;
+    // Measured 4-vectors (with experimental resolution) from the event record - Lab frame
+    const FourVector& v1 = product_p4_meas[selected_product1];
+    const FourVector& v2 = product_p4_meas[selected_product2];
     
     // Sum 4-momenta to get parent particle
-    double parent_px = p1x + p2x;
-    double parent_py = p1y + p2y;
-    double parent_pz = p1z + p2z;
-    double parent_p_mag = sqrt(parent_px*parent_px + parent_py*parent_py + parent_pz*parent_pz);
-    
-    // Total energy = kinetic energy + rest mass for each product
-    double E1_total = E1_measured + p1.mass;
-    double E2_total = E2_measured + p2.mass;
-    double parent_E_total = E1_total + E2_total;
+    double parent_px = v1.px + v2.px;
+    double parent_py = v1.py + v2.py;
+    double parent_pz = v1.pz + v2.pz;
+    double parent_E_total = v1.E + v2.E;
+    double parent_p2 = parent_px*parent_px + parent_py*parent_py + parent_pz*parent_pz;
     
     // Calculate parent particle invariant mass (rest mass)
-    double parent_mass_reconstructed = sqrt(parent_E_total*parent_E_total - parent_p_mag*parent_p_mag);
+    double parent_mass_reconstructed = sqrt(parent_E_total*parent_E_total - parent_p2);
     
     // Calculate parent particle kinetic energy
     double parent_kinetic_energy_reconstructed = parent_E_total - parent_mass_reconstructed;
     
     // Get actual parent particle properties (from mass file)
     double parent_mass_actual = parent_mass;  // Actual parent mass from mass file
-    double parent_kinetic_energy_actual = p1.energy_lab + p2.energy_lab;  // Sum of kinetic energies
+    double parent_kinetic_energy_actual = product_kin.energy[selected_product1] + product_kin.energy[selected_product2];  // Sum of kinetic energies
     
     // Fill histograms
     his_product1_mass_reconstructed->Fill(parent_mass_reconstructed);
@@ -261,21 +324,12 @@ void FusionReaction::ReconstructProductProperties() {
     his_product1_energy_reconstructed->Fill(parent_kinetic_energy_reconstructed);
     his_product1_energy_actual->Fill(parent_kinetic_energy_actual);
     his_product1_energy_difference->Fill(parent_kinetic_energy_actual - parent_kinetic_energy_reconstructed);
-    
-    // Product 2 histograms are not used in this approach, but keep them for compatibility
-    his_product2_mass_reconstructed->Fill(0);  // Not used
-    his_product2_mass_actual->Fill(0);         // Not used
-    his_product2_mass_difference->Fill(0);     // Not used
-    
-    his_product2_energy_reconstructed->Fill(0);  // Not used
-    his_product2_energy_actual->Fill(0);         // Not used
-    his_product2_energy_difference->Fill(0);     // Not used
 }
 
 // Print event information
 void FusionReaction::PrintEventInfo(int event_num) {
     cout << "\n========== Event " << event_num << " ==========" << endl;
-    cout << "Q-value: " << fixed << setprecision(3) << CalculateQValue() << " MeV" << endl;
+    cout << "Q-value: " << fixed << setprecision(3) << prepared->Q_value << " MeV" << endl;
     cout << "Number of products: " << products.size() << endl;
     
     cout << "\nParticle Information (Lab frame):" << endl;
@@ -286,9 +340,9 @@ void FusionReaction::PrintEventInfo(int event_num) {
         cout << products[i].name << "\t\t" 
              << products[i].A << "\t" 
              << products[i].Z << "\t"
-             << fixed << setprecision(3) << products[i].energy << "\t\t"
-             << fixed << setprecision(1) << products[i].theta * 180.0 / TMath::Pi() << "\t\t"
-             << fixed << setprecision(3) << products[i].momentum << endl;
+             << fixed << setprecision(3) << product_kin.energy[i] << "\t\t"
+             << fixed << setprecision(1) << product_kin.theta[i] * 180.0 / TMath::Pi() << "\t\t"
+             << fixed << setprecision(3) << product_kin.momentum[i] << endl;
     }
 }
 
@@ -297,38 +351,41 @@ void FusionReaction::PrintDecayInfo(int event_num) {
     if (!decay_enabled) return;
     
     cout << "\n========== Decay Event " << event_num << " ==========" << endl;
+    cout << "Decay tree (Lab frame):" << endl;
+    cout << "Entry\tName\t\tA\tZ\tEx(MeV)\tE_Lab(MeV)\tParent\tChannel" << endl;
+    cout << "------------------------------------------------------------------------" << endl;
     
-    // Get the parent particle that will decay
-    Particle& parent = products[decay_product_index];
-    cout << "Parent particle: " << parent.name << " (A=" << parent.A << ", Z=" << parent.Z << ")" << endl;
-    cout << "Parent energy (Lab): " << fixed << setprecision(3) << parent.energy << " MeV" << endl;
-    cout << "Parent momentum (Lab): " << fixed << setprecision(3) << parent.momentum << " MeV/c" << endl;
-    cout << "Parent angle (Lab): " << fixed << setprecision(1) << parent.theta * 180.0 / TMath::Pi() << " deg" << endl;
-    
-    // Calculate decay Q-value
-    double Q_decay = parent.mass;
-    for (int i = 0; i < decay_A.size(); i++) {
-        Q_decay -= decay_masses[i];
+    for (int e = 0; e < n_decay_tree; e++) {
+        const DecayTreeEntry& entry = decay_tree[e];
+        bool is_product = (entry.product >= 0);
+        cout << e << "\t"
+             << (is_product ? products[entry.product].name : decay_names[entry.slot]) << "\t\t"
+             << (is_product ? products[entry.product].A : decay_A[entry.slot]) << "\t"
+             << (is_product ? products[entry.product].Z : decay_Z[entry.slot]) << "\t"
+             << fixed << setprecision(3) << entry.excitation_energy << "\t"
+             << fixed << setprecision(3) << KineticEnergy(is_product ? product_p4_true[entry.product] : decay_p4_true[entry.slot], entry.mass + entry.excitation_energy) << "\t\t"
+             << entry.parent << "\t"
+             << entry.channel << endl;
     }
-    cout << "Decay Q-value: " << fixed << setprecision(3) << Q_decay << " MeV" << endl;
     
-    cout << "\nDecay products (Lab frame):" << endl;
+    // Measured (resolution-applied) decay product kinematics
+    cout << "\nDecay products (Lab frame, with resolution):" << endl;
     cout << "Name\t\tA\tZ\tMass(MeV)\tE_Lab(MeV)\tP_Lab(MeV/c)\tTheta_Lab(deg)" << endl;
     cout << "------------------------------------------------------------------------" << endl;
     
-    for (int i = 0; i < decay_A.size(); i++) {
+    for (int e = 0; e < n_decay_tree; e++) {
+        int i = decay_tree[e].slot;
+        if (i < 0) continue;
+        const FourVector& p4 = decay_p4_meas[i];
+        double p_meas = sqrt(p4.px * p4.px + p4.py * p4.py + p4.pz * p4.pz);
         cout << decay_names[i] << "\t\t" 
              << decay_A[i] << "\t" 
              << decay_Z[i] << "\t"
              << fixed << setprecision(1) << decay_masses[i] << "\t\t"
-             << fixed << setprecision(3) << decay_energies[i] << "\t\t"
-             << fixed << setprecision(3) << decay_momenta[i] << "\t\t"
-             << fixed << setprecision(1) << decay_angles_lab[i] << endl;
+             << fixed << setprecision(3) << KineticEnergy(p4, decay_masses[i] + decay_excitation[i]) << "\t\t"
+             << fixed << setprecision(3) << p_meas << "\t\t"
+             << fixed << setprecision(1) << acos(p4.pz / p_meas) * 180.0 / TMath::Pi() << endl;
     }
-    
-    // Calculate and show CM frame energies for comparison
-    cout << "\nNote: Lab frame energies include parent's kinetic energy (27.877 MeV)" << endl;
-    cout << "CM frame relative energies should be much smaller (~Q-value = " << fixed << setprecision(3) << Q_decay << " MeV)" << endl;
 }
 
 // Print product summary
@@ -345,136 +402,223 @@ void FusionReaction::PrintProductSummary() {
     }
 }
 
-// Run simulation
-void FusionReaction::RunSimulation(int n_events, bool verbose) {
+// Run simulation; with a convergence monitor, stops early once its targets are met.
+// Returns the number of events simulated.
+int FusionReaction::RunSimulation(int n_events, bool verbose, int first_event) {
+    if (!prepared) {
+        cout << "ERROR: InitializeHistograms() must be called before RunSimulation()!" << endl;
+        exit(1);
+    }
     cout << "Starting fusion reaction simulation..." << endl;
     PrintProductSummary();
     cout << "Number of events: " << n_events << endl;
+    cout << "Vector kernels: " << VectorISA() << endl;
     
-    for (int event = 0; event < n_events; event++) {
+    // first_event > 0: resumed from a checkpoint
+    int event = first_event;
+    while (event < n_events) {
         if (event % 10000 == 0) {
             cout << "Processing event " << event << endl;
         }
+        SimulateEvent(event, verbose);
+        event++;
         
-        CalculateProductKinematics();
-        
-        // Check energy conservation
-        if (verbose && event < 3) {
-            bool energy_ok = CheckEnergyConservation();
-            if (!energy_ok) {
-                cout << "Event " << event << " failed energy conservation!" << endl;
-            }
-        }
-        
-        // Lab frame already calculated in CalculateProductKinematics
-        // TransformToLabFrame();  // No longer needed
-        
-        // Simulate decay if enabled
-        if (decay_enabled) {
-            SimulateDecay();
-        }
-        
-        // Reconstruct total energy (if enabled)
-        if (enable_total_energy_reconstruction) {
-            ReconstructEnergy();
-        }
-        
-        // Reconstruct parent energy from decay products (if enabled)
-        if (enable_energy_reconstruction) {
-            ReconstructParentEnergy();
-        }
-        
-        // Reconstruct parent mass from decay products (if enabled)
-        if (enable_mass_reconstruction) {
-            ReconstructParentMass();
+        if (!checkpoint_file.empty() && checkpoint_schedule.Due(event)) {
+            WriteCheckpoint(checkpoint_file, checkpoint_hash, vector<FusionReaction*>(1, this), vector<int>(1, event), nullptr);
         }
-        
-        // Reconstruct product properties (if enabled)
-        if (enable_product_reconstruction) {
-            ReconstructProductProperties();
+        if (live_monitor && event % kEventBlockSize == 0) PublishSnapshot(event, n_events);
+        if (convergence && event % kEventBlockSize == 0 && PublishConvergence(event, n_events)) break;
+    }
+    
+    FinishSimulation();
+    if (live_monitor) PublishSnapshot(event, n_events, true);
+    cout << "Simulation completed!" << endl;
+    if (convergence) {
+        if (convergence->Converged()) cout << "Stop targets reached after " << event << " events" << endl;
+        else cout << "WARNING: Stop targets not reached within " << n_events << " events" << endl;
+        convergence->PrintStatus();
+    }
+    return event;
+}
+
+// Simulate and reconstruct one event
+void FusionReaction::SimulateEvent(int event, bool verbose) {
+    if (!sparse_settled && event >= kAllocationWarmupEvents) SettleSparseHistograms();
+    long long allocations = check_allocations ? allocation_counter() : 0;
+    
+    CalculateProductKinematics();
+    
+    // Simulate decay if enabled
+    if (decay_enabled) {
+        event_weight *= SimulateDecay();
+    }
+    
+    CompleteEvent(event, verbose);
+    
+    if (check_allocations && event >= kAllocationWarmupEvents) {
+        event_allocations += allocation_counter() - allocations;
+        counted_events++;
+    }
+}
+
+// Reconstruct the measured event, fill the beam histograms and export the event
+void FusionReaction::CompleteEvent(int event, bool verbose) {
+    // Reconstruct all enabled observables (one pass, shared 4-vector sums)
+    ReconstructEvent();
+    
+    // Check energy conservation (reuses the cached final-state sum)
+    if (verbose && event < 3) {
+        bool energy_ok = CheckEnergyConservation();
+        if (!energy_ok) {
+            cout << "Event " << event << " failed energy conservation!" << endl;
         }
-        
-        // Print detailed info for first 2 events if verbose
-        // if (verbose && event < 2) {
-        //     PrintEventInfo(event);
-        //     PrintDecayInfo(event);
-        // }
-        
-        // Fill beam histograms using the actual beam energy used in calculation
+    }
+    
+    // Print detailed info for first 2 events if verbose
+    // if (verbose && event < 2) {
+    //     PrintEventInfo(event);
+    //     PrintDecayInfo(event);
+    // }
+    
+    // Fill beam histograms using the actual beam energy used in calculation
+    double tar_x = RandomGaus(0, tar_res);
+    double tar_y = RandomGaus(0, tar_res);
+    if (standard_histograms) {
         his_beam_E->Fill(E_beam_current);
-        
-        double tar_x = fRandom->Gaus(0, tar_res);
-        double tar_y = fRandom->Gaus(0, tar_res);
         his_beam_pos->Fill(tar_x, tar_y);
     }
     
-    cout << "Simulation completed!" << endl;
+    if (hepmc_writer) ExportEvent(event, tar_x, tar_y);
+}
+
+// Process the last partial event blocks
+void FusionReaction::FinishSimulation() {
+    FlushMissingMass();
+    FlushKinematicFit();
+    if (hepmc_writer) hepmc_writer->Close();
 }
 
 // Save results to ROOT file
 void FusionReaction::SaveResults(const char* filename) {
     TFile* file = new TFile(filename, "recreate");
+    WriteResults();
+    file->Close();
+    cout << "Results saved to " << filename << endl;
+}
+
+// Write all histograms (and the response matrices) to the current directory
+void FusionReaction::WriteResults() {
+    vector<TH1*> histograms;
+    CollectHistograms(histograms);
+    for (int h = 0; h < histograms.size(); h++) {
+        histograms[h]->Write();
+    }
     
-    his_beam_E->Write();
-    his_beam_pos->Write();
-    his_multi_momentum->Write();
+    // Response matrix and efficiency maps
+    if (response_product >= 0) {
+        WriteResponse();
+    }
+}
+
+// Histograms that are saved, in output order; the sparse histograms are converted to
+// dense ones unless with_sparse is false (then they are left out)
+void FusionReaction::CollectHistograms(vector<TH1*>& out, bool with_sparse) {
+    if (standard_histograms) {
+        out.push_back(his_beam_E);
+        out.push_back(his_beam_pos);
+        out.push_back(his_multi_momentum);
+    }
     
-    // Write energy reconstruction histograms (if enabled)
+    // Energy reconstruction histograms (if enabled)
     if (enable_total_energy_reconstruction) {
-        his_total_energy_initial->Write();
-        his_total_energy_final->Write();
-        his_energy_difference->Write();
-        his_total_momentum_mag->Write();
+        out.push_back(his_total_energy_initial);
+        out.push_back(his_total_energy_final);
+        out.push_back(his_energy_difference);
+        out.push_back(his_total_momentum_mag);
     }
     
-    for (int i = 0; i < products.size(); i++) {
-        his_product_angle[i]->Write();
-        his_product_energy[i]->Write();
-        his_product_Evsang[i]->Write();
-        his_product_theta_E_lab[i]->Write();
+    for (int i = 0; i < his_product_angle.size(); i++) {
+        out.push_back(his_product_angle[i]);
+        out.push_back(his_product_energy[i]);
+        for (int k = 0; with_sparse && k < his_product_E_theta[i]->NumOutputs(); k++) {
+            out.push_back(his_product_E_theta[i]->Dense(k));
+        }
     }
     
-    // Write decay histograms (only if decay is enabled)
+    // Decay histograms (only if decay is enabled)
     if (decay_enabled) {
         for (int i = 0; i < his_decay_angle.size(); i++) {
-            his_decay_angle[i]->Write();
-            his_decay_energy[i]->Write();
-            his_decay_Evsang[i]->Write();
-            his_decay_theta_E_lab[i]->Write();
+            out.push_back(his_decay_angle[i]);
+            out.push_back(his_decay_energy[i]);
+            for (int k = 0; with_sparse && k < his_decay_E_theta[i]->NumOutputs(); k++) {
+                out.push_back(his_decay_E_theta[i]->Dense(k));
+            }
+        }
+        for (int n = 0; n < his_decay_node_channel.size(); n++) {
+            out.push_back(his_decay_node_channel[n]);
         }
     }
     
-    // Write parent reconstruction histograms
+    // Parent reconstruction histograms
     if (his_parent_energy_reconstructed) {
-        his_parent_energy_reconstructed->Write();
-        his_parent_energy_actual->Write();
-        his_parent_energy_difference->Write();
+        out.push_back(his_parent_energy_reconstructed);
+        out.push_back(his_parent_energy_actual);
+        out.push_back(his_parent_energy_difference);
     }
     
-    // Write parent mass reconstruction histograms
+    // Parent mass reconstruction histograms
     if (his_parent_mass_reconstructed) {
-        his_parent_mass_reconstructed->Write();
-        his_parent_mass_actual->Write();
-        his_parent_mass_difference->Write();
+        out.push_back(his_parent_mass_reconstructed);
+        out.push_back(his_parent_mass_actual);
+        out.push_back(his_parent_mass_difference);
     }
     
-    // Write product reconstruction histograms
+    // Product reconstruction histograms
     if (enable_product_reconstruction && his_product1_mass_reconstructed) {
-        his_product1_mass_reconstructed->Write();
-        his_product1_mass_actual->Write();
-        his_product1_mass_difference->Write();
-        his_product1_energy_reconstructed->Write();
-        his_product1_energy_actual->Write();
-        his_product1_energy_difference->Write();
-        
-        his_product2_mass_reconstructed->Write();
-        his_product2_mass_actual->Write();
-        his_product2_mass_difference->Write();
-        his_product2_energy_reconstructed->Write();
-        his_product2_energy_actual->Write();
-        his_product2_energy_difference->Write();
+        out.push_back(his_product1_mass_reconstructed);
+        out.push_back(his_product1_mass_actual);
+        out.push_back(his_product1_mass_difference);
+        out.push_back(his_product1_energy_reconstructed);
+        out.push_back(his_product1_energy_actual);
+        out.push_back(his_product1_energy_difference);
     }
     
-    file->Close();
-    cout << "Results saved to " << filename << endl;
+    // Invariant-mass histograms
+    for (int s = 0; s < his_invariant_mass.size(); s++) {
+        out.push_back(his_invariant_mass[s]);
+    }
+    
+    // Kinematic fit histograms
+    if (enable_kinematic_fit) {
+        out.push_back(his_fit_chi2);
+        out.push_back(his_fit_probability);
+        out.push_back(his_fit_beam_energy_difference);
+        if (decay_enabled) {
+            out.push_back(his_fit_parent_mass);
+            out.push_back(his_fit_parent_mass_difference);
+        }
+        for (int i = 0; i < products.size(); i++) {
+            out.push_back(his_fit_product_theta_difference[i]);
+            out.push_back(his_fit_product_energy_difference[i]);
+        }
+        for (int i = 0; i < his_fit_decay_theta_difference.size(); i++) {
+            out.push_back(his_fit_decay_theta_difference[i]);
+            out.push_back(his_fit_decay_energy_difference[i]);
+        }
+    }
+    
+    // Missing-mass histograms
+    for (int s = 0; s < missing_mass_sets.size(); s++) {
+        out.push_back(missing_mass_sets[s].his_mass);
+        out.push_back(missing_mass_sets[s].his_Ex);
+        out.push_back(missing_mass_sets[s].his_Q);
+        out.push_back(missing_mass_sets[s].his_Ex_difference);
+    }
+    
+    // Declared observable histograms
+    for (int h = 0; h < observable_histograms.size(); h++) {
+        ObservableHistogram& obs = observable_histograms[h];
+        if (obs.his_1d) out.push_back(obs.his_1d);
+        if (obs.his_2d) out.push_back(obs.his_2d);
+    }
 }
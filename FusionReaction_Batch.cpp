@@ -0,0 +1,316 @@
+#include "FusionReaction.h"
+#include <algorithm>
+
+// Two-body decay momentum a -> b + c with a = b + c + eps, free of the cancellation in
+// (a - b - c) when the masses are large compared with eps
+template <typename Real>
+static inline Real StablePDK(Real eps, Real b, Real c, Real a) {
+    return sqrt(eps * (eps + 2 * b) * (eps + 2 * c) * (eps + 2 * b + 2 * c)) / (2 * a);
+}
+
+// Boost (p_along, T) of a particle of mass m along its axis: gamma - 1 = gm1, gamma * beta = gb
+template <typename Real>
+static inline void BoostKinetic(Real& p, Real& T, Real m, Real gm1, Real gb) {
+    Real p_new = p + gm1 * p + gb * (m + T);
+    T = gm1 * m + T + gm1 * T + gb * p;
+    p = p_new;
+}
+
+// Phase space of one block of events, the algorithm of PhaseSpaceGenerator::Generate with the
+// subsystem masses written as (sum of masses + kinetic) and every energy carried as T
+template <typename Real>
+static void GeneratePhaseSpaceBatch(PhaseSpaceBatch<Real>& b, int nt) {
+    const int n_events = b.n_events;
+
+    #pragma omp simd
+    for (int e = 0; e < n_events; e++) b.msum[0][e] = b.mass[0][e];
+    for (int n = 1; n < nt; n++) {
+        #pragma omp simd
+        for (int e = 0; e < n_events; e++) b.msum[n][e] = b.msum[n - 1][e] + b.mass[n][e];
+    }
+
+    // Weight: product of the split momenta over their maxima (all kinetic energy in one split)
+    #pragma omp simd
+    for (int e = 0; e < n_events; e++) b.weight[e] = 1;
+    for (int n = 0; n < nt - 1; n++) {
+        #pragma omp simd
+        for (int e = 0; e < n_events; e++) {
+            Real K = b.kinetic[e];
+            Real eps_lo = b.rno[n][e] * K;
+            Real eps_hi = b.rno[n + 1][e] * K;
+            b.pd[n][e] = StablePDK(eps_hi - eps_lo, b.msum[n][e] + eps_lo, b.mass[n + 1][e], b.msum[n + 1][e] + eps_hi);
+            Real pd_max = StablePDK(K, b.msum[n][e], b.mass[n + 1][e], b.msum[n + 1][e] + K);
+            b.weight[e] *= b.pd[n][e] / pd_max;
+        }
+    }
+
+    // First two daughters back to back along y
+    for (int j = 0; j < 2; j++) {
+        Real sign = (j == 0) ? 1 : -1;
+        #pragma omp simd
+        for (int e = 0; e < n_events; e++) {
+            Real p = b.pd[0][e];
+            Real m = b.mass[j][e];
+            b.px[j][e] = 0;
+            b.py[j][e] = sign * p;
+            b.pz[j][e] = 0;
+            b.T[j][e] = p * p / (sqrt(p * p + m * m) + m);
+        }
+    }
+
+    Real cos_y[kEventBlockSize], sin_y[kEventBlockSize];
+    for (int i = 1; i < nt; i++) {
+        if (i > 1) {
+            #pragma omp simd
+            for (int e = 0; e < n_events; e++) {
+                Real p = b.pd[i - 1][e];
+                Real m = b.mass[i][e];
+                b.px[i][e] = 0;
+                b.py[i][e] = -p;
+                b.pz[i][e] = 0;
+                b.T[i][e] = p * p / (sqrt(p * p + m * m) + m);
+            }
+        }
+
+        // Random rotation of the subsystem (about z, then about y)
+        VectorSinCos(n_events, b.angle[i], sin_y, cos_y);
+        for (int j = 0; j <= i; j++) {
+            #pragma omp simd
+            for (int e = 0; e < n_events; e++) {
+                Real cZ = b.cz[i][e];
+                Real sZ = sqrt(1 - cZ * cZ);
+                Real x = cZ * b.px[j][e] - sZ * b.py[j][e];
+                b.py[j][e] = sZ * b.px[j][e] + cZ * b.py[j][e];
+                Real z = b.pz[j][e];
+                b.px[j][e] = cos_y[e] * x - sin_y[e] * z;
+                b.pz[j][e] = sin_y[e] * x + cos_y[e] * z;
+            }
+        }
+
+        if (i == nt - 1) break;
+
+        // Boost into the rest frame of the next subsystem (along y)
+        for (int j = 0; j <= i; j++) {
+            #pragma omp simd
+            for (int e = 0; e < n_events; e++) {
+                Real p = b.pd[i][e];
+                Real M = b.msum[i][e] + b.rno[i][e] * b.kinetic[e];
+                Real gm1 = p * p / (M * (sqrt(p * p + M * M) + M));
+                BoostKinetic(b.py[j][e], b.T[j][e], b.mass[j][e], gm1, p / M);
+            }
+        }
+    }
+
+    // CM -> Lab along the beam
+    for (int j = 0; j < nt; j++) {
+        #pragma omp simd
+        for (int e = 0; e < n_events; e++) {
+            BoostKinetic(b.pz[j][e], b.T[j][e], b.mass[j][e], (Real)b.lab_gm1[e], (Real)b.lab_gb[e]);
+        }
+    }
+
+    for (int j = 0; j < nt; j++) VectorAngles(n_events, b.px[j], b.py[j], b.pz[j], b.p[j], b.theta[j], b.phi[j]);
+
+    #pragma omp simd
+    for (int e = 0; e < n_events; e++) {
+        if (!(b.kinetic[e] > 0)) b.weight[e] = -1;
+    }
+}
+
+// Draw the random inputs of n_events events, in the order GenerateProducts draws them
+template <typename Real>
+void FusionReaction::DrawPhaseSpaceBatch(PhaseSpaceBatch<Real>& b, int n_events) {
+    int nt = products.size();
+    const PreparedReaction& r = *prepared;
+    double rno[kMaxPhaseSpaceParticles];
+
+    b.n_events = n_events;
+    b.next = 0;
+    for (int e = 0; e < n_events; e++) {
+        double beam_T = DrawBeamEnergy();
+        b.beam_T[e] = beam_T;
+
+        // CM -> Lab boost in double precision: gamma - 1 = p^2 / (sqrt(s) (E + sqrt(s)))
+        double p_beam2 = beam_T * (beam_T + 2.0 * r.M_beam);
+        double sqrt_s = r.SqrtS(beam_T);
+        b.lab_gb[e] = sqrt(p_beam2) / sqrt_s;
+        b.lab_gm1[e] = p_beam2 / (sqrt_s * (beam_T + r.M0 + sqrt_s));
+
+        for (int n = 0; n < kMaxPhaseSpaceParticles; n++) {
+            b.mass[n][e] = 1;
+            b.rno[n][e] = 0;
+            b.cz[n][e] = 1;
+            b.angle[n][e] = 0;
+        }
+        b.kinetic[e] = 0;
+        if (nt < 2) continue;
+
+        double kinetic = r.AvailableKineticEnergy(beam_T);
+        for (int i = 0; i < nt; i++) {
+            b.excitation[i][e] = DrawExcitation(i);
+            b.mass[i][e] = products[i].mass + b.excitation[i][e];
+            kinetic -= b.excitation[i][e];
+        }
+        b.kinetic[e] = kinetic;
+        if (kinetic <= 0) continue;
+
+        rno[0] = 0.0;
+        for (int n = 1; n < nt - 1; n++) rno[n] = RandomUniform();
+        sort(rno + 1, rno + nt - 1);
+        rno[nt - 1] = 1.0;
+        for (int n = 0; n < nt; n++) b.rno[n][e] = rno[n];
+
+        for (int i = 1; i < nt; i++) {
+            b.cz[i][e] = 2.0 * RandomUniform() - 1.0;
+            b.angle[i][e] = 2.0 * TMath::Pi() * RandomUniform();
+        }
+    }
+}
+
+// Hand out the next event of the float batch, refilling it every kEventBlockSize events
+double FusionReaction::NextBatchedProducts() {
+    PhaseSpaceBatch<float>& b = *float_batch;
+    if (b.next == b.n_events) {
+        DrawPhaseSpaceBatch(b, kEventBlockSize);
+        GeneratePhaseSpaceBatch(b, products.size());
+    }
+    int e = b.next++;
+
+    // Store current beam energy for reconstruction
+    E_beam_current = b.beam_T[e];
+
+    // New event: cached reconstruction sums are stale
+    event_sums.final_valid = false;
+    event_sums.decay_valid = false;
+
+    if (b.weight[e] < 0) return -1.0;
+    for (int i = 0; i < products.size(); i++) {
+        product_kin.excitation_energy[i] = b.excitation[i][e];
+        double T = b.T[i][e];
+        SetProductKinematics(i, b.px[i][e], b.py[i][e], b.pz[i][e], products[i].mass + product_kin.excitation_energy[i] + T, T,
+                             b.p[i][e], b.theta[i][e], b.phi[i][e]);
+    }
+    return b.weight[e];
+}
+
+// Generate the reaction products in single precision, kEventBlockSize events per kernel call
+// (the decay chain, smearing and analysis stay in double precision)
+void FusionReaction::EnableFloatBatch(bool enable) {
+    delete float_batch;
+    float_batch = nullptr;
+    if (!enable) return;
+
+    float_batch = new PhaseSpaceBatch<float>;
+    float_batch->n_events = 0;
+    float_batch->next = 0;
+    cout << "Float batch: single-precision product generation, " << kEventBlockSize << " events per block" << endl;
+}
+
+// Same inputs in another precision
+template <typename To, typename From>
+static void CopyBatchInputs(const PhaseSpaceBatch<From>& from, PhaseSpaceBatch<To>& to) {
+    to.n_events = from.n_events;
+    to.next = 0;
+    for (int e = 0; e < from.n_events; e++) {
+        to.beam_T[e] = from.beam_T[e];
+        to.lab_gm1[e] = from.lab_gm1[e];
+        to.lab_gb[e] = from.lab_gb[e];
+        to.kinetic[e] = from.kinetic[e];
+        for (int n = 0; n < kMaxPhaseSpaceParticles; n++) {
+            to.excitation[n][e] = from.excitation[n][e];
+            to.mass[n][e] = from.mass[n][e];
+            to.rno[n][e] = from.rno[n][e];
+            to.cz[n][e] = from.cz[n][e];
+            to.angle[n][e] = from.angle[n][e];
+        }
+    }
+}
+
+// Float batch validation bounds. The double kernel must reproduce PhaseSpaceGenerator to
+// rounding; the float kernel must stay well inside the detector resolutions (tens of keV,
+// ~1 mrad). Weights differ most for events at the phase-space boundary (2-body momentum ~ 0).
+const double kBatchKernelMaxdT = 1e-6;   // Double kernel vs PhaseSpaceGenerator (MeV)
+const double kFloatBatchMaxdT = 1e-3;    // Float vs double (MeV)
+const double kFloatBatchMaxdTheta = 0.1; // Float vs double (mrad)
+const double kFloatBatchMaxdWeight = 0.05; // Float vs double (relative)
+
+// Compare the batched kernel with the double-precision generator on n_events events:
+// the double kernel against PhaseSpaceGenerator (same random numbers), then the float kernel
+// against the double kernel (same inputs). Uses its own random streams; run before the simulation.
+// Returns false if a maximum deviation exceeds its bound above.
+bool FusionReaction::ValidateFloatBatch(int n_events) {
+    int nt = products.size();
+    if (nt < 2 || n_events < 1) return true;
+
+    PhaseSpaceBatch<float>* saved_batch = float_batch;
+    BulkRandom* saved_bulk = bulk_random;
+    TRandom3* saved_random = fRandom;
+    float_batch = nullptr;
+    bulk_random = nullptr;
+
+    PhaseSpaceBatch<double>* batch_double = new PhaseSpaceBatch<double>;
+    PhaseSpaceBatch<float>* batch_float = new PhaseSpaceBatch<float>;
+    TRandom3 batch_random(4357);
+    TRandom3 scalar_random(4357);
+
+    int n_compared = 0;
+    double max_dT_kernel = 0.0;   // double kernel vs PhaseSpaceGenerator (MeV)
+    double max_dT = 0.0;          // float vs double (MeV)
+    double max_dT_rel = 0.0;
+    double max_dtheta = 0.0;      // float vs double (mrad)
+    double max_dweight = 0.0;     // float vs double (relative)
+    for (int start = 0; start < n_events; start += kEventBlockSize) {
+        int n = min(kEventBlockSize, n_events - start);
+        fRandom = &batch_random;
+        DrawPhaseSpaceBatch(*batch_double, n);
+        CopyBatchInputs(*batch_double, *batch_float);
+        GeneratePhaseSpaceBatch(*batch_double, nt);
+        GeneratePhaseSpaceBatch(*batch_float, nt);
+
+        fRandom = &scalar_random;
+        for (int e = 0; e < n; e++) {
+            double weight = GenerateProducts();
+            if (weight < 0 || batch_double->weight[e] < 0) continue;
+            n_compared++;
+
+            for (int i = 0; i < nt; i++) {
+                double T_scalar = product_kin.energy[i] - product_kin.excitation_energy[i];
+                max_dT_kernel = max(max_dT_kernel, fabs(batch_double->T[i][e] - T_scalar));
+
+                double T_double = batch_double->T[i][e];
+                double dT = fabs(batch_float->T[i][e] - T_double);
+                max_dT = max(max_dT, dT);
+                if (T_double > 0) max_dT_rel = max(max_dT_rel, dT / T_double);
+
+                double theta_double = atan2(sqrt(batch_double->px[i][e] * batch_double->px[i][e] +
+                                                 batch_double->py[i][e] * batch_double->py[i][e]), batch_double->pz[i][e]);
+                double theta_float = atan2(sqrt((double)batch_float->px[i][e] * batch_float->px[i][e] +
+                                                (double)batch_float->py[i][e] * batch_float->py[i][e]), (double)batch_float->pz[i][e]);
+                max_dtheta = max(max_dtheta, 1000.0 * fabs(theta_float - theta_double));
+            }
+            double w = batch_double->weight[e];
+            if (w > 0) max_dweight = max(max_dweight, fabs(batch_float->weight[e] - w) / w);
+        }
+    }
+
+    delete batch_double;
+    delete batch_float;
+    fRandom = saved_random;
+    bulk_random = saved_bulk;
+    float_batch = saved_batch;
+
+    bool kernel_ok = max_dT_kernel <= kBatchKernelMaxdT;
+    bool dT_ok = max_dT <= kFloatBatchMaxdT;
+    bool dtheta_ok = max_dtheta <= kFloatBatchMaxdTheta;
+    bool dweight_ok = max_dweight <= kFloatBatchMaxdWeight;
+    cout << "\n=== Float batch validation (" << n_compared << " events) ===" << defaultfloat << setprecision(6) << endl;
+    cout << "Double kernel vs PhaseSpaceGenerator: max |dT| = " << max_dT_kernel << " MeV (bound "
+         << kBatchKernelMaxdT << ") " << (kernel_ok ? "OK" : "FAIL") << endl;
+    cout << "Float vs double kernel: max |dT| = " << max_dT << " MeV (relative " << max_dT_rel << ", bound "
+         << kFloatBatchMaxdT << " MeV) " << (dT_ok ? "OK" : "FAIL") << endl;
+    cout << "                        max |dtheta| = " << max_dtheta << " mrad (bound " << kFloatBatchMaxdTheta
+         << ") " << (dtheta_ok ? "OK" : "FAIL") << endl;
+    cout << "                        max relative weight difference = " << max_dweight << " (bound "
+         << kFloatBatchMaxdWeight << ") " << (dweight_ok ? "OK" : "FAIL") << endl;
+    return n_compared > 0 && kernel_ok && dT_ok && dtheta_ok && dweight_ok;
+}
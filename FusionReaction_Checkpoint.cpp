@@ -0,0 +1,337 @@
+#include "FusionReaction.h"
+#include <TBufferFile.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+// Checkpoint file: magic, configuration hash, number of reactions and their event counters,
+// the channel selector, then the state of every reaction. Sections are a count followed by
+// the values; raw block buffers are preceded by their size, so a checkpoint is only read
+// back by the same build.
+static const char kCheckpointMagic[8] = {'F', 'R', 'C', 'H', 'K', 'P', 'T', '2'};
+
+CheckpointSchedule::CheckpointSchedule(int every_events, double every_seconds) {
+    fEveryEvents = every_events;
+    fEverySeconds = every_seconds;
+    fLast = chrono::steady_clock::now();
+}
+
+// True if a checkpoint is due after events_done events
+bool CheckpointSchedule::Due(int events_done) {
+    bool due = fEveryEvents > 0 && events_done % fEveryEvents == 0;
+    if (!due && fEverySeconds > 0.0 && events_done % kEventBlockSize == 0) {
+        due = chrono::duration<double>(chrono::steady_clock::now() - fLast).count() >= fEverySeconds;
+    }
+    if (due) fLast = chrono::steady_clock::now();
+    return due;
+}
+
+static void WriteInt(FILE* file, int value) {
+    fwrite(&value, sizeof(int), 1, file);
+}
+
+static bool ReadInt(FILE* file, int& value) {
+    return fread(&value, sizeof(int), 1, file) == 1;
+}
+
+static void WriteDoubles(FILE* file, const double* values, int n) {
+    WriteInt(file, n);
+    fwrite(values, sizeof(double), n, file);
+}
+
+// Exactly n values expected
+static bool ReadDoubles(FILE* file, double* values, int n) {
+    int stored;
+    return ReadInt(file, stored) && stored == n && fread(values, sizeof(double), n, file) == (size_t)n;
+}
+
+// A raw block buffer (or its absence, size 0)
+static void WriteRaw(FILE* file, const void* data, int size) {
+    WriteInt(file, data ? size : 0);
+    if (data) fwrite(data, 1, size, file);
+}
+
+static bool ReadRaw(FILE* file, void* data, int size) {
+    int stored;
+    if (!ReadInt(file, stored) || stored != (data ? size : 0)) return false;
+    return !data || fread(data, 1, size, file) == (size_t)size;
+}
+
+// Sparse table: number of slots and filled slots, then (bin, counts) of every filled slot
+static void WriteSparseCounts(FILE* file, const SparseCounts& table) {
+    WriteInt(file, table.bins.size());
+    WriteInt(file, table.n_filled);
+    for (int s = 0; s < table.bins.size(); s++) {
+        if (table.bins[s] < 0) continue;
+        fwrite(&table.bins[s], sizeof(long long), 1, file);
+        fwrite(&table.counts[s], sizeof(double), 1, file);
+    }
+}
+
+static bool ReadSparseCounts(FILE* file, SparseCounts& table) {
+    int n_slots, n_filled;
+    if (!ReadInt(file, n_slots) || !ReadInt(file, n_filled)) return false;
+    if (n_slots <= 0 || (n_slots & (n_slots - 1)) != 0 || n_filled < 0 || n_filled > n_slots) return false;
+    table.Reset(n_slots);
+    for (int k = 0; k < n_filled; k++) {
+        long long bin;
+        double counts;
+        if (fread(&bin, sizeof(long long), 1, file) != 1 || fread(&counts, sizeof(double), 1, file) != 1) return false;
+        if (bin < 0) return false;
+        table.Add(bin, counts);
+    }
+    return true;
+}
+
+// Entries and statistics, then the filled cells (sparse table or dense array)
+void SparseHist2D::WriteState(FILE* file) const {
+    WriteDoubles(file, &fEntries, 1);
+    WriteDoubles(file, fStats, 7);
+    WriteInt(file, fDense.empty() ? 0 : fCells);
+    if (fDense.empty()) WriteSparseCounts(file, fSparse);
+    else fwrite(fDense.data(), sizeof(float), fCells, file);
+}
+
+bool SparseHist2D::ReadState(FILE* file) {
+    int n_dense;
+    if (!ReadDoubles(file, &fEntries, 1) || !ReadDoubles(file, fStats, 7) || !ReadInt(file, n_dense)) return false;
+    if (n_dense == 0) {
+        fDense.clear();
+        return ReadSparseCounts(file, fSparse);
+    }
+    if (n_dense != fCells) return false;
+    fDense.resize(fCells);
+    SparseCounts empty;
+    empty.n_filled = 0;
+    swap(fSparse, empty);
+    return fread(fDense.data(), sizeof(float), fCells, file) == (size_t)fCells;
+}
+
+// Generator state through its ROOT streamer
+static void WriteRandom(FILE* file, TRandom3* random) {
+    TBufferFile buffer(TBuffer::kWrite);
+    random->Streamer(buffer);
+    WriteInt(file, buffer.Length());
+    fwrite(buffer.Buffer(), 1, buffer.Length(), file);
+}
+
+static bool ReadRandom(FILE* file, TRandom3* random) {
+    int length;
+    if (!ReadInt(file, length) || length <= 0 || length > (1 << 20)) return false;
+    vector<char> data(length);
+    if (fread(data.data(), 1, length, file) != (size_t)length) return false;
+    TBufferFile buffer(TBuffer::kRead, length, data.data(), false);
+    random->Streamer(buffer);
+    return true;
+}
+
+void BulkRandom::WriteState(FILE* file) const {
+    WriteInt(file, fNextUniform);
+    WriteInt(file, fNextGaus);
+    WriteDoubles(file, fUniform, kBulkRandomSize);
+    WriteDoubles(file, fGaus, kBulkRandomSize);
+}
+
+bool BulkRandom::ReadState(FILE* file) {
+    return ReadInt(file, fNextUniform) && ReadInt(file, fNextGaus) && fNextUniform >= 0 &&
+           fNextUniform <= kBulkRandomSize && fNextGaus >= 0 && fNextGaus <= kBulkRandomSize &&
+           ReadDoubles(file, fUniform, kBulkRandomSize) && ReadDoubles(file, fGaus, kBulkRandomSize);
+}
+
+// Everything an event changes: histograms (contents, sum of squared weights, statistics,
+// entries), the sparse histograms, the response accumulator, events waiting in the missing-mass, kinematic-fit and
+// single-precision batches, the random generator and the bulk random buffers
+void FusionReaction::WriteState(FILE* file) {
+    vector<TH1*> histograms;
+    CollectHistograms(histograms, false);
+    WriteInt(file, histograms.size());
+    for (int h = 0; h < histograms.size(); h++) {
+        TH1* his = histograms[h];
+        string name = his->GetName();
+        WriteInt(file, name.size());
+        fwrite(name.data(), 1, name.size(), file);
+        vector<double> contents(his->GetNcells());
+        for (int bin = 0; bin < contents.size(); bin++) contents[bin] = his->GetBinContent(bin);
+        WriteDoubles(file, contents.data(), contents.size());
+        const TArrayD* sumw2 = his->GetSumw2();
+        WriteDoubles(file, sumw2->GetArray(), sumw2->GetSize());
+        double stats[14] = {0.0};
+        his->GetStats(stats);
+        stats[13] = his->GetEntries();
+        WriteDoubles(file, stats, 14);
+    }
+
+    WriteInt(file, his_product_E_theta.size() + his_decay_E_theta.size());
+    for (int i = 0; i < his_product_E_theta.size(); i++) his_product_E_theta[i]->WriteState(file);
+    for (int i = 0; i < his_decay_E_theta.size(); i++) his_decay_E_theta[i]->WriteState(file);
+
+    WriteDoubles(file, response_acc.generated.data(), response_acc.generated.size());
+    WriteDoubles(file, response_acc.accepted.data(), response_acc.accepted.size());
+    WriteSparseCounts(file, response_acc.response);
+
+    for (int s = 0; s < missing_mass_sets.size(); s++) {
+        const MissingMassSet& set = missing_mass_sets[s];
+        int n = set.n_block;
+        WriteInt(file, n);
+        WriteDoubles(file, set.beam_T.data(), n);
+        WriteDoubles(file, set.E.data(), n);
+        WriteDoubles(file, set.px.data(), n);
+        WriteDoubles(file, set.py.data(), n);
+        WriteDoubles(file, set.pz.data(), n);
+        WriteDoubles(file, set.Ex_true.data(), n);
+    }
+    WriteRaw(file, fit_block, sizeof(FitBlock));
+    WriteRaw(file, float_batch, sizeof(PhaseSpaceBatch<float>));
+
+    WriteRandom(file, fRandom);
+    WriteInt(file, bulk_random ? 1 : 0);
+    if (bulk_random) bulk_random->WriteState(file);
+}
+
+// Restore a state written by WriteState; false if it does not fit this configuration
+bool FusionReaction::ReadState(FILE* file) {
+    vector<TH1*> histograms;
+    CollectHistograms(histograms, false);
+    int n_histograms;
+    if (!ReadInt(file, n_histograms) || n_histograms != histograms.size()) return false;
+    for (int h = 0; h < histograms.size(); h++) {
+        TH1* his = histograms[h];
+        int length, n_cells, n_sumw2;
+        if (!ReadInt(file, length) || length < 0 || length > 4096) return false;
+        string name(length, ' ');
+        if (fread(&name[0], 1, length, file) != (size_t)length || name != his->GetName()) return false;
+
+        vector<double> contents(his->GetNcells());
+        if (!ReadInt(file, n_cells) || n_cells != contents.size()) return false;
+        if (fread(contents.data(), sizeof(double), n_cells, file) != (size_t)n_cells) return false;
+        if (!ReadInt(file, n_sumw2) || (n_sumw2 != 0 && n_sumw2 != n_cells)) return false;
+        vector<double> sumw2(n_sumw2);
+        if (fread(sumw2.data(), sizeof(double), n_sumw2, file) != (size_t)n_sumw2) return false;
+        double stats[14];
+        if (!ReadDoubles(file, stats, 14)) return false;
+
+        // Contents first (SetBinContent touches the statistics), then the statistics
+        his->Reset();
+        for (int bin = 0; bin < n_cells; bin++) his->SetBinContent(bin, contents[bin]);
+        if (n_sumw2 > 0) his->GetSumw2()->Set(n_sumw2, sumw2.data());
+        his->PutStats(stats);
+        his->SetEntries(stats[13]);
+    }
+
+    int n_sparse;
+    if (!ReadInt(file, n_sparse) || n_sparse != his_product_E_theta.size() + his_decay_E_theta.size()) return false;
+    for (int i = 0; i < his_product_E_theta.size(); i++) {
+        if (!his_product_E_theta[i]->ReadState(file)) return false;
+    }
+    for (int i = 0; i < his_decay_E_theta.size(); i++) {
+        if (!his_decay_E_theta[i]->ReadState(file)) return false;
+    }
+
+    if (!ReadDoubles(file, response_acc.generated.data(), response_acc.generated.size())) return false;
+    if (!ReadDoubles(file, response_acc.accepted.data(), response_acc.accepted.size())) return false;
+    if (!ReadSparseCounts(file, response_acc.response)) return false;
+
+    for (int s = 0; s < missing_mass_sets.size(); s++) {
+        MissingMassSet& set = missing_mass_sets[s];
+        int n;
+        if (!ReadInt(file, n) || n < 0 || n > kEventBlockSize) return false;
+        set.n_block = n;
+        if (!ReadDoubles(file, set.beam_T.data(), n) || !ReadDoubles(file, set.E.data(), n) ||
+            !ReadDoubles(file, set.px.data(), n) || !ReadDoubles(file, set.py.data(), n) ||
+            !ReadDoubles(file, set.pz.data(), n) || !ReadDoubles(file, set.Ex_true.data(), n)) return false;
+    }
+    if (!ReadRaw(file, fit_block, sizeof(FitBlock))) return false;
+    if (!ReadRaw(file, float_batch, sizeof(PhaseSpaceBatch<float>))) return false;
+
+    int has_bulk;
+    if (!ReadRandom(file, fRandom) || !ReadInt(file, has_bulk) || has_bulk != (bulk_random ? 1 : 0)) return false;
+    return !bulk_random || bulk_random->ReadState(file);
+}
+
+// Checkpoints of RunSimulation (call after InitializeHistograms)
+void FusionReaction::SetCheckpoint(const string& filename, unsigned long long config_hash, const CheckpointSchedule& schedule) {
+    if (hepmc_writer) {
+        cout << "ERROR: Checkpoints cannot be combined with HepMC export (the event file is not resumable)!" << endl;
+        exit(1);
+    }
+    checkpoint_file = filename;
+    checkpoint_hash = config_hash;
+    checkpoint_schedule = schedule;
+}
+
+// Restore the run state from checkpoint_file; returns the events already simulated (0 if
+// there is no checkpoint yet)
+int FusionReaction::ResumeCheckpoint() {
+    vector<int> events;
+    if (!ReadCheckpoint(checkpoint_file, checkpoint_hash, vector<FusionReaction*>(1, this), events, nullptr)) return 0;
+    return events[0];
+}
+
+bool WriteCheckpoint(const string& filename, unsigned long long config_hash, const vector<FusionReaction*>& reactions,
+                     const vector<int>& events, TRandom3* selector) {
+    string temporary = filename + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        cout << "WARNING: Cannot write checkpoint " << temporary << ": " << strerror(errno) << endl;
+        return false;
+    }
+    fwrite(kCheckpointMagic, 1, sizeof(kCheckpointMagic), file);
+    fwrite(&config_hash, sizeof(config_hash), 1, file);
+    WriteInt(file, reactions.size());
+    for (int r = 0; r < reactions.size(); r++) WriteInt(file, events[r]);
+    WriteInt(file, selector ? 1 : 0);
+    if (selector) WriteRandom(file, selector);
+    for (int r = 0; r < reactions.size(); r++) reactions[r]->WriteState(file);
+
+    // Data on disk before the rename replaces the previous checkpoint
+    bool ok = fflush(file) == 0 && !ferror(file) && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), filename.c_str()) != 0) {
+        cout << "WARNING: Cannot write checkpoint " << filename << ": " << strerror(errno) << endl;
+        remove(temporary.c_str());
+        return false;
+    }
+    int total = 0;
+    for (int r = 0; r < events.size(); r++) total += events[r];
+    cout << "Checkpoint written to " << filename << " after " << total << " events" << endl;
+    return true;
+}
+
+bool ReadCheckpoint(const string& filename, unsigned long long config_hash, const vector<FusionReaction*>& reactions,
+                    vector<int>& events, TRandom3* selector) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        cout << "No checkpoint " << filename << " yet, starting from the first event" << endl;
+        return false;
+    }
+    char magic[sizeof(kCheckpointMagic)];
+    unsigned long long stored_hash;
+    int n_reactions, has_selector;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, kCheckpointMagic, sizeof(magic)) != 0 ||
+        fread(&stored_hash, sizeof(stored_hash), 1, file) != 1) {
+        cout << "ERROR: " << filename << " is not a checkpoint file!" << endl;
+        exit(1);
+    }
+    if (stored_hash != config_hash) {
+        cout << "ERROR: Checkpoint " << filename << " was written with a different configuration!" << endl;
+        exit(1);
+    }
+
+    bool ok = ReadInt(file, n_reactions) && n_reactions == reactions.size();
+    events.assign(reactions.size(), 0);
+    for (int r = 0; ok && r < reactions.size(); r++) ok = ReadInt(file, events[r]) && events[r] >= 0;
+    ok = ok && ReadInt(file, has_selector) && has_selector == (selector ? 1 : 0);
+    if (ok && selector) ok = ReadRandom(file, selector);
+    for (int r = 0; ok && r < reactions.size(); r++) ok = reactions[r]->ReadState(file);
+    fclose(file);
+    if (!ok) {
+        cout << "ERROR: Checkpoint " << filename << " is truncated or does not match this build!" << endl;
+        exit(1);
+    }
+
+    int total = 0;
+    for (int r = 0; r < events.size(); r++) total += events[r];
+    cout << "Resuming from checkpoint " << filename << " after " << total << " events" << endl;
+    return true;
+}
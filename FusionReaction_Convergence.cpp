@@ -0,0 +1,171 @@
+#include "FusionReaction.h"
+#include <algorithm>
+#include <cmath>
+
+// Targets are not judged before this many events in total (moment errors are unreliable earlier)
+const int kStopMinEvents = 10 * kEventBlockSize;
+
+ConvergenceMonitor::ConvergenceMonitor(const vector<StopTarget>& targets, int n_reactions) {
+    fTargets = targets;
+    StopSums empty = {0.0, 0.0, 0.0, 0.0, 0.0};
+    fSums.assign(n_reactions, vector<StopSums>(targets.size(), empty));
+    fEvents.assign(n_reactions, 0);
+    fFraction.assign(n_reactions, 0.0);
+    fConverged = false;
+    fStopFraction = 1.0;
+}
+
+// Store a reaction's latest sums (events done, fraction of its planned events) and check
+// the targets. Returns true once they are met.
+bool ConvergenceMonitor::Publish(int reaction, const vector<StopSums>& sums, int events, double fraction) {
+    lock_guard<mutex> lock(fMutex);
+    fSums[reaction] = sums;
+    fEvents[reaction] = events;
+    fFraction[reaction] = fraction;
+    if (fConverged) return true;
+
+    vector<double> value, precision;
+    if (!Evaluate(value, precision)) return false;
+
+    // Reactions behind the furthest one catch up to its fraction (keeps the channel mixture)
+    fStopFraction = *max_element(fFraction.begin(), fFraction.end());
+    fConverged = true;
+    return true;
+}
+
+// Events a reaction with n_planned events runs in total once the targets are met
+int ConvergenceMonitor::EventLimit(int n_planned) const {
+    if (!fConverged) return n_planned;
+    return min(n_planned, (int)ceil(fStopFraction * n_planned));
+}
+
+// Add up the published sums and compute every target's value and relative precision
+// (called with fMutex held). Errors as TH1::GetMeanError / GetStdDevError. Returns true if
+// all targets are met.
+bool ConvergenceMonitor::Evaluate(vector<double>& value, vector<double>& precision) {
+    int total_events = 0;
+    for (int r = 0; r < fEvents.size(); r++) total_events += fEvents[r];
+
+    bool met = total_events >= kStopMinEvents;
+    value.assign(fTargets.size(), 0.0);
+    precision.assign(fTargets.size(), HUGE_VAL);
+    for (int t = 0; t < fTargets.size(); t++) {
+        StopSums total = {0.0, 0.0, 0.0, 0.0, 0.0};
+        for (int r = 0; r < fSums.size(); r++) {
+            const StopSums& sums = fSums[r][t];
+            total.sumw += sums.sumw;
+            total.sumw2 += sums.sumw2;
+            total.sumwx += sums.sumwx;
+            total.sumwx2 += sums.sumwx2;
+            total.window += sums.window;
+        }
+
+        const StopTarget& target = fTargets[t];
+        if (target.quantity == "count") {
+            value[t] = total.window;
+            if (total.window > 0.0) precision[t] = 1.0 / sqrt(total.window);
+        } else if (total.sumw > 0.0 && total.sumw2 > 0.0) {
+            double n_eff = total.sumw * total.sumw / total.sumw2;
+            double mean = total.sumwx / total.sumw;
+            double std_dev = sqrt(max(total.sumwx2 / total.sumw - mean * mean, 0.0));
+            if (target.quantity == "mean") {
+                value[t] = mean;
+                if (mean != 0.0) precision[t] = std_dev / sqrt(n_eff) / fabs(mean);
+            } else {
+                value[t] = std_dev;
+                if (std_dev > 0.0) precision[t] = 1.0 / sqrt(2.0 * n_eff);
+            }
+        }
+        if (!(precision[t] <= target.precision)) met = false;
+    }
+    return met;
+}
+
+// Current value and precision of every target
+void ConvergenceMonitor::PrintStatus() {
+    lock_guard<mutex> lock(fMutex);
+    vector<double> value, precision;
+    Evaluate(value, precision);
+    for (int t = 0; t < fTargets.size(); t++) {
+        const StopTarget& target = fTargets[t];
+        cout << "  " << target.histogram << " " << target.quantity;
+        if (target.quantity == "count") cout << " [" << target.lo << ", " << target.hi << "]";
+        cout << " = " << defaultfloat << setprecision(6) << value[t] << ", relative precision " << precision[t]
+             << " (target " << target.precision << ")" << endl;
+    }
+}
+
+// Attach the reaction to a monitor as reaction index; the target histograms are looked up by
+// name among the saved histograms (call after InitializeHistograms)
+void FusionReaction::SetConvergenceMonitor(ConvergenceMonitor* monitor, int index) {
+    convergence = monitor;
+    convergence_index = index;
+    convergence_his.clear();
+    if (!monitor) return;
+
+    // Sparse histograms: only the targets get a dense copy, refreshed before publishing
+    vector<TH1*> histograms;
+    CollectHistograms(histograms, false);
+    vector<SparseHist2D*> sparse(his_product_E_theta.begin(), his_product_E_theta.end());
+    sparse.insert(sparse.end(), his_decay_E_theta.begin(), his_decay_E_theta.end());
+    convergence_sparse = false;
+    const vector<StopTarget>& targets = monitor->Targets();
+    for (int t = 0; t < targets.size(); t++) {
+        TH1* his = nullptr;
+        for (int h = 0; h < histograms.size(); h++) {
+            if (targets[t].histogram == histograms[h]->GetName()) his = histograms[h];
+        }
+        for (int s = 0; s < sparse.size() && !his; s++) {
+            int output = sparse[s]->FindOutput(targets[t].histogram);
+            if (output < 0) continue;
+            his = sparse[s]->Dense(output);
+            convergence_sparse = true;
+        }
+        if (!his) {
+            cout << "ERROR: Stop target histogram not found: " << targets[t].histogram << endl;
+            exit(1);
+        }
+        convergence_his.push_back(his);
+    }
+    convergence_sums.resize(targets.size());
+}
+
+// Contents of x bins first..last, summed over the y bins of a 2D histogram
+static double XBinContent(const TH1* his, int first, int last) {
+    double sum = 0.0;
+    for (int bx = first; bx <= last; bx++) {
+        if (his->GetDimension() == 1) {
+            sum += his->GetBinContent(bx);
+            continue;
+        }
+        for (int by = 1; by <= his->GetNbinsY(); by++) sum += his->GetBinContent(bx, by);
+    }
+    return sum;
+}
+
+// Publish the statistics of the target histograms after events_done of events_planned events
+// (block buffers are flushed first). Returns true once the targets are met.
+bool FusionReaction::PublishConvergence(int events_done, int events_planned) {
+    FlushMissingMass();
+    FlushKinematicFit();
+    if (convergence_sparse) RefreshSparseHistograms();
+
+    const vector<StopTarget>& targets = convergence->Targets();
+    for (int t = 0; t < targets.size(); t++) {
+        const TH1* his = convergence_his[t];
+        StopSums& sums = convergence_sums[t];
+        double stats[13];
+        his->GetStats(stats);
+        sums.sumw = stats[0];
+        sums.sumw2 = stats[1];
+        sums.sumwx = stats[2];
+        sums.sumwx2 = stats[3];
+
+        sums.window = 0.0;
+        if (targets[t].quantity == "count") {
+            const TAxis* axis = his->GetXaxis();
+            sums.window = XBinContent(his, axis->FindFixBin(targets[t].lo), axis->FindFixBin(targets[t].hi));
+        }
+    }
+    return convergence->Publish(convergence_index, convergence_sums, events_done, (double)events_done / events_planned);
+}
@@ -0,0 +1,259 @@
+#include "FusionReaction.h"
+
+// Number of fit parameters: (T, theta, phi) per particle plus the beam kinetic energy
+const int kMaxFitParameters = 3 * kMaxFitParticles + 1;
+
+// Constrained kinematic fit of one event (Lagrange multipliers, linearised and iterated).
+// Constraints: final-state momentum = beam momentum, final-state energy = beam + target energy.
+// Parameters are fitted in place; sigma holds the measurement errors in the same order
+// (T, theta, phi per particle, then the beam). Fixed-size, no allocation.
+// Returns false if the constraint matrix is singular or the fit did not converge.
+static bool KinematicFit(int n, const double* mass, double* T, double* theta, double* phi,
+                         double& beam_T, const double* sigma, double M_beam, double M_target,
+                         double& chi2) {
+    int n_par = 3 * n + 1;
+    double alpha0[kMaxFitParameters], alpha[kMaxFitParameters], V[kMaxFitParameters];
+    for (int i = 0; i < n; i++) {
+        alpha0[3 * i] = T[i];
+        alpha0[3 * i + 1] = theta[i];
+        alpha0[3 * i + 2] = phi[i];
+    }
+    alpha0[3 * n] = beam_T;
+    for (int j = 0; j < n_par; j++) {
+        alpha[j] = alpha0[j];
+        V[j] = sigma[j] * sigma[j];
+    }
+    
+    chi2 = 0.0;
+    for (int iter = 0; iter < 10; iter++) {
+        // Constraint values d and analytic Jacobian D at the current point
+        double d[4] = {0.0, 0.0, 0.0, 0.0};
+        double D[4][kMaxFitParameters];
+        for (int i = 0; i < n; i++) {
+            double t = alpha[3 * i] > 1e-6 ? alpha[3 * i] : 1e-6;
+            double E = t + mass[i];
+            double p = sqrt(t * (t + 2.0 * mass[i]));
+            double dp = E / p;  // dp/dT
+            double st = sin(alpha[3 * i + 1]), ct = cos(alpha[3 * i + 1]);
+            double sp = sin(alpha[3 * i + 2]), cp = cos(alpha[3 * i + 2]);
+            
+            d[0] += p * st * cp;
+            d[1] += p * st * sp;
+            d[2] += p * ct;
+            d[3] += E;
+            
+            D[0][3 * i] = dp * st * cp;  D[0][3 * i + 1] = p * ct * cp;  D[0][3 * i + 2] = -p * st * sp;
+            D[1][3 * i] = dp * st * sp;  D[1][3 * i + 1] = p * ct * sp;  D[1][3 * i + 2] = p * st * cp;
+            D[2][3 * i] = dp * ct;       D[2][3 * i + 1] = -p * st;      D[2][3 * i + 2] = 0.0;
+            D[3][3 * i] = 1.0;           D[3][3 * i + 1] = 0.0;          D[3][3 * i + 2] = 0.0;
+        }
+        double tb = alpha[3 * n];
+        double p_beam = sqrt(tb * (tb + 2.0 * M_beam));
+        d[2] -= p_beam;
+        d[3] -= tb + M_beam + M_target;
+        D[0][3 * n] = 0.0;
+        D[1][3 * n] = 0.0;
+        D[2][3 * n] = -(tb + M_beam) / p_beam;
+        D[3][3 * n] = -1.0;
+        
+        // r = d + D (alpha0 - alpha), S = D V D^T (4x4, symmetric)
+        double r[4], S[4][4];
+        for (int a = 0; a < 4; a++) {
+            r[a] = d[a];
+            for (int j = 0; j < n_par; j++) r[a] += D[a][j] * (alpha0[j] - alpha[j]);
+            for (int b = 0; b <= a; b++) {
+                double sum = 0.0;
+                for (int j = 0; j < n_par; j++) sum += D[a][j] * V[j] * D[b][j];
+                S[a][b] = sum;
+                S[b][a] = sum;
+            }
+        }
+        
+        // Solve S lambda = r by Cholesky decomposition (S = L L^T)
+        double L[4][4] = {{0.0}};
+        for (int a = 0; a < 4; a++) {
+            for (int b = 0; b <= a; b++) {
+                double sum = S[a][b];
+                for (int k = 0; k < b; k++) sum -= L[a][k] * L[b][k];
+                if (a == b) {
+                    if (sum <= 0.0) return false;
+                    L[a][a] = sqrt(sum);
+                } else {
+                    L[a][b] = sum / L[b][b];
+                }
+            }
+        }
+        double z[4], lambda[4];
+        for (int a = 0; a < 4; a++) {
+            double sum = r[a];
+            for (int k = 0; k < a; k++) sum -= L[a][k] * z[k];
+            z[a] = sum / L[a][a];
+        }
+        for (int a = 3; a >= 0; a--) {
+            double sum = z[a];
+            for (int k = a + 1; k < 4; k++) sum -= L[k][a] * lambda[k];
+            lambda[a] = sum / L[a][a];
+        }
+        
+        // alpha = alpha0 - V D^T lambda, chi2 = r . lambda
+        for (int j = 0; j < n_par; j++) {
+            double sum = 0.0;
+            for (int a = 0; a < 4; a++) sum += D[a][j] * lambda[a];
+            alpha[j] = alpha0[j] - V[j] * sum;
+        }
+        double chi2_new = r[0] * lambda[0] + r[1] * lambda[1] + r[2] * lambda[2] + r[3] * lambda[3];
+        
+        bool converged = fabs(chi2_new - chi2) < 1e-3;
+        chi2 = chi2_new;
+        if (converged && iter > 0) {
+            for (int i = 0; i < n; i++) {
+                T[i] = alpha[3 * i];
+                theta[i] = alpha[3 * i + 1];
+                phi[i] = alpha[3 * i + 2];
+            }
+            beam_T = alpha[3 * n];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Buffer the measured final-state particles of this event for the kinematic fit
+void FusionReaction::AccumulateKinematicFit() {
+    FitBlock& block = *fit_block;
+    int e = block.n_events;
+    int n = 0;
+    
+    // Final state: products without decay tree, otherwise the tree entries that did not decay
+    int n_entries = decay_enabled ? n_decay_tree : products.size();
+    for (int k = 0; k < n_entries; k++) {
+        int product = decay_enabled ? decay_tree[k].product : k;
+        int slot = decay_enabled ? decay_tree[k].slot : -1;
+        if (decay_enabled && decay_tree[k].channel >= 0) continue;
+        
+        if (n == kMaxFitParticles) {
+            if (!fit_overflow_warned) {
+                cout << "WARNING: More than " << kMaxFitParticles << " final-state particles, event not fitted" << endl;
+                fit_overflow_warned = true;
+            }
+            return;
+        }
+        
+        const FourVector& meas = (product >= 0) ? product_p4_meas[product] : decay_p4_meas[slot];
+        const FourVector& tru = (product >= 0) ? product_p4_true[product] : decay_p4_true[slot];
+        double m = (product >= 0) ? products[product].mass + product_kin.excitation_energy[product]
+                                  : decay_masses[slot] + decay_excitation[slot];
+        
+        bool from_parent = false;
+        if (decay_enabled) {
+            for (int q = decay_tree[k].parent; q >= 0; q = decay_tree[q].parent) {
+                if (decay_tree[q].product == decay_product_index) from_parent = true;
+            }
+        }
+        
+        block.product[e][n] = product;
+        block.slot[e][n] = slot;
+        block.from_parent[e][n] = from_parent;
+        block.mass[e][n] = m;
+        block.T[e][n] = KineticEnergy(meas, m);
+        block.theta[e][n] = atan2(sqrt(meas.px * meas.px + meas.py * meas.py), meas.pz);
+        block.phi[e][n] = atan2(meas.py, meas.px);
+        block.T_true[e][n] = KineticEnergy(tru, m);
+        block.theta_true[e][n] = atan2(sqrt(tru.px * tru.px + tru.py * tru.py), tru.pz);
+        n++;
+    }
+    
+    block.n_particles[e] = n;
+    block.beam_T_true[e] = E_beam_current;
+    block.parent_mass_true[e] = 0.0;
+    if (decay_product_index >= 0) {
+        block.parent_mass_true[e] = products[decay_product_index].mass + product_kin.excitation_energy[decay_product_index];
+    }
+    
+    block.n_events = e + 1;
+    if (block.n_events == kEventBlockSize) {
+        FlushKinematicFit();
+    }
+}
+
+// Fit the buffered events and fill the fit histograms
+void FusionReaction::FlushKinematicFit() {
+    if (!fit_block) return;
+    FitBlock& block = *fit_block;
+    
+    // Measurement errors follow the simulated smearing: theta by th_res for every particle,
+    // decay-product T by E_beam_re; product T and all azimuths are exact and only get a
+    // small error so the constraint matrix stays invertible. Beam: nominal energy at
+    // mid-target with the beam spread, straggling and target thickness.
+    const double kExactEnergyError = 1e-4;  // MeV
+    const double kExactAngleError = 1e-6;   // rad
+    double beam_T_nominal = prepared->nominal_beam_T;
+    double sigma_beam = sqrt(E_beam_re * E_beam_re + E_strag * E_strag + E_loss * E_loss / 12.0);
+    double sigma_T_decay = E_beam_re > kExactEnergyError ? E_beam_re : kExactEnergyError;
+    double sigma_theta = th_res > kExactAngleError ? th_res : kExactAngleError;
+    double rad_to_deg = 180.0 / TMath::Pi();
+    
+    for (int e = 0; e < block.n_events; e++) {
+        int n = block.n_particles[e];
+        if (n < 2) continue;
+        
+        // Degrees of freedom: four constraints, at most the number of smeared parameters
+        double sigma[kMaxFitParameters];
+        int n_smeared = (sigma_beam > kExactEnergyError) + (th_res > kExactAngleError) * n;
+        for (int i = 0; i < n; i++) {
+            bool decay_product = block.product[e][i] < 0;
+            sigma[3 * i] = decay_product ? sigma_T_decay : kExactEnergyError;
+            sigma[3 * i + 1] = sigma_theta;
+            sigma[3 * i + 2] = kExactAngleError;
+            if (decay_product && E_beam_re > kExactEnergyError) n_smeared++;
+        }
+        sigma[3 * n] = sigma_beam > kExactEnergyError ? sigma_beam : kExactEnergyError;
+        int ndf = n_smeared < 4 ? n_smeared : 4;
+        if (ndf < 1) continue;
+        
+        double beam_T = beam_T_nominal;
+        double chi2 = 0.0;
+        if (!KinematicFit(n, block.mass[e], block.T[e], block.theta[e], block.phi[e],
+                          beam_T, sigma, prepared->M_beam, prepared->M_target, chi2)) {
+            continue;
+        }
+        
+        his_fit_chi2->Fill(chi2);
+        his_fit_probability->Fill(TMath::Prob(chi2, ndf));
+        his_fit_beam_energy_difference->Fill(beam_T - block.beam_T_true[e]);
+        
+        double E = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+        bool has_parent = false;
+        for (int i = 0; i < n; i++) {
+            double t = block.T[e][i];
+            double m = block.mass[e][i];
+            double p = sqrt(t * (t + 2.0 * m));
+            double dtheta = (block.theta[e][i] - block.theta_true[e][i]) * rad_to_deg;
+            double dT = t - block.T_true[e][i];
+            
+            if (block.product[e][i] >= 0) {
+                his_fit_product_theta_difference[block.product[e][i]]->Fill(dtheta);
+                his_fit_product_energy_difference[block.product[e][i]]->Fill(dT);
+            } else {
+                his_fit_decay_theta_difference[block.slot[e][i]]->Fill(dtheta);
+                his_fit_decay_energy_difference[block.slot[e][i]]->Fill(dT);
+            }
+            
+            if (block.from_parent[e][i]) {
+                has_parent = true;
+                E += t + m;
+                px += p * sin(block.theta[e][i]) * cos(block.phi[e][i]);
+                py += p * sin(block.theta[e][i]) * sin(block.phi[e][i]);
+                pz += p * cos(block.theta[e][i]);
+            }
+        }
+        
+        // Parent mass from the fitted decay products
+        if (has_parent) {
+            double parent_mass_fitted = sqrt(E * E - px * px - py * py - pz * pz);
+            his_fit_parent_mass->Fill(parent_mass_fitted);
+            his_fit_parent_mass_difference->Fill(block.parent_mass_true[e] - parent_mass_fitted);
+        }
+    }
+    block.n_events = 0;
+}
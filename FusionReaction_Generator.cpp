@@ -0,0 +1,75 @@
+#include "FusionReaction.h"
+
+// PDG-style particle code: neutron and proton by their hadron codes, nuclei as 100ZZZAAA0
+int PDGCode(int A, int Z) {
+    if (A == 1 && Z == 0) return 2112;
+    if (A == 1 && Z == 1) return 2212;
+    return 1000000000 + Z * 10000 + A * 10;
+}
+
+// Upper bound on the final-state particles of one event: every product and every decay slot
+int FusionReaction::MaxFinalStateParticles() const {
+    return products.size() + (decay_enabled ? decay_A.size() : 0);
+}
+
+// Generate n_events true events into caller-owned buffers
+// Each event is the beam-spot vertex, the final state (undecayed products and the leaves of
+// the decay tree) and the phase-space weight. Nothing is filled, printed or allocated, so this
+// runs at generator speed for transport codes and external analysis frameworks.
+// An event that falls below threshold is drawn again, so the sample keeps the beam energy
+// distribution above threshold. Returns the number of events written: n_events, fewer only
+// if kMaxGenerateAttempts draws in a row fail (the reaction is essentially closed), and 0 if
+// the buffers have too few particle slots.
+int FusionReaction::GenerateEvents(int n_events, EventBuffers& buffers) {
+    if (buffers.max_particles < MaxFinalStateParticles()) return 0;
+    if (!prepared) {
+        cout << "ERROR: InitializeHistograms() must be called before GenerateEvents()!" << endl;
+        exit(1);
+    }
+
+    for (int event = 0; event < n_events; event++) {
+        double weight = GenerateProducts();
+        for (int attempt = 1; weight < 0 && attempt < kMaxGenerateAttempts; attempt++) {
+            weight = GenerateProducts();
+        }
+        if (weight < 0) return event;
+
+        int base = event * buffers.max_particles;
+        int n = 0;
+        if (decay_enabled) {
+            weight *= SimulateDecay(false);
+
+            // Final state: entries of the decay tree that did not decay in this event
+            for (int e = 0; e < n_decay_tree; e++) {
+                const DecayTreeEntry& entry = decay_tree[e];
+                if (entry.channel >= 0) continue;
+                const FourVector& p4 = (entry.product >= 0) ? product_p4_true[entry.product] : decay_p4_true[entry.slot];
+                buffers.pdg[base + n] = (entry.product >= 0) ? PDGCode(products[entry.product].A, products[entry.product].Z)
+                                                             : PDGCode(decay_A[entry.slot], decay_Z[entry.slot]);
+                buffers.px[base + n] = p4.px;
+                buffers.py[base + n] = p4.py;
+                buffers.pz[base + n] = p4.pz;
+                buffers.E[base + n] = p4.E;
+                n++;
+            }
+        } else {
+            for (int i = 0; i < products.size(); i++) {
+                const FourVector& p4 = product_p4_true[i];
+                buffers.pdg[base + n] = PDGCode(products[i].A, products[i].Z);
+                buffers.px[base + n] = p4.px;
+                buffers.py[base + n] = p4.py;
+                buffers.pz[base + n] = p4.pz;
+                buffers.E[base + n] = p4.E;
+                n++;
+            }
+        }
+        buffers.n_particles[event] = n;
+        buffers.weight[event] = weight;
+
+        // Beam spot on the target
+        buffers.vertex_x[event] = RandomGaus(0, tar_res);
+        buffers.vertex_y[event] = RandomGaus(0, tar_res);
+        buffers.vertex_z[event] = 0.0;
+    }
+    return n_events;
+}
@@ -0,0 +1,251 @@
+#include "FusionReaction.h"
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <pthread.h>
+
+// Blocks in flight between the simulation and the writer thread
+const int kHepMCBlocks = 4;
+
+HepMCWriter::HepMCWriter() {
+    fFile = nullptr;
+    fGzip = -1;
+    fCurrent = nullptr;
+    fDone = false;
+    fWriteOk = true;
+}
+
+HepMCWriter::~HepMCWriter() {
+    Close();
+    for (int b = 0; b < fBlocks.size(); b++) delete fBlocks[b];
+}
+
+// Start "gzip -1 -c" writing to filename; returns the write end of its input pipe (-1 on failure).
+// The file name is passed as a path, never through a shell. Both descriptors are close-on-exec
+// so gzip processes of other writers do not hold this pipe open.
+static int StartGzip(const char* filename, pid_t& pid) {
+    int out = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) return -1;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        close(out);
+        return -1;
+    }
+    pid = fork();
+    if (pid == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        execlp("gzip", "gzip", "-1", "-c", (char*)nullptr);
+        _exit(127);
+    }
+    close(fds[0]);
+    close(out);
+    if (pid < 0) {
+        close(fds[1]);
+        return -1;
+    }
+    return fds[1];
+}
+
+// Open the output (compressed by a gzip process for names ending in .gz) and start the writer thread
+bool HepMCWriter::Open(const char* filename) {
+    string name = filename;
+    fName = name;
+    if (name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0) {
+        int fd = StartGzip(filename, fGzip);
+        if (fd >= 0) fFile = fdopen(fd, "w");
+        if (fd >= 0 && !fFile) close(fd);
+    } else {
+        fFile = fopen(filename, "w");
+    }
+    if (!fFile) return false;
+
+    // Blocks sized for the largest event, so filling them never allocates
+    for (int b = 0; b < kHepMCBlocks; b++) {
+        Block* block = new Block;
+        block->events.reserve(kEventBlockSize);
+        block->particles.reserve(kEventBlockSize * (kMaxDecayEntries + 2));
+        fBlocks.push_back(block);
+        fFree.push_back(block);
+    }
+    fCurrent = fFree.back();
+    fFree.pop_back();
+
+    fprintf(fFile, "HepMC::Version 3.02.05\n");
+    fprintf(fFile, "HepMC::Asciiv3-START_EVENT_LISTING\n");
+    fDone = false;
+    fThread = thread(&HepMCWriter::WriterLoop, this);
+    return true;
+}
+
+// Start a new event; a full block is handed to the writer thread first
+void HepMCWriter::BeginEvent(int number, double weight, double x, double y, double z) {
+    if (fCurrent->events.size() == kEventBlockSize) Submit();
+
+    HepMCEvent event;
+    event.number = number;
+    event.first_particle = fCurrent->particles.size();
+    event.n_particles = 0;
+    event.weight = weight;
+    event.x = x;
+    event.y = y;
+    event.z = z;
+    fCurrent->events.push_back(event);
+}
+
+void HepMCWriter::AddParticle(int pdg, int mother, int status, double px, double py, double pz, double E, double m) {
+    HepMCParticle particle = {pdg, mother, status, px, py, pz, E, m};
+    fCurrent->particles.push_back(particle);
+    fCurrent->events.back().n_particles++;
+}
+
+// Queue the current block and take a free one (waits while the writer is behind)
+void HepMCWriter::Submit() {
+    unique_lock<mutex> lock(fMutex);
+    fQueue.push_back(fCurrent);
+    fCond.notify_all();
+    fCond.wait(lock, [this] { return !fFree.empty(); });
+    fCurrent = fFree.back();
+    fFree.pop_back();
+}
+
+// Format queued blocks until Close(), then end the listing and close the output. SIGPIPE is
+// blocked in this thread, so a gzip process that died makes the writes fail instead of
+// ending the program.
+void HepMCWriter::WriterLoop() {
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+    
+    while (true) {
+        Block* block;
+        {
+            unique_lock<mutex> lock(fMutex);
+            fCond.wait(lock, [this] { return !fQueue.empty() || fDone; });
+            if (fQueue.empty()) break;
+            block = fQueue.front();
+            fQueue.pop_front();
+        }
+        WriteBlock(*block);
+        block->events.clear();
+        block->particles.clear();
+        {
+            lock_guard<mutex> lock(fMutex);
+            fFree.push_back(block);
+        }
+        fCond.notify_all();
+    }
+    
+    fprintf(fFile, "HepMC::Asciiv3-END_EVENT_LISTING\n\n");
+    fWriteOk = !ferror(fFile);
+    if (fclose(fFile) != 0) fWriteOk = false;
+}
+
+// Format one block. Particle ids start at 1 in event order; vertex -1 is the reaction
+// (beam + target in), each decayed particle gets the next vertex at the reaction point.
+void HepMCWriter::WriteBlock(const Block& block) {
+    int vertex_of[kMaxDecayEntries + 2];
+    for (int e = 0; e < block.events.size(); e++) {
+        const HepMCEvent& event = block.events[e];
+        const HepMCParticle* particles = &block.particles[event.first_particle];
+
+        int n_vertices = 0;
+        bool has_reaction = false;
+        for (int i = 0; i < event.n_particles; i++) {
+            if (particles[i].mother == -2) has_reaction = true;
+            if (particles[i].status == 2) n_vertices++;
+        }
+        if (has_reaction) n_vertices++;
+
+        fprintf(fFile, "E %d %d %d\n", event.number, n_vertices, event.n_particles);
+        fprintf(fFile, "U MEV MM\n");
+        fprintf(fFile, "W %.10e\n", event.weight);
+
+        int next_vertex = -1;
+        bool reaction_written = false;
+        for (int i = 0; i < event.n_particles; i++) vertex_of[i] = 0;
+        for (int i = 0; i < event.n_particles; i++) {
+            const HepMCParticle& p = particles[i];
+            int parent = 0;
+            if (p.mother == -2) {
+                if (!reaction_written) {
+                    // Incoming particles are the ones without a production vertex
+                    fprintf(fFile, "V %d 0 [", next_vertex);
+                    bool first = true;
+                    for (int k = 0; k < event.n_particles; k++) {
+                        if (particles[k].mother != -1) continue;
+                        fprintf(fFile, first ? "%d" : ",%d", k + 1);
+                        first = false;
+                    }
+                    fprintf(fFile, "] @ %.10e %.10e %.10e 0\n", event.x, event.y, event.z);
+                    reaction_written = true;
+                    next_vertex--;
+                }
+                parent = -1;
+            } else if (p.mother >= 0) {
+                if (vertex_of[p.mother] == 0) {
+                    vertex_of[p.mother] = next_vertex--;
+                    fprintf(fFile, "V %d 0 [%d] @ %.10e %.10e %.10e 0\n", vertex_of[p.mother], p.mother + 1,
+                            event.x, event.y, event.z);
+                }
+                parent = vertex_of[p.mother];
+            }
+            fprintf(fFile, "P %d %d %d %.10e %.10e %.10e %.10e %.10e %d\n", i + 1, parent, p.pdg,
+                    p.px, p.py, p.pz, p.E, p.m, p.status);
+        }
+    }
+}
+
+// Write the last partial block, stop the writer thread and close the output. Returns false
+// if any write failed (e.g. disk full) or gzip did not exit cleanly.
+bool HepMCWriter::Close() {
+    if (!fFile) return true;
+    if (!fCurrent->events.empty()) Submit();
+    {
+        lock_guard<mutex> lock(fMutex);
+        fDone = true;
+    }
+    fCond.notify_all();
+    fThread.join();
+    fFile = nullptr;
+    
+    bool ok = fWriteOk;
+    if (fGzip > 0) {
+        int status;
+        if (waitpid(fGzip, &status, 0) != fGzip || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+        fGzip = -1;
+    }
+    if (!ok) cout << "ERROR: Writing HepMC output " << fName << " failed, the file is incomplete" << endl;
+    return ok;
+}
+
+// Copy the current event (beam, target, products and the decay tree, true 4-vectors) to the writer
+void FusionReaction::ExportEvent(int event, double tar_x, double tar_y) {
+    if (event_weight < 0) return;
+    hepmc_writer->BeginEvent(event, event_weight, tar_x, tar_y, 0.0);
+
+    double p_beam = prepared->BeamMomentum(E_beam_current);
+    hepmc_writer->AddParticle(PDGCode(A_beam, Z_beam), -1, 4, 0.0, 0.0, p_beam, E_beam_current + M_beam, M_beam);
+    hepmc_writer->AddParticle(PDGCode(A_target, Z_target), -1, 4, 0.0, 0.0, 0.0, M_target, M_target);
+
+    if (decay_enabled) {
+        // Decay tree order: products first, daughters after their parent (particle index = entry + 2)
+        for (int e = 0; e < n_decay_tree; e++) {
+            const DecayTreeEntry& entry = decay_tree[e];
+            const FourVector& p4 = (entry.product >= 0) ? product_p4_true[entry.product] : decay_p4_true[entry.slot];
+            int pdg = (entry.product >= 0) ? PDGCode(products[entry.product].A, products[entry.product].Z)
+                                           : PDGCode(decay_A[entry.slot], decay_Z[entry.slot]);
+            hepmc_writer->AddParticle(pdg, entry.parent >= 0 ? entry.parent + 2 : -2, entry.channel >= 0 ? 2 : 1,
+                                      p4.px, p4.py, p4.pz, p4.E, entry.mass + entry.excitation_energy);
+        }
+    } else {
+        for (int i = 0; i < products.size(); i++) {
+            const FourVector& p4 = product_p4_true[i];
+            hepmc_writer->AddParticle(PDGCode(products[i].A, products[i].Z), -2, 1, p4.px, p4.py, p4.pz, p4.E,
+                                      products[i].mass + product_kin.excitation_energy[i]);
+        }
+    }
+}
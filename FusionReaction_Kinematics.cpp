@@ -1,17 +1,230 @@
 #include "FusionReaction.h"
+#include <algorithm>
+
+// Measured 4-vector: measured polar angle (sin, cos) at the true azimuth, momentum p_meas, energy E_meas
+static inline FourVector MeasuredFourVector(const FourVector& v, double sin_theta, double cos_theta, double p_meas, double E_meas) {
+    double pt = sqrt(v.px * v.px + v.py * v.py);
+    double cos_phi = (pt > 0.0) ? v.px / pt : 1.0;
+    double sin_phi = (pt > 0.0) ? v.py / pt : 0.0;
+    
+    FourVector m;
+    m.px = p_meas * sin_theta * cos_phi;
+    m.py = p_meas * sin_theta * sin_phi;
+    m.pz = p_meas * cos_theta;
+    m.E = E_meas;
+    return m;
+}
+
+// Two-body decay momentum: a -> b + c
+static inline double PDK(double a, double b, double c) {
+    double x = (a - b - c) * (a + b + c) * (a - b + c) * (a + b - c);
+    return sqrt(x) / (2.0 * a);
+}
+
+PhaseSpaceGenerator::PhaseSpaceGenerator() {
+    fNt = 0;
+    fTeCmTm = 0.0;
+    fWtMax = 0.0;
+    fBeta[0] = fBeta[1] = fBeta[2] = 0.0;
+}
+
+// Set the decaying system P and the nt daughter masses (same units as P)
+bool PhaseSpaceGenerator::SetDecay(const TLorentzVector& P, int nt, const double* mass) {
+    double kinetic = P.M();
+    for (int n = 0; n < nt && n < kMaxPhaseSpaceParticles; n++) kinetic -= mass[n];
+    return SetDecay(P, nt, mass, kinetic);
+}
+
+// Same, with the kinetic energy M(P) - sum of masses supplied by the caller, who can
+// compute it without subtracting the large masses
+bool PhaseSpaceGenerator::SetDecay(const TLorentzVector& P, int nt, const double* mass, double kinetic) {
+    fNt = nt;
+    if (fNt < 2 || fNt > kMaxPhaseSpaceParticles) return false;
+    
+    fTeCmTm = kinetic;
+    for (int n = 0; n < fNt; n++) fMass[n] = mass[n];
+    if (fTeCmTm <= 0) return false;
+    
+    // Maximum weight (used to normalise the event weight)
+    double emmax = fTeCmTm + fMass[0];
+    double emmin = 0.0;
+    double wtmax = 1.0;
+    for (int n = 1; n < fNt; n++) {
+        emmin += fMass[n - 1];
+        emmax += fMass[n];
+        wtmax *= PDK(emmax, emmin, fMass[n]);
+    }
+    fWtMax = 1.0 / wtmax;
+    
+    // Boost from the rest frame of P to the frame P is given in
+    if (P.Beta() > 0) {
+        fBeta[0] = P.Px() / P.E();
+        fBeta[1] = P.Py() / P.E();
+        fBeta[2] = P.Pz() / P.E();
+    } else {
+        fBeta[0] = fBeta[1] = fBeta[2] = 0.0;
+    }
+    return true;
+}
+
+// Generate one event; returns its phase-space weight
+double PhaseSpaceGenerator::Generate(TRandom3* random) {
+    double u[3 * kMaxPhaseSpaceParticles];
+    random->RndmArray(NUniforms(), u);
+    return Generate(u);
+}
+
+// Generate one event from NUniforms() uniforms, used in the order Generate(TRandom3*) draws them
+double PhaseSpaceGenerator::Generate(const double* u) {
+    double rno[kMaxPhaseSpaceParticles];
+    rno[0] = 0.0;
+    if (fNt > 2) {
+        for (int n = 1; n < fNt - 1; n++) rno[n] = *u++;
+        sort(rno + 1, rno + fNt - 1);
+    }
+    rno[fNt - 1] = 1.0;
+    
+    // Invariant masses of the successive subsystems
+    double invMas[kMaxPhaseSpaceParticles];
+    double sum = 0.0;
+    for (int n = 0; n < fNt; n++) {
+        sum += fMass[n];
+        invMas[n] = rno[n] * fTeCmTm + sum;
+    }
+    
+    double wt = fWtMax;
+    double pd[kMaxPhaseSpaceParticles];
+    for (int n = 0; n < fNt - 1; n++) {
+        pd[n] = PDK(invMas[n + 1], invMas[n], fMass[n + 1]);
+        wt *= pd[n];
+    }
+    
+    // Build the daughters two at a time, rotating randomly and boosting into the next subsystem
+    fDecPro[0].SetPxPyPzE(0, pd[0], 0, sqrt(pd[0] * pd[0] + fMass[0] * fMass[0]));
+    int i = 1;
+    while (true) {
+        fDecPro[i].SetPxPyPzE(0, -pd[i - 1], 0, sqrt(pd[i - 1] * pd[i - 1] + fMass[i] * fMass[i]));
+        
+        double cZ = 2.0 * *u++ - 1.0;
+        double sZ = sqrt(1.0 - cZ * cZ);
+        double angY = 2.0 * TMath::Pi() * *u++;
+        double cY = cos(angY);
+        double sY = sin(angY);
+        for (int j = 0; j <= i; j++) {
+            TLorentzVector& v = fDecPro[j];
+            double x = v.Px();
+            double y = v.Py();
+            v.SetPx(cZ * x - sZ * y);  // Rotation around Z
+            v.SetPy(sZ * x + cZ * y);
+            x = v.Px();
+            double z = v.Pz();
+            v.SetPx(cY * x - sY * z);  // Rotation around Y
+            v.SetPz(sY * x + cY * z);
+        }
+        
+        if (i == fNt - 1) break;
+        
+        double beta = pd[i] / sqrt(pd[i] * pd[i] + invMas[i] * invMas[i]);
+        for (int j = 0; j <= i; j++) fDecPro[j].Boost(0, beta, 0);
+        i++;
+    }
+    
+    for (int n = 0; n < fNt; n++) fDecPro[n].Boost(fBeta[0], fBeta[1], fBeta[2]);
+    return wt;
+}
 
 // Calculate Q-value of the reaction
 double FusionReaction::CalculateQValue() {
     double total_mass_initial = M_beam + M_target;
     double total_mass_final = 0;
     
-    for (int i = 0; i < product_masses.size(); i++) {
-        total_mass_final += product_masses[i];
+    for (int i = 0; i < products.size(); i++) {
+        total_mass_final += products[i].mass;
     }
     
     return total_mass_initial - total_mass_final;
 }
 
+// Build the run constants read by the event loop. Called by InitializeHistograms() once the
+// masses, excited states, decays and missing-mass sets are configured; any later change to the
+// configuration needs another call.
+void FusionReaction::PrepareReaction() {
+    shared_ptr<PreparedReaction> r = make_shared<PreparedReaction>();
+    r->M_beam = M_beam;
+    r->M_target = M_target;
+    r->M0 = M_beam + M_target;
+    r->M0_squared = r->M0 * r->M0;
+    r->Q_value = CalculateQValue();
+    r->nominal_beam_T = E_beam_initial - 0.5 * E_loss;
+    
+    // Excited states: energies and cumulative branching per product (ground state if none is selected)
+    int n_products = products.size();
+    r->fixed_excitation.resize(n_products);
+    r->state_energy.resize(n_products);
+    r->state_cumulative.resize(n_products);
+    for (int i = 0; i < n_products; i++) {
+        r->fixed_excitation[i] = products[i].excitation_energy;
+        if (!multiple_excited_states_enabled) continue;
+        
+        pair<int, int> nucleus_key = make_pair(products[i].A, products[i].Z);
+        map<pair<int, int>, vector<double> >::const_iterator states = excited_states_energies.find(nucleus_key);
+        if (states == excited_states_energies.end()) continue;
+        
+        const vector<double>& ratios = excited_states_ratios[nucleus_key];
+        double cumulative_probability = 0.0;
+        for (int j = 0; j < states->second.size(); j++) {
+            cumulative_probability += ratios[j];
+            r->state_cumulative[i].push_back(cumulative_probability);
+        }
+        r->state_energy[i] = states->second;
+    }
+    
+    // Decays: daughter rest masses, ground-state Q-value and cumulative branching of every channel
+    r->decay_rest_mass.resize(decay_masses.size());
+    for (int slot = 0; slot < decay_masses.size(); slot++) {
+        r->decay_rest_mass[slot] = decay_masses[slot] + decay_excitation[slot];
+    }
+    r->decay_Q_ground.resize(decay_nodes.size());
+    r->channel_cumulative.resize(decay_nodes.size());
+    for (int n = 0; n < decay_nodes.size(); n++) {
+        const DecayNode& node = decay_nodes[n];
+        double parent_mass = (node.parent_product >= 0) ? products[node.parent_product].mass : decay_masses[node.parent_slot];
+        double cumulative_probability = 0.0;
+        for (int c = 0; c < node.channels.size(); c++) {
+            const DecayChannel& channel = node.channels[c];
+            double Q_ground = parent_mass;
+            for (int k = 0; k < channel.n_daughters; k++) {
+                Q_ground -= r->decay_rest_mass[channel.first_slot + k];
+            }
+            r->decay_Q_ground[n].push_back(Q_ground);
+            cumulative_probability += channel.branching;
+            r->channel_cumulative[n].push_back(cumulative_probability);
+        }
+    }
+    
+    for (int s = 0; s < missing_mass_sets.size(); s++) {
+        r->missing_mass_Q_offset.push_back(r->M0 - missing_mass_sets[s].detected_mass);
+    }
+    
+    if (beam_table_points > 0) BuildBeamEnergyTable(r->beam_inverse_cdf);
+    
+    prepared = r;
+}
+
+// Excitation energy of product i for this event (random state if multiple states are enabled)
+double FusionReaction::DrawExcitation(int i) {
+    const vector<double>& energies = prepared->state_energy[i];
+    if (energies.empty()) return prepared->fixed_excitation[i];
+    
+    // Randomly select excited state based on branching ratios (ground state if none is selected)
+    const vector<double>& cumulative = prepared->state_cumulative[i];
+    double random_value = RandomUniform();
+    for (int j = 0; j < energies.size(); j++) {
+        if (random_value <= cumulative[j]) return energies[j];
+    }
+    return 0.0;
+}
+
 // Simplified N-body phase space generation
 double FusionReaction::GeneratePhaseSpace() {
     double Q_val = CalculateQValue();
@@ -21,281 +234,327 @@ double FusionReaction::GeneratePhaseSpace() {
     return E_beam + Q_val; // Total available energy
 }
 
-// Calculate product kinematics using phase space
+// Calculate product kinematics using phase space, then apply resolution and fill histograms
 void FusionReaction::CalculateProductKinematics() {
-    double E_beam = fRandom->Gaus(E_beam_initial, E_beam_re) - E_loss * fRandom->Uniform();
-    E_beam = fRandom->Gaus(E_beam, E_strag);
+    event_weight = GenerateProducts();
+    if (event_weight < 0) {
+        if (products.size() >= 2) cout << "ERROR: Phase space generation failed!" << endl;
+        return;
+    }
+    MeasureProducts();
+}
+
+// True Lab frame kinematics of product i (MeV): momentum, total energy E, kinetic energy T,
+// momentum magnitude and angles (from VectorAngles)
+void FusionReaction::SetProductKinematics(int i, double px, double py, double pz, double E, double T,
+                                          double p, double theta_deg, double phi_deg) {
+    // Event record: true Lab frame 4-vector
+    FourVector& p4 = product_p4_true[i];
+    p4.px = px;
+    p4.py = py;
+    p4.pz = pz;
+    p4.E = E;
+    
+    // Lab frame energy above the ground state: kinetic plus excitation energy
+    product_kin.energy[i] = T + product_kin.excitation_energy[i];
+    product_kin.momentum[i] = p;
+    product_kin.theta[i] = theta_deg * TMath::Pi() / 180.0;
+    product_kin.phi[i] = phi_deg * TMath::Pi() / 180.0;
+}
+
+// Generate the true Lab frame product kinematics of one event
+// Returns the phase-space weight, or -1 if no event could be generated
+double FusionReaction::GenerateProducts() {
+    if (float_batch) return NextBatchedProducts();
+    
+    double E_beam = DrawBeamEnergy();
     
     // Store current beam energy for reconstruction
     E_beam_current = E_beam;
     
+    // New event: cached reconstruction sums are stale
+    event_sums.final_valid = false;
+    event_sums.decay_valid = false;
+    
     int n_products = products.size();
-    if (n_products < 2) return;
+    if (n_products < 2) return -1.0;
     
-    // Convert to GeV for TGenPhaseSpace
-    double E_beam_GeV = E_beam / 1000.0;
-    double M_beam_GeV = M_beam / 1000.0;
-    double M_target_GeV = M_target / 1000.0;
+    // Initial state 4-vector in MeV (Lab frame): beam along z, target at rest
+    TLorentzVector W(0.0, 0.0, prepared->BeamMomentum(E_beam), E_beam + prepared->M0);
     
-    // Create initial state 4-vector in GeV (Lab frame)
-    // Beam total energy = kinetic + mass
-    double E_beam_total = E_beam_GeV + M_beam_GeV;
-    double p_beam = sqrt(E_beam_total * E_beam_total - M_beam_GeV * M_beam_GeV);  // Relativistic momentum
+    // Product rest masses including the excitation energy of this event
+    Double_t masses[kMaxProducts];
+    double kinetic = prepared->AvailableKineticEnergy(E_beam);
+    for (int i = 0; i < n_products; i++) {
+        product_kin.excitation_energy[i] = DrawExcitation(i);
+        masses[i] = products[i].mass + product_kin.excitation_energy[i];
+        kinetic -= product_kin.excitation_energy[i];
+    }
     
-    TLorentzVector beam(0.0, 0.0, p_beam, E_beam_total);
-    TLorentzVector target(0.0, 0.0, 0.0, M_target_GeV);
-    TLorentzVector W = beam + target;  // Total 4-momentum in Lab frame
+    // N-body phase space for all reactions
+    if (!fPhaseSpace->SetDecay(W, n_products, masses, kinetic)) return -1.0;
     
+    Double_t weight = PhaseSpaceWeight(*fPhaseSpace);
     
-    // Set masses for products in GeV (including excitation energy)
-    Double_t masses[10];  // Maximum 10 products
+    // Get decay products (already in Lab frame); angles for all products in one batch
+    double px[kMaxProducts], py[kMaxProducts], pz[kMaxProducts], p[kMaxProducts], theta_deg[kMaxProducts], phi_deg[kMaxProducts];
     for (int i = 0; i < n_products; i++) {
-        double excited_mass = products[i].mass;
-        
-        // If multiple excited states are enabled, randomly select one
-        if (multiple_excited_states_enabled) {
-            pair<int, int> nucleus_key = make_pair(products[i].A, products[i].Z);
-            if (excited_states_energies.find(nucleus_key) != excited_states_energies.end()) {
-                // Randomly select excited state based on branching ratios
-                double random_value = fRandom->Uniform();
-                double cumulative_probability = 0.0;
-                
-                for (int j = 0; j < excited_states_energies[nucleus_key].size(); j++) {
-                    cumulative_probability += excited_states_ratios[nucleus_key][j];
-                    if (random_value <= cumulative_probability) {
-                        excited_mass += excited_states_energies[nucleus_key][j];
-                        products[i].excitation_energy = excited_states_energies[nucleus_key][j];
-                        break;
-                    }
-                }
-            } else {
-                // No excited states configured, use ground state
-                excited_mass += products[i].excitation_energy;
-            }
-        } else {
-            // Single excited state mode
-            excited_mass += products[i].excitation_energy;
-        }
-        
-        masses[i] = excited_mass / 1000.0;  // Convert to GeV
+        TLorentzVector* v = fPhaseSpace->GetDecay(i);
+        px[i] = v->Px();
+        py[i] = v->Py();
+        pz[i] = v->Pz();
     }
+    VectorAngles(n_products, px, py, pz, p, theta_deg, phi_deg);
     
-    // Use TGenPhaseSpace for all reactions
-    if (!fPhaseSpace->SetDecay(W, n_products, masses)) {
-        cout << "ERROR: Phase space generation failed!" << endl;
-        return;
+    // Kinetic energy as p^2 / (E + m)
+    for (int i = 0; i < n_products; i++) {
+        double E = fPhaseSpace->GetDecay(i)->E();
+        SetProductKinematics(i, px[i], py[i], pz[i], E, p[i] * p[i] / (E + masses[i]), p[i], theta_deg[i], phi_deg[i]);
     }
     
-    Double_t weight = fPhaseSpace->Generate();
+    return weight;
+}
+
+// Apply the angular resolution to the generated products and fill the product histograms
+void FusionReaction::MeasureProducts() {
+    int n_products = products.size();
+    
+    // Add angular resolution (experimental uncertainty)
+    double theta_with_resolution[kMaxProducts] = {}, sin_theta[kMaxProducts], cos_theta[kMaxProducts];
+    for (int i = 0; i < n_products; i++) theta_with_resolution[i] = product_kin.theta[i] + RandomGaus(0, th_res);
+    VectorSinCos(n_products, theta_with_resolution, sin_theta, cos_theta);
     
-    // Get decay products (already in Lab frame from TGenPhaseSpace)
     for (int i = 0; i < n_products; i++) {
-        TLorentzVector* p = fPhaseSpace->GetDecay(i);
-        
-        // Extract Lab frame kinematic variables (convert back to MeV)
-        products[i].px = p->Px() * 1000.0;
-        products[i].py = p->Py() * 1000.0;
-        products[i].pz = p->Pz() * 1000.0;
-        products[i].momentum = p->P() * 1000.0;
-        
-        // Set Lab frame momentum components
-        products[i].px_lab = products[i].px;
-        products[i].py_lab = products[i].py;
-        products[i].pz_lab = products[i].pz;
-        products[i].momentum_lab = products[i].momentum;
-        
-        double total_E_GeV = p->E();  // Total energy in GeV (Lab frame)
-        products[i].energy = total_E_GeV * 1000.0 - products[i].mass;  // Kinetic energy in MeV (Lab frame)
-        products[i].energy_lab = products[i].energy;  // Set Lab frame energy
-        
-        products[i].theta = p->Theta();
-        products[i].phi = p->Phi();
-        products[i].theta_lab = p->Theta();  // Lab frame theta (TGenPhaseSpace gives Lab frame results)
-        
-        // Add angular resolution (experimental uncertainty)
-        double theta_with_resolution = products[i].theta + fRandom->Gaus(0, th_res);
+        // Event record: measured Lab frame 4-vector
+        const FourVector& p4 = product_p4_true[i];
+        product_p4_meas[i] = MeasuredFourVector(p4, sin_theta[i], cos_theta[i], product_kin.momentum[i], p4.E);
         
         // Fill histograms with resolution (Lab frame)
-        his_product_angle[i]->Fill(theta_with_resolution * 180.0 / TMath::Pi());
-        his_product_energy[i]->Fill(products[i].energy);
-        his_product_Evsang[i]->Fill(theta_with_resolution * 180.0 / TMath::Pi(), products[i].energy);
-        his_product_theta_E_lab[i]->Fill(theta_with_resolution * 180.0 / TMath::Pi(), products[i].energy);
-        his_multi_momentum->Fill(products[i].px, products[i].py);
+        if (!standard_histograms) continue;
+        double theta_deg = theta_with_resolution[i] * 180.0 / TMath::Pi();
+        his_product_angle[i]->Fill(theta_deg);
+        his_product_energy[i]->Fill(product_kin.energy[i]);
+        his_product_E_theta[i]->Fill(theta_deg, product_kin.energy[i]);
+        his_multi_momentum->Fill(p4.px, p4.py);
         
     }
 }
 
-// Transform from CM frame to Lab frame
-void FusionReaction::TransformToLabFrame() {
-    int n_products = products.size();
-    if (n_products == 0) return;
+// Simulate the decay tree of the current event
+// Reaction products are the roots of the tree. Entries with a decay node are
+// processed depth-first from a fixed-size stack and their daughters are
+// appended to the per-event buffer, so cascades need no allocation.
+// With measure = false only the true kinematics are generated (no resolution, histograms
+// or warnings). Returns the product of the decay phase-space weights.
+double FusionReaction::SimulateDecay(bool measure) {
+    double weight = 1.0;
+    int pending[kMaxDecayEntries];
+    int n_pending = 0;
     
-    // Use the same beam energy that was used in CalculateProductKinematics
-    double E_beam = E_beam_current;
+    n_decay_tree = 0;
+    for (int i = 0; i < products.size() && n_decay_tree < kMaxDecayEntries; i++) {
+        DecayTreeEntry& entry = decay_tree[n_decay_tree];
+        entry.product = i;
+        entry.slot = -1;
+        entry.parent = -1;
+        entry.channel = -1;
+        entry.first_daughter = -1;
+        entry.n_daughters = 0;
+        entry.mass = products[i].mass;
+        entry.excitation_energy = product_kin.excitation_energy[i];
+        
+        if (product_decay_node[i] >= 0) {
+            pending[n_pending++] = n_decay_tree;
+        }
+        n_decay_tree++;
+    }
     
-    // Calculate CM velocity (velocity of CM frame in Lab frame)
-    double p_beam = sqrt(E_beam * (E_beam + 2 * M_beam));
-    double E_beam_total = E_beam + M_beam;  // Beam total energy
-    double E_target_total = M_target;  // Target at rest
-    double E_cm_total = sqrt((E_beam_total + E_target_total) * (E_beam_total + E_target_total) - p_beam * p_beam);
-    double beta_cm = p_beam / (E_beam_total + E_target_total);  // CM frame velocity
-    double gamma_cm = 1.0 / sqrt(1.0 - beta_cm * beta_cm);
+    // Store original parent energy before decay
+    if (decay_product_index >= 0) {
+        original_parent_energy = product_kin.energy[decay_product_index];
+    }
     
-    // Transform each particle from CM to Lab frame
-    for (int i = 0; i < n_products; i++) {
-        // CM frame 4-momentum
-        double E_cm = products[i].energy + products[i].mass;
-        double p_cm = products[i].momentum;
-        double pz_cm = products[i].pz;  // z-component in CM
-        
-        // Lorentz transformation to Lab frame
-        double E_lab_total = gamma_cm * (E_cm + beta_cm * pz_cm);
-        double pz_lab = gamma_cm * (pz_cm + beta_cm * E_cm);
-        
-        // Calculate lab frame momentum components
-        // x,y components are unchanged in Lorentz boost along z-axis
-        double px_lab = products[i].px;  
-        double py_lab = products[i].py;
-        double p_lab = sqrt(px_lab * px_lab + py_lab * py_lab + pz_lab * pz_lab);
-        
-        // Store lab frame momentum components
-        products[i].px_lab = px_lab;
-        products[i].py_lab = py_lab;
-        products[i].pz_lab = pz_lab;
-        products[i].momentum_lab = p_lab;
-        
-        // Lab frame kinetic energy
-        products[i].energy_lab = E_lab_total - products[i].mass;
+    while (n_pending > 0) {
+        int entry_index = pending[--n_pending];
+        if (!DecayEntry(entry_index, measure, weight)) continue;
         
-        // Lab frame angle
-        products[i].theta_lab = acos(pz_lab / p_lab);
-        
-        // Add angular resolution (experimental uncertainty)
-        double theta_lab_with_resolution = products[i].theta_lab + fRandom->Gaus(0, th_res);
-        
-        // Fill lab frame histogram with resolution
-        his_product_theta_E_lab[i]->Fill(theta_lab_with_resolution * 180.0 / TMath::Pi(), 
-                                        products[i].energy_lab);
+        // Daughters with their own decay node are decayed next (sequential emission)
+        const DecayTreeEntry& entry = decay_tree[entry_index];
+        for (int k = entry.n_daughters - 1; k >= 0; k--) {
+            int daughter_index = entry.first_daughter + k;
+            if (decay_slot_node[decay_tree[daughter_index].slot] >= 0) {
+                pending[n_pending++] = daughter_index;
+            }
+        }
     }
+    return weight;
 }
 
-// Simulate decay of unbound state
-void FusionReaction::SimulateDecay() {
-    int n_decay_products = decay_A.size();
-    if (n_decay_products < 2) return;
-    
-    // Get the parent particle that will decay
-    Particle& parent = products[decay_product_index];
+// Decay one entry of the event decay tree through a randomly selected channel
+// The channel's phase-space weight multiplies weight; returns false if the entry stays undecayed
+bool FusionReaction::DecayEntry(int entry_index, bool measure, double& weight) {
+    DecayTreeEntry& parent = decay_tree[entry_index];
+    int node_index = (parent.product >= 0) ? product_decay_node[parent.product] : decay_slot_node[parent.slot];
+    DecayNode& node = decay_nodes[node_index];
     
     // Only decay if the particle is in an excited state (excitation energy > 0)
     if (parent.excitation_energy <= 0.0) {
         // Ground state - no decay
-        return;
+        return false;
     }
     
-    // Store original parent energy before decay
-    original_parent_energy = parent.energy_lab;
-    
-    // Calculate decay Q-value
-    double Q_decay = parent.mass;
-    for (int i = 0; i < n_decay_products; i++) {
-        Q_decay -= decay_masses[i];
+    // Select decay channel based on branching ratios
+    const vector<double>& cumulative = prepared->channel_cumulative[node_index];
+    double random_value = RandomUniform() * cumulative.back();
+    int channel_index = node.channels.size() - 1;
+    for (int c = 0; c < node.channels.size(); c++) {
+        if (random_value <= cumulative[c]) {
+            channel_index = c;
+            break;
+        }
     }
     
-    // Add excitation energy to Q-value (excited state has more energy available)
-    Q_decay += parent.excitation_energy;
+    DecayChannel& channel = node.channels[channel_index];
+    int n_decay_products = channel.n_daughters;
+    if (n_decay_products < 2) return false;
+    
+    // Calculate decay Q-value (excitation energies of parent and daughters included)
+    double Q_decay = prepared->decay_Q_ground[node_index][channel_index] + parent.excitation_energy;
     
     if (Q_decay <= 0) {
-        cout << "WARNING: Decay Q-value is negative or zero: " << Q_decay << " MeV" << endl;
-        cout << "  DECAY: " << parent.name << " (excitation: " << parent.excitation_energy 
-             << " MeV) -> Q-value: " << Q_decay << " MeV" << endl;
-        cout << "  Parent mass: " << parent.mass << " MeV/c^2" << endl;
-        cout << "  Decay products: ";
-        for (int i = 0; i < n_decay_products; i++) {
-            cout << decay_names[i] << " (" << decay_masses[i] << " MeV/c^2)";
-            if (i < n_decay_products - 1) cout << " + ";
+        // Closed channel - the parent stays undecayed; report once per channel
+        if (measure && !channel.closed_warned) {
+            const string& parent_name = (parent.product >= 0) ? products[parent.product].name : decay_names[parent.slot];
+            cout << "WARNING: Decay Q-value is negative or zero: " << Q_decay << " MeV" << endl;
+            cout << "  DECAY: " << parent_name << " (excitation: " << parent.excitation_energy
+                 << " MeV) -> Q-value: " << Q_decay << " MeV" << endl;
+            cout << "  Parent mass: " << parent.mass << " MeV/c^2" << endl;
+            cout << "  Decay products: ";
+            for (int k = 0; k < n_decay_products; k++) {
+                int slot = channel.first_slot + k;
+                cout << decay_names[slot] << " (" << decay_masses[slot] << " MeV/c^2)";
+                if (k < n_decay_products - 1) cout << " + ";
+            }
+            cout << endl;
+            channel.closed_warned = true;
         }
-        cout << endl;
-        return;
+        return false;
+    }
+    
+    if (n_decay_tree + n_decay_products > kMaxDecayEntries) {
+        if (measure && !decay_tree_overflow_warned) {
+            cout << "WARNING: Decay tree exceeds " << kMaxDecayEntries << " entries, further decays skipped" << endl;
+            decay_tree_overflow_warned = true;
+        }
+        return false;
     }
     
-    // Create parent 4-momentum in Lab frame (convert to GeV for TLorentzVector)
-    double E_parent_total = (parent.energy + parent.mass) / 1000.0;  // Convert to GeV
-    double px_parent = parent.px / 1000.0;  // Convert to GeV/c
-    double py_parent = parent.py / 1000.0;  // Convert to GeV/c
-    double pz_parent = parent.pz / 1000.0;  // Convert to GeV/c
+    // Parent at rest (its CM frame) and the boost back to the Lab frame
+    const FourVector& parent_p4 = (parent.product >= 0) ? product_p4_true[parent.product] : decay_p4_true[parent.slot];
+    TLorentzVector parent_4vec_cm(0.0, 0.0, 0.0, parent.mass + parent.excitation_energy);
+    double parent_beta[3] = {parent_p4.px / parent_p4.E, parent_p4.py / parent_p4.E, parent_p4.pz / parent_p4.E};
     
-    TLorentzVector parent_4vec_lab(px_parent, py_parent, pz_parent, E_parent_total);
+    // Rest masses of the decay products (including excitation energy)
+    const double* decay_rest_masses = &prepared->decay_rest_mass[channel.first_slot];
     
-    // Boost to parent's CM frame for decay calculation
-    TVector3 parent_boost = parent_4vec_lab.BoostVector();
-    TLorentzVector parent_4vec_cm = parent_4vec_lab;
-    parent_4vec_cm.Boost(-parent_boost);  // Boost to CM frame
+    // Phase space for the decay in parent's CM frame (the available kinetic energy is Q_decay)
+    if (!fDecayPhaseSpace->SetDecay(parent_4vec_cm, n_decay_products, decay_rest_masses, Q_decay)) {
+        if (measure) cout << "ERROR: Decay phase space generation failed!" << endl;
+        return false;
+    }
     
+    weight *= PhaseSpaceWeight(*fDecayPhaseSpace);
     
+    parent.channel = channel_index;
+    parent.first_daughter = n_decay_tree;
+    parent.n_daughters = n_decay_products;
     
-    // Set masses for decay products in GeV
-    Double_t decay_masses_GeV[10];
-    for (int i = 0; i < n_decay_products; i++) {
-        decay_masses_GeV[i] = decay_masses[i] / 1000.0;
+    // Decay products in parent's CM frame, boosted to the Lab frame in one batch
+    double px[kMaxDecayDaughters], py[kMaxDecayDaughters], pz[kMaxDecayDaughters], E[kMaxDecayDaughters];
+    for (int k = 0; k < n_decay_products; k++) {
+        TLorentzVector* decay_p_cm = fDecayPhaseSpace->GetDecay(k);
+        px[k] = decay_p_cm->Px();
+        py[k] = decay_p_cm->Py();
+        pz[k] = decay_p_cm->Pz();
+        E[k] = decay_p_cm->E();
     }
+    VectorBoost(n_decay_products, px, py, pz, E, parent_beta[0], parent_beta[1], parent_beta[2]);
     
-    // Use TGenPhaseSpace for decay in parent's CM frame
-    TGenPhaseSpace decay_phase_space;
-    if (!decay_phase_space.SetDecay(parent_4vec_cm, n_decay_products, decay_masses_GeV)) {
-        cout << "ERROR: Decay phase space generation failed!" << endl;
-        return;
+    for (int k = 0; k < n_decay_products; k++) {
+        int i = channel.first_slot + k;  // Decay slot
+        
+        DecayTreeEntry& daughter = decay_tree[n_decay_tree++];
+        daughter.product = -1;
+        daughter.slot = i;
+        daughter.parent = entry_index;
+        daughter.channel = -1;
+        daughter.first_daughter = -1;
+        daughter.n_daughters = 0;
+        daughter.mass = decay_masses[i];
+        daughter.excitation_energy = decay_excitation[i];
+        
+        FourVector& p4 = decay_p4_true[i];
+        p4.px = px[k];
+        p4.py = py[k];
+        p4.pz = pz[k];
+        p4.E = E[k];
     }
     
-    Double_t decay_weight = decay_phase_space.Generate();
+    if (measure) MeasureDecayProducts(entry_index, node_index);
+    return true;
+}
+
+// Apply angle and energy resolution to the daughters of a decayed entry and fill the decay histograms
+void FusionReaction::MeasureDecayProducts(int entry_index, int node_index) {
+    const DecayTreeEntry& parent = decay_tree[entry_index];
+    int n_daughters = parent.n_daughters;
     
-    // Get decay products in parent's CM frame, then boost to Lab frame
-    for (int i = 0; i < n_decay_products; i++) {
-        TLorentzVector* decay_p_cm = decay_phase_space.GetDecay(i);
-        
-        // Convert to Lab frame by boosting back
-        TLorentzVector decay_p_lab = *decay_p_cm;
-        decay_p_lab.Boost(parent_boost);  // Boost from CM to Lab frame
-        
-        // Extract decay product kinematic variables (convert back to MeV)
-        double px_decay = decay_p_lab.Px() * 1000.0;
-        double py_decay = decay_p_lab.Py() * 1000.0;
-        double pz_decay = decay_p_lab.Pz() * 1000.0;
-        double p_decay = decay_p_lab.P() * 1000.0;
-        
-        double E_decay_total = decay_p_lab.E() * 1000.0;
-        double E_decay_kinetic = E_decay_total - decay_masses[i];
+    // True angles of all daughters in one batch
+    double px[kMaxDecayDaughters] = {}, py[kMaxDecayDaughters] = {}, pz[kMaxDecayDaughters] = {};
+    double p[kMaxDecayDaughters], theta_deg[kMaxDecayDaughters], phi_deg[kMaxDecayDaughters];
+    for (int k = 0; k < n_daughters; k++) {
+        const FourVector& p4 = decay_p4_true[decay_tree[parent.first_daughter + k].slot];
+        px[k] = p4.px;
+        py[k] = p4.py;
+        pz[k] = p4.pz;
+    }
+    VectorAngles(n_daughters, px, py, pz, p, theta_deg, phi_deg);
+    
+    // Add experimental resolution
+    double theta_with_resolution[kMaxDecayDaughters] = {}, E_kinetic_with_resolution[kMaxDecayDaughters];
+    double sin_theta[kMaxDecayDaughters], cos_theta[kMaxDecayDaughters];
+    for (int k = 0; k < n_daughters; k++) {
+        int i = decay_tree[parent.first_daughter + k].slot;  // Decay slot
         
-        double theta_decay = decay_p_lab.Theta();
-        double phi_decay = decay_p_lab.Phi();
+        // Kinetic energy (MeV); the excitation energy is part of the rest mass
+        double decay_rest_mass = prepared->decay_rest_mass[i];
+        double E_decay_kinetic = p[k] * p[k] / (decay_p4_true[i].E + decay_rest_mass);
         
-        // Add experimental resolution
-        double theta_decay_with_resolution = theta_decay + fRandom->Gaus(0, th_res);
-        double E_decay_kinetic_with_resolution = E_decay_kinetic + fRandom->Gaus(0, E_beam_re);
+        theta_with_resolution[k] = theta_deg[k] * TMath::Pi() / 180.0 + RandomGaus(0, th_res);
+        E_kinetic_with_resolution[k] = E_decay_kinetic + RandomGaus(0, E_beam_re);
+    }
+    VectorSinCos(n_daughters, theta_with_resolution, sin_theta, cos_theta);
+    
+    for (int k = 0; k < n_daughters; k++) {
+        int i = decay_tree[parent.first_daughter + k].slot;  // Decay slot
+        double decay_rest_mass = prepared->decay_rest_mass[i];
+        double E_decay_kinetic_with_resolution = E_kinetic_with_resolution[k];
         
         // Calculate momentum with energy resolution effect
         // p = sqrt(E_kinetic * (E_kinetic + 2*mass))
-        double E_total_with_resolution = E_decay_kinetic_with_resolution + decay_masses[i];
-        double p_decay_with_resolution = sqrt(E_decay_kinetic_with_resolution * (E_decay_kinetic_with_resolution + 2 * decay_masses[i]));
+        double p_decay_with_resolution = sqrt(E_decay_kinetic_with_resolution * (E_decay_kinetic_with_resolution + 2 * decay_rest_mass));
         
-        // Store decay product kinematics for display (Lab frame)
-        // Use resolution-applied values for reconstruction analysis
-        if (i < decay_energies.size()) {
-            decay_energies[i] = E_decay_kinetic_with_resolution;  // Use resolution-applied energy
-            decay_momenta[i] = p_decay_with_resolution;           // Use resolution-applied momentum
-            decay_angles[i] = theta_decay * 180.0 / TMath::Pi();
-            decay_angles_lab[i] = theta_decay_with_resolution * 180.0 / TMath::Pi();
-        } else {
-            decay_energies.push_back(E_decay_kinetic_with_resolution);  // Use resolution-applied energy
-            decay_momenta.push_back(p_decay_with_resolution);           // Use resolution-applied momentum
-            decay_angles.push_back(theta_decay * 180.0 / TMath::Pi());
-            decay_angles_lab.push_back(theta_decay_with_resolution * 180.0 / TMath::Pi());
-        }
+        // Measured 4-vector (angle and energy resolution), used by all reconstructions
+        decay_p4_meas[i] = MeasuredFourVector(decay_p4_true[i], sin_theta[k], cos_theta[k], p_decay_with_resolution,
+                                              E_decay_kinetic_with_resolution + decay_rest_mass);
         
         // Fill decay histograms with resolution
-        his_decay_angle[i]->Fill(theta_decay_with_resolution * 180.0 / TMath::Pi());
+        if (!standard_histograms) continue;
+        double theta_deg_meas = theta_with_resolution[k] * 180.0 / TMath::Pi();
+        his_decay_angle[i]->Fill(theta_deg_meas);
         his_decay_energy[i]->Fill(E_decay_kinetic_with_resolution);
-        his_decay_Evsang[i]->Fill(theta_decay_with_resolution * 180.0 / TMath::Pi(), E_decay_kinetic_with_resolution);
-        his_decay_theta_E_lab[i]->Fill(theta_decay_with_resolution * 180.0 / TMath::Pi(), E_decay_kinetic_with_resolution);
+        his_decay_E_theta[i]->Fill(theta_deg_meas, E_decay_kinetic_with_resolution);
     }
+    
+    if (standard_histograms) his_decay_node_channel[node_index]->Fill(parent.channel);
 }
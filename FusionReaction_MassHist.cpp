@@ -1,18 +1,60 @@
 #include "FusionReaction.h"
 #include "TLegend.h"
+#include <algorithm>
 
-// Read mass file and set particle masses
-void FusionReaction::ReadMassFile(const char* filename) {
+// Load a mass file (lines "A Z mass", an A of 0 ends the table); the first entry of a nucleus wins
+bool MassTable::Load(const char* filename) {
     ifstream mass_file(filename);
+    if (!mass_file) return false;
+    
     int A_temp, Z_temp;
     double M_temp;
-    
+    while (mass_file >> A_temp >> Z_temp >> M_temp) {
+        if (A_temp == 0) break;
+        masses.insert(make_pair(make_pair(A_temp, Z_temp), M_temp));
+    }
+    mass_file.close();
+    return true;
+}
+
+// Look up a nuclear mass (MeV/c^2): loaded entries first, then the built-in table
+bool MassTable::Find(int A, int Z, double& mass) const {
+    map<pair<int, int>, double>::const_iterator it = masses.find(make_pair(A, Z));
+    if (it == masses.end()) return FindBuiltin(A, Z, mass);
+    mass = it->second;
+    return true;
+}
+
+// Binary search in the built-in table
+bool MassTable::FindBuiltin(int A, int Z, double& mass) {
+    const MassEntry* end = kBuiltinMasses + kBuiltinMassCount;
+    const MassEntry* it = lower_bound(kBuiltinMasses, end, make_pair(A, Z),
+        [](const MassEntry& e, const pair<int, int>& key) {
+            return e.A < key.first || (e.A == key.first && e.Z < key.second);
+        });
+    if (it == end || it->A != A || it->Z != Z) return false;
+    mass = it->mass;
+    return true;
+}
+
+// Read mass file (overriding the built-in masses) and set particle masses
+void FusionReaction::ReadMassFile(const char* filename) {
     cout << "Reading mass file: " << filename << endl;
+    MassTable table;
+    if (!table.Load(filename)) {
+        cout << "ERROR: Cannot open mass file: " << filename << endl;
+        exit(1);
+    }
+    SetMasses(table);
+}
+
+// Set beam, target, product and decay product masses from a (shared) mass table
+void FusionReaction::SetMasses(const MassTable& table) {
     cout << "Looking for masses:" << endl;
     cout << "Beam: " << A_beam << " (Z=" << Z_beam << ")" << endl;
     cout << "Target: " << A_target << " (Z=" << Z_target << ")" << endl;
-    for (int i = 0; i < product_A.size(); i++) {
-        cout << "Product " << i+1 << ": " << product_names[i] << " (" << product_A[i] << ", Z=" << product_Z[i] << ")" << endl;
+    for (int i = 0; i < products.size(); i++) {
+        cout << "Product " << i+1 << ": " << products[i].name << " (" << products[i].A << ", Z=" << products[i].Z << ")" << endl;
     }
     
     // Print decay products if enabled
@@ -23,91 +65,72 @@ void FusionReaction::ReadMassFile(const char* filename) {
         }
     }
     
-    bool beam_found = false, target_found = false, parent_found = false;
-    vector<bool> products_found(product_A.size(), false);
-    vector<bool> decay_found(decay_A.size(), false);
+    bool beam_found = table.Find(A_beam, Z_beam, M_beam);
+    if (beam_found) {
+        cout << "Found beam mass: " << A_beam << " (Z=" << Z_beam << ") = " << M_beam << " MeV" << endl;
+    }
+    bool target_found = table.Find(A_target, Z_target, M_target);
+    if (target_found) {
+        cout << "Found target mass: " << A_target << " (Z=" << Z_target << ") = " << M_target << " MeV" << endl;
+    }
     
-    while (mass_file >> A_temp >> Z_temp >> M_temp) {
-        
-        if (A_temp == A_beam && Z_temp == Z_beam && !beam_found) {
-            M_beam = M_temp;
-            beam_found = true;
-            cout << "Found beam mass: " << A_beam << " (Z=" << Z_beam << ") = " << M_temp << " MeV" << endl;
-        }
-        if (A_temp == A_target && Z_temp == Z_target && !target_found) {
-            M_target = M_temp;
-            target_found = true;
-            cout << "Found target mass: " << A_target << " (Z=" << Z_target << ") = " << M_temp << " MeV" << endl;
-        }
-        
-        // Find parent particle mass for reconstruction
-        if (enable_product_reconstruction && A_temp == parent_A && Z_temp == parent_Z && !parent_found) {
-            parent_mass = M_temp;
-            parent_found = true;
-            cout << "Found parent mass: " << parent_name << " (" << parent_A << ", Z=" << parent_Z << ") = " << M_temp << " MeV" << endl;
-        }
-        
-        // Find product masses
-        for (int i = 0; i < product_A.size(); i++) {
-            if (A_temp == product_A[i] && Z_temp == product_Z[i] && !products_found[i]) {
-                product_masses[i] = M_temp;
-                products[i].mass = M_temp;
-                products_found[i] = true;
-                cout << "Found product mass: " << product_names[i] << " (" << product_A[i] << ", Z=" << product_Z[i] << ") = " << M_temp << " MeV" << endl;
-            }
-        }
-        
-        // Find decay product masses
-        for (int i = 0; i < decay_A.size(); i++) {
-            if (A_temp == decay_A[i] && Z_temp == decay_Z[i] && !decay_found[i]) {
-                decay_masses[i] = M_temp;
-                decay_found[i] = true;
-                cout << "Found decay product mass: " << decay_names[i] << " (" << decay_A[i] << ", Z=" << decay_Z[i] << ") = " << M_temp << " MeV" << endl;
-            }
-        }
-        
-        
-        // Check if all masses found
-        bool all_found = beam_found && target_found;
-        for (int i = 0; i < products_found.size(); i++) {
-            all_found = all_found && products_found[i];
-        }
-        for (int i = 0; i < decay_found.size(); i++) {
-            all_found = all_found && decay_found[i];
+    // Find parent particle mass for reconstruction
+    bool parent_found = false;
+    if (enable_product_reconstruction) {
+        parent_found = table.Find(parent_A, parent_Z, parent_mass);
+        if (parent_found) {
+            cout << "Found parent mass: " << parent_name << " (" << parent_A << ", Z=" << parent_Z << ") = " << parent_mass << " MeV" << endl;
         }
-        // Also check parent mass if product reconstruction is enabled
-        if (enable_product_reconstruction) {
-            all_found = all_found && parent_found;
+    }
+    
+    // Find product masses
+    vector<bool> products_found(products.size(), false);
+    for (int i = 0; i < products.size(); i++) {
+        double M_temp;
+        if (table.Find(products[i].A, products[i].Z, M_temp)) {
+            products[i].mass = M_temp;
+            products_found[i] = true;
+            cout << "Found product mass: " << products[i].name << " (" << products[i].A << ", Z=" << products[i].Z << ") = " << M_temp << " MeV" << endl;
         }
-        if (all_found) {
-            cout << "All masses found successfully!" << endl;
-            break;
+    }
+    
+    // Find decay product masses
+    vector<bool> decay_found(decay_A.size(), false);
+    for (int i = 0; i < decay_A.size(); i++) {
+        double M_temp;
+        if (table.Find(decay_A[i], decay_Z[i], M_temp)) {
+            decay_masses[i] = M_temp;
+            decay_found[i] = true;
+            cout << "Found decay product mass: " << decay_names[i] << " (" << decay_A[i] << ", Z=" << decay_Z[i] << ") = " << M_temp << " MeV" << endl;
         }
-        
-        if (A_temp == 0) break;
     }
-    mass_file.close();
     
     // Check for missing masses
+    bool all_found = beam_found && target_found;
     if (!beam_found) {
-        cout << "ERROR: Beam mass not found in mass.dat!" << endl;
+        cout << "ERROR: Beam mass not found in mass table!" << endl;
     }
     if (!target_found) {
-        cout << "ERROR: Target mass not found in mass.dat!" << endl;
+        cout << "ERROR: Target mass not found in mass table!" << endl;
     }
-    for (int i = 0; i < product_A.size(); i++) {
+    for (int i = 0; i < products.size(); i++) {
+        all_found = all_found && products_found[i];
         if (!products_found[i]) {
-            cout << "ERROR: Product mass not found in mass.dat: " << product_names[i] << " (" << product_A[i] << ", Z=" << product_Z[i] << ")" << endl;
+            cout << "ERROR: Product mass not found in mass table: " << products[i].name << " (" << products[i].A << ", Z=" << products[i].Z << ")" << endl;
         }
     }
     for (int i = 0; i < decay_A.size(); i++) {
+        all_found = all_found && decay_found[i];
         if (!decay_found[i]) {
-            cout << "ERROR: Decay product mass not found in mass.dat: " << decay_names[i] << " (" << decay_A[i] << ", Z=" << decay_Z[i] << ")" << endl;
+            cout << "ERROR: Decay product mass not found in mass table: " << decay_names[i] << " (" << decay_A[i] << ", Z=" << decay_Z[i] << ")" << endl;
         }
     }
     if (enable_product_reconstruction && !parent_found) {
-        cout << "ERROR: Parent particle mass not found in mass.dat: " << parent_name << " (" << parent_A << ", Z=" << parent_Z << ")" << endl;
+        all_found = false;
+        cout << "ERROR: Parent particle mass not found in mass table: " << parent_name << " (" << parent_A << ", Z=" << parent_Z << ")" << endl;
     }
+    if (!all_found) exit(1);
+    cout << "All masses found successfully!" << endl;
     
     // Check conservation laws after all masses are loaded
     CheckConservation();
@@ -115,13 +138,21 @@ void FusionReaction::ReadMassFile(const char* filename) {
 
 // Initialize all histograms
 void FusionReaction::InitializeHistograms() {
-    his_beam_E = new TH1D("his_beam_E", "Beam Energy", 4000, 0, 400);
-    his_beam_pos = new TH2F("his_beam_pos", "Beam Position", 100, -10, 10, 100, -10, 10);
-    his_beam_pos->SetOption("COL");
-    
-    his_multi_momentum = new TH2F("his_multi_momentum", "Multi-particle Momentum", 
-                                 100, -1000, 1000, 100, -1000, 1000);
-    his_multi_momentum->SetOption("COL");
+    // Standard beam, product and decay histograms (standard_histograms = false leaves only
+    // the declared observables and the enabled reconstructions)
+    if (standard_histograms) {
+        his_beam_E = new TH1D("his_beam_E", "Beam Energy", 4000, 0, 400);
+        his_beam_pos = new TH2F("his_beam_pos", "Beam Position", 100, -10, 10, 100, -10, 10);
+        his_beam_pos->SetOption("COL");
+        
+        his_multi_momentum = new TH2F("his_multi_momentum", "Multi-particle Momentum", 
+                                     100, -1000, 1000, 100, -1000, 1000);
+        his_multi_momentum->SetOption("COL");
+    } else {
+        his_beam_E = nullptr;
+        his_beam_pos = nullptr;
+        his_multi_momentum = nullptr;
+    }
     
     // Initialize energy reconstruction histograms (if enabled)
     if (enable_total_energy_reconstruction) {
@@ -136,32 +167,37 @@ void FusionReaction::InitializeHistograms() {
         his_total_momentum_mag = nullptr;
     }
     
+    // Event record for products (one 4-vector per product)
+    FourVector zero = {0.0, 0.0, 0.0, 0.0};
+    product_p4_true.assign(products.size(), zero);
+    product_p4_meas.assign(products.size(), zero);
+    
     // Create histograms for each product
-    his_product_angle.resize(products.size());
-    his_product_energy.resize(products.size());
-    his_product_Evsang.resize(products.size());
-    his_product_theta_E_lab.resize(products.size());
+    int n_product_his = standard_histograms ? products.size() : 0;
+    his_product_angle.resize(n_product_his);
+    his_product_energy.resize(n_product_his);
+    his_product_E_theta.resize(n_product_his);
     
-    for (int i = 0; i < products.size(); i++) {
+    for (int i = 0; i < n_product_his; i++) {
         char name[100], title[100];
         sprintf(name, "his_product_%d_angle", i);
-        sprintf(title, "%s Angle", product_names[i].c_str());
+        sprintf(title, "%s Angle", products[i].name.c_str());
         his_product_angle[i] = new TH1D(name, title, 1800, 0, 180);
         
         sprintf(name, "his_product_%d_energy", i);
-        sprintf(title, "%s Energy", product_names[i].c_str());
+        sprintf(title, "%s Energy", products[i].name.c_str());
         // Use wide energy range for auto-adjustment
         his_product_energy[i] = new TH1D(name, title, 2000, 0, 500); // Wide range
         
+        // Evsang and theta_E_lab are filled with the same values: one sparse accumulator
+        his_product_E_theta[i] = new SparseHist2D(180, 0, 180, 1000, 0, 500); // Wide range
         sprintf(name, "his_product_%d_Evsang", i);
-        sprintf(title, "%s E vs Angle (CM)", product_names[i].c_str());
-        his_product_Evsang[i] = new TH2F(name, title, 180, 0, 180, 1000, 0, 500); // Wide range
-        his_product_Evsang[i]->SetOption("COL");
+        sprintf(title, "%s E vs Angle (CM)", products[i].name.c_str());
+        his_product_E_theta[i]->AddOutput(name, title);
         
         sprintf(name, "his_product_%d_theta_E_lab", i);
-        sprintf(title, "%s Theta vs Energy (Lab)", product_names[i].c_str());
-        his_product_theta_E_lab[i] = new TH2F(name, title, 180, 0, 180, 1000, 0, 500); // Wide range
-        his_product_theta_E_lab[i]->SetOption("COL");
+        sprintf(title, "%s Theta vs Energy (Lab)", products[i].name.c_str());
+        his_product_E_theta[i]->AddOutput(name, title);
     }
     
     // Initialize product reconstruction histograms (if enabled)
@@ -185,20 +221,6 @@ void FusionReaction::InitializeHistograms() {
             "Product 1 Actual Energy", 100, 0, 100);
         his_product1_energy_difference = new TH1D("his_product1_energy_difference", 
             "Product 1 Energy Reconstruction Error", 100, -10, 10);
-        
-        // Product 2 histograms (same range as product 1)
-        his_product2_mass_reconstructed = new TH1D("his_product2_mass_reconstructed", 
-            "Product 2 Reconstructed Mass", 200, mass_min, mass_max);
-        his_product2_mass_actual = new TH1D("his_product2_mass_actual", 
-            "Product 2 Actual Mass", 200, mass_min, mass_max);
-        his_product2_mass_difference = new TH1D("his_product2_mass_difference", 
-            "Product 2 Mass Reconstruction Error", 500, -50, 50);
-        his_product2_energy_reconstructed = new TH1D("his_product2_energy_reconstructed", 
-            "Product 2 Reconstructed Energy", 100, 0, 100);
-        his_product2_energy_actual = new TH1D("his_product2_energy_actual", 
-            "Product 2 Actual Energy", 100, 0, 100);
-        his_product2_energy_difference = new TH1D("his_product2_energy_difference", 
-            "Product 2 Energy Reconstruction Error", 100, -10, 10);
     } else {
         // Set all product reconstruction histograms to nullptr
         his_product1_mass_reconstructed = nullptr;
@@ -207,19 +229,167 @@ void FusionReaction::InitializeHistograms() {
         his_product1_energy_reconstructed = nullptr;
         his_product1_energy_actual = nullptr;
         his_product1_energy_difference = nullptr;
-        
-        his_product2_mass_reconstructed = nullptr;
-        his_product2_mass_actual = nullptr;
-        his_product2_mass_difference = nullptr;
-        his_product2_energy_reconstructed = nullptr;
-        his_product2_energy_actual = nullptr;
-        his_product2_energy_difference = nullptr;
     }
     
     // Automatically initialize decay histograms if decay is enabled
     if (decay_enabled) {
         InitializeDecayHistograms();
     }
+    
+    InitializeMissingMassHistograms();
+    InitializeInvariantMassHistograms();
+    
+    if (enable_kinematic_fit) {
+        InitializeFitHistograms();
+    }
+    
+    InitializeObservableHistograms();
+    
+    // Response mode: ground-state mass of the missing system
+    if (response_product >= 0) {
+        response_reference_mass = 0.0;
+        for (int n = 0; n < response_undetected.size(); n++) {
+            response_reference_mass += products[response_undetected[n]].mass;
+        }
+    }
+    
+    // Run constants for the event loop (configuration is complete at this point)
+    PrepareReaction();
+}
+
+// Initialize kinematic fit histograms and the event block
+void FusionReaction::InitializeFitHistograms() {
+    if (!fit_block) fit_block = new FitBlock;
+    fit_block->n_events = 0;
+    
+    his_fit_chi2 = new TH1D("his_fit_chi2", "Kinematic Fit Chi2 (4 constraints)", 500, 0, 50);
+    his_fit_probability = new TH1D("his_fit_probability", "Kinematic Fit Probability", 100, 0, 1);
+    his_fit_beam_energy_difference = new TH1D("his_fit_beam_energy_difference",
+        "Fitted Beam Energy Error (Fitted - Actual)", 400, -10, 10);
+    
+    double parent_particle_mass = 0.0;
+    if (decay_product_index >= 0 && decay_product_index < products.size()) {
+        parent_particle_mass = products[decay_product_index].mass;
+    }
+    his_fit_parent_mass = new TH1D("his_fit_parent_mass", "Fitted Parent Mass",
+        1000, parent_particle_mass - 5, parent_particle_mass + 45);
+    his_fit_parent_mass_difference = new TH1D("his_fit_parent_mass_difference",
+        "Fitted Parent Mass Error (Actual - Fitted)", 1000, -10, 10);
+    
+    his_fit_product_theta_difference.resize(products.size());
+    his_fit_product_energy_difference.resize(products.size());
+    for (int i = 0; i < products.size(); i++) {
+        char name[100], title[100];
+        sprintf(name, "his_fit_product_%d_theta_difference", i);
+        sprintf(title, "%s Fitted Angle Error (deg)", products[i].name.c_str());
+        his_fit_product_theta_difference[i] = new TH1D(name, title, 400, -2, 2);
+        
+        sprintf(name, "his_fit_product_%d_energy_difference", i);
+        sprintf(title, "%s Fitted Energy Error", products[i].name.c_str());
+        his_fit_product_energy_difference[i] = new TH1D(name, title, 400, -10, 10);
+    }
+    
+    his_fit_decay_theta_difference.resize(decay_A.size());
+    his_fit_decay_energy_difference.resize(decay_A.size());
+    for (int i = 0; i < decay_A.size(); i++) {
+        char name[100], title[100];
+        sprintf(name, "his_fit_decay_%d_theta_difference", i);
+        sprintf(title, "%s Fitted Angle Error (deg)", decay_names[i].c_str());
+        his_fit_decay_theta_difference[i] = new TH1D(name, title, 400, -2, 2);
+        
+        sprintf(name, "his_fit_decay_%d_energy_difference", i);
+        sprintf(title, "%s Fitted Energy Error", decay_names[i].c_str());
+        his_fit_decay_energy_difference[i] = new TH1D(name, title, 400, -10, 10);
+    }
+}
+
+// Initialize one invariant-mass histogram per combinatorics subset
+void FusionReaction::InitializeInvariantMassHistograms() {
+    BuildInvariantMassSubsets();
+    
+    int n_products = products.size();
+    int n_subsets = combo_offset.size() - 1;
+    his_invariant_mass.resize(n_subsets);
+    
+    for (int s = 0; s < n_subsets; s++) {
+        // Range starts just below the sum of the member masses (threshold)
+        string label = "";
+        double threshold = 0.0;
+        for (int k = combo_offset[s]; k < combo_offset[s + 1]; k++) {
+            int particle = combo_members[k];
+            if (!label.empty()) label += "+";
+            if (particle < n_products) {
+                label += products[particle].name;
+                threshold += products[particle].mass;
+            } else if (particle < n_products + decay_A.size()) {
+                int slot = particle - n_products;
+                label += decay_names[slot];
+                threshold += decay_masses[slot] + decay_excitation[slot];
+            } else {
+                // Alias of a name repeated across channels: the lightest of its slots
+                double lightest = -1.0;
+                for (int slot = 0; slot < decay_A.size(); slot++) {
+                    if (combo_slot_alias[slot] != particle) continue;
+                    if (lightest < 0.0) label += decay_names[slot];
+                    double mass = decay_masses[slot] + decay_excitation[slot];
+                    if (lightest < 0.0 || mass < lightest) lightest = mass;
+                }
+                threshold += lightest;
+            }
+        }
+        
+        char name[100], title[200];
+        sprintf(name, "his_invariant_mass_%d", s);
+        sprintf(title, "Invariant Mass %s", label.c_str());
+        his_invariant_mass[s] = new TH1D(name, title, 1000, threshold - 5, threshold + 45);
+    }
+}
+
+// Initialize missing-mass block buffers and histograms (masses must be loaded)
+void FusionReaction::InitializeMissingMassHistograms() {
+    for (int s = 0; s < missing_mass_sets.size(); s++) {
+        MissingMassSet& set = missing_mass_sets[s];
+        
+        set.detected_mass = 0.0;
+        for (int n = 0; n < set.detected.size(); n++) {
+            set.detected_mass += products[set.detected[n]].mass;
+        }
+        set.reference_mass = 0.0;
+        for (int n = 0; n < set.undetected.size(); n++) {
+            set.reference_mass += products[set.undetected[n]].mass;
+        }
+        
+        set.n_block = 0;
+        set.beam_T.assign(kEventBlockSize, 0.0);
+        set.E.assign(kEventBlockSize, 0.0);
+        set.px.assign(kEventBlockSize, 0.0);
+        set.py.assign(kEventBlockSize, 0.0);
+        set.pz.assign(kEventBlockSize, 0.0);
+        set.Ex_true.assign(kEventBlockSize, 0.0);
+        set.mass.assign(kEventBlockSize, 0.0);
+        set.Ex.assign(kEventBlockSize, 0.0);
+        set.Q.assign(kEventBlockSize, 0.0);
+        
+        // Ground-state Q-value of the reaction
+        double Q_gs = M_beam + M_target - set.detected_mass - set.reference_mass;
+        
+        char name[100], title[100];
+        sprintf(name, "his_missing_%d_mass", s);
+        sprintf(title, "Missing Mass (detected %s)", set.label.c_str());
+        set.his_mass = new TH1D(name, title, 1000, set.reference_mass - 10, set.reference_mass + 40);
+        
+        sprintf(name, "his_missing_%d_Ex", s);
+        sprintf(title, "Missing Excitation Energy (detected %s)", set.label.c_str());
+        set.his_Ex = new TH1D(name, title, 1000, -10, 40);
+        
+        sprintf(name, "his_missing_%d_Q", s);
+        sprintf(title, "Q-value (detected %s)", set.label.c_str());
+        set.his_Q = new TH1D(name, title, 1000, Q_gs - 40, Q_gs + 10);
+        
+        sprintf(name, "his_missing_%d_Ex_difference", s);
+        sprintf(title, "Missing Ex Reconstruction Error (detected %s)", set.label.c_str());
+        set.his_Ex_difference = new TH1D(name, title, 1000, -5, 5);
+    }
 }
 
 // Initialize decay histograms
@@ -227,12 +397,17 @@ void FusionReaction::InitializeDecayHistograms() {
     if (!decay_enabled) return;
     
     // Create histograms for each decay product with wide initial range
-    his_decay_angle.resize(decay_A.size());
-    his_decay_energy.resize(decay_A.size());
-    his_decay_Evsang.resize(decay_A.size());
-    his_decay_theta_E_lab.resize(decay_A.size());
+    int n_decay_his = standard_histograms ? decay_A.size() : 0;
+    his_decay_angle.resize(n_decay_his);
+    his_decay_energy.resize(n_decay_his);
+    his_decay_E_theta.resize(n_decay_his);
     
-    for (int i = 0; i < decay_A.size(); i++) {
+    // Event record for decay products (one 4-vector per slot)
+    FourVector zero = {0.0, 0.0, 0.0, 0.0};
+    decay_p4_true.assign(decay_A.size(), zero);
+    decay_p4_meas.assign(decay_A.size(), zero);
+    
+    for (int i = 0; i < n_decay_his; i++) {
         char name[100], title[100];
         sprintf(name, "his_decay_%d_angle", i);
         sprintf(title, "%s Decay Angle", decay_names[i].c_str());
@@ -242,15 +417,27 @@ void FusionReaction::InitializeDecayHistograms() {
         sprintf(title, "%s Decay Energy", decay_names[i].c_str());
         his_decay_energy[i] = new TH1D(name, title, 2000, 0, 500); // Very wide initial range
         
+        his_decay_E_theta[i] = new SparseHist2D(180, 0, 180, 1000, 0, 500); // Very wide initial range
         sprintf(name, "his_decay_%d_Evsang", i);
         sprintf(title, "%s Decay E vs Angle (CM)", decay_names[i].c_str());
-        his_decay_Evsang[i] = new TH2F(name, title, 180, 0, 180, 1000, 0, 500); // Very wide initial range
-        his_decay_Evsang[i]->SetOption("COL");
+        his_decay_E_theta[i]->AddOutput(name, title);
         
         sprintf(name, "his_decay_%d_theta_E_lab", i);
         sprintf(title, "%s Decay Theta vs Energy (Lab)", decay_names[i].c_str());
-        his_decay_theta_E_lab[i] = new TH2F(name, title, 180, 0, 180, 1000, 0, 500); // Very wide initial range
-        his_decay_theta_E_lab[i]->SetOption("COL");
+        his_decay_E_theta[i]->AddOutput(name, title);
+    }
+    
+    // Channel selection histogram for each decay node
+    his_decay_node_channel.resize(standard_histograms ? decay_nodes.size() : 0);
+    for (int n = 0; n < his_decay_node_channel.size(); n++) {
+        const DecayNode& node = decay_nodes[n];
+        string parent = (node.parent_product >= 0) ? products[node.parent_product].name : decay_names[node.parent_slot];
+        int n_channels = node.channels.size();
+        
+        char name[100], title[100];
+        sprintf(name, "his_decay_node_%d_channel", n);
+        sprintf(title, "%s Decay Channel", parent.c_str());
+        his_decay_node_channel[n] = new TH1D(name, title, n_channels, -0.5, n_channels - 0.5);
     }
     
     // Initialize parent particle reconstruction histograms (if enabled)
@@ -307,20 +494,6 @@ void FusionReaction::InitializeDecayHistograms() {
             "Product 1 Actual Energy", 100, 0, 100);
         his_product1_energy_difference = new TH1D("his_product1_energy_difference", 
             "Product 1 Energy Reconstruction Error", 100, -10, 10);
-        
-        // Product 2 histograms
-        his_product2_mass_reconstructed = new TH1D("his_product2_mass_reconstructed", 
-            "Product 2 Reconstructed Mass", 100, 0, 1000);
-        his_product2_mass_actual = new TH1D("his_product2_mass_actual", 
-            "Product 2 Actual Mass", 100, 0, 1000);
-        his_product2_mass_difference = new TH1D("his_product2_mass_difference", 
-            "Product 2 Mass Reconstruction Error", 100, -50, 50);
-        his_product2_energy_reconstructed = new TH1D("his_product2_energy_reconstructed", 
-            "Product 2 Reconstructed Energy", 100, 0, 100);
-        his_product2_energy_actual = new TH1D("his_product2_energy_actual", 
-            "Product 2 Actual Energy", 100, 0, 100);
-        his_product2_energy_difference = new TH1D("his_product2_energy_difference", 
-            "Product 2 Energy Reconstruction Error", 100, -10, 10);
     } else {
         // Set all product reconstruction histograms to nullptr
         his_product1_mass_reconstructed = nullptr;
@@ -329,13 +502,6 @@ void FusionReaction::InitializeDecayHistograms() {
         his_product1_energy_reconstructed = nullptr;
         his_product1_energy_actual = nullptr;
         his_product1_energy_difference = nullptr;
-        
-        his_product2_mass_reconstructed = nullptr;
-        his_product2_mass_actual = nullptr;
-        his_product2_mass_difference = nullptr;
-        his_product2_energy_reconstructed = nullptr;
-        his_product2_energy_actual = nullptr;
-        his_product2_energy_difference = nullptr;
     }
 }
 
@@ -345,17 +511,19 @@ void FusionReaction::DrawResults() {
     AutoAdjustHistogramRanges();
     
     // Canvas 1: Beam properties and momentum
-    TCanvas* c1 = new TCanvas("c1", "Beam and Momentum", 1200, 400);
-    c1->Divide(3, 1);
-    
-    c1->cd(1);
-    his_beam_E->Draw();
-    
-    c1->cd(2);
-    his_beam_pos->Draw("COL");
-    
-    c1->cd(3);
-    his_multi_momentum->Draw("COL");
+    if (standard_histograms) {
+        TCanvas* c1 = new TCanvas("c1", "Beam and Momentum", 1200, 400);
+        c1->Divide(3, 1);
+        
+        c1->cd(1);
+        his_beam_E->Draw();
+        
+        c1->cd(2);
+        his_beam_pos->Draw("COL");
+        
+        c1->cd(3);
+        his_multi_momentum->Draw("COL");
+    }
     
     // Canvas 2: Energy reconstruction (if enabled)
     if (enable_total_energy_reconstruction) {
@@ -376,7 +544,7 @@ void FusionReaction::DrawResults() {
     }
     
     // Canvas 3+: Lab Frame Distributions for all particles
-    int n_products = his_product_theta_E_lab.size();
+    int n_products = his_product_E_theta.size();
     if (n_products > 0) {
         // Calculate number of canvases needed (4 plots per canvas)
         int n_canvases = (n_products + 3) / 4;  // Round up
@@ -399,14 +567,14 @@ void FusionReaction::DrawResults() {
             for (int i = 0; i < n_plots; i++) {
                 c->cd(i + 1);
                 gPad->SetRightMargin(0.15);
-                his_product_theta_E_lab[start_idx + i]->Draw("COLZ");
+                his_product_E_theta[start_idx + i]->Dense(1)->Draw("COLZ");
             }
         }
     }
     
     // Draw decay histograms if decay is enabled
-    if (decay_enabled && his_decay_theta_E_lab.size() > 0) {
-        int n_decay_products = his_decay_theta_E_lab.size();
+    if (decay_enabled && his_decay_E_theta.size() > 0) {
+        int n_decay_products = his_decay_E_theta.size();
         int n_decay_canvases = (n_decay_products + 3) / 4;  // Round up
         
         for (int canvas_idx = 0; canvas_idx < n_decay_canvases; canvas_idx++) {
@@ -427,7 +595,7 @@ void FusionReaction::DrawResults() {
             for (int i = 0; i < n_plots; i++) {
                 c->cd(i + 1);
                 gPad->SetRightMargin(0.15);
-                his_decay_theta_E_lab[start_idx + i]->Draw("COLZ");
+                his_decay_E_theta[start_idx + i]->Dense(1)->Draw("COLZ");
             }
         }
     }
@@ -549,16 +717,8 @@ void FusionReaction::AutoAdjustHistogramRanges() {
             }
             
             // Also check 2D histograms for maximum energy
-            if (his_product_theta_E_lab[i] && his_product_theta_E_lab[i]->GetEntries() > 0) {
-                int n_y_bins = his_product_theta_E_lab[i]->GetNbinsY();
-                for (int y_bin = 1; y_bin <= n_y_bins; y_bin++) {
-                    for (int x_bin = 1; x_bin <= his_product_theta_E_lab[i]->GetNbinsX(); x_bin++) {
-                        if (his_product_theta_E_lab[i]->GetBinContent(x_bin, y_bin) > 0) {
-                            double y_center = his_product_theta_E_lab[i]->GetYaxis()->GetBinCenter(y_bin);
-                            actual_max = TMath::Max(actual_max, y_center);
-                        }
-                    }
-                }
+            if (his_product_E_theta[i] && his_product_E_theta[i]->GetEntries() > 0) {
+                actual_max = TMath::Max(actual_max, his_product_E_theta[i]->MaxFilledY());
             }
             
             if (actual_max > 0) {
@@ -566,17 +726,16 @@ void FusionReaction::AutoAdjustHistogramRanges() {
                 double new_max = actual_max * 1.5;
                 double min_val = his_product_energy[i]->GetXaxis()->GetXmin();
                 
-                cout << "Adjusting fusion product " << i << " (" << product_names[i] << ") range: " 
+                cout << "Adjusting fusion product " << i << " (" << products[i].name << ") range: " 
                      << min_val << " - " << new_max << " MeV (actual max: " << actual_max << " MeV)" << endl;
                 
                 his_product_energy[i]->GetXaxis()->SetRangeUser(min_val, new_max);
                 
                 // Also adjust 2D histograms
-                if (his_product_Evsang[i]) {
-                    his_product_Evsang[i]->GetYaxis()->SetRangeUser(0, new_max);
-                }
-                if (his_product_theta_E_lab[i]) {
-                    his_product_theta_E_lab[i]->GetYaxis()->SetRangeUser(0, new_max);
+                if (his_product_E_theta[i]) {
+                    for (int k = 0; k < his_product_E_theta[i]->NumOutputs(); k++) {
+                        his_product_E_theta[i]->Dense(k)->GetYaxis()->SetRangeUser(0, new_max);
+                    }
                 }
             }
         }
@@ -598,16 +757,8 @@ void FusionReaction::AutoAdjustHistogramRanges() {
                 }
                 
                 // Also check 2D histograms for maximum energy
-                if (his_decay_theta_E_lab[i] && his_decay_theta_E_lab[i]->GetEntries() > 0) {
-                    int n_y_bins = his_decay_theta_E_lab[i]->GetNbinsY();
-                    for (int y_bin = 1; y_bin <= n_y_bins; y_bin++) {
-                        for (int x_bin = 1; x_bin <= his_decay_theta_E_lab[i]->GetNbinsX(); x_bin++) {
-                            if (his_decay_theta_E_lab[i]->GetBinContent(x_bin, y_bin) > 0) {
-                                double y_center = his_decay_theta_E_lab[i]->GetYaxis()->GetBinCenter(y_bin);
-                                actual_max = TMath::Max(actual_max, y_center);
-                            }
-                        }
-                    }
+                if (his_decay_E_theta[i] && his_decay_E_theta[i]->GetEntries() > 0) {
+                    actual_max = TMath::Max(actual_max, his_decay_E_theta[i]->MaxFilledY());
                 }
                 
                 if (actual_max > 0) {
@@ -621,11 +772,10 @@ void FusionReaction::AutoAdjustHistogramRanges() {
                     his_decay_energy[i]->GetXaxis()->SetRangeUser(min_val, new_max);
                     
                     // Also adjust 2D histograms
-                    if (his_decay_Evsang[i]) {
-                        his_decay_Evsang[i]->GetYaxis()->SetRangeUser(0, new_max);
-                    }
-                    if (his_decay_theta_E_lab[i]) {
-                        his_decay_theta_E_lab[i]->GetYaxis()->SetRangeUser(0, new_max);
+                    if (his_decay_E_theta[i]) {
+                        for (int k = 0; k < his_decay_E_theta[i]->NumOutputs(); k++) {
+                            his_decay_E_theta[i]->Dense(k)->GetYaxis()->SetRangeUser(0, new_max);
+                        }
                     }
                 }
             }
@@ -0,0 +1,260 @@
+#include "FusionReaction.h"
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+LiveMonitor::LiveMonitor(int port, double interval, const vector<string>& names) {
+    fNames = names;
+    fSnapshots.resize(names.size());
+    fEvents.assign(names.size(), 0);
+    fPlanned.assign(names.size(), 0);
+    fTime.assign(names.size(), 0.0);
+    fRate.assign(names.size(), 0.0);
+    fNextOffer.assign(names.size(), 0.0);
+    fStart = chrono::steady_clock::now();
+    fPort = port;
+    fInterval = interval;
+    fSocket = -1;
+    fRunning = false;
+}
+
+LiveMonitor::~LiveMonitor() {
+    Stop();
+    for (int r = 0; r < fSnapshots.size(); r++) {
+        for (int h = 0; h < fSnapshots[r].size(); h++) delete fSnapshots[r][h];
+    }
+}
+
+// Listen on 127.0.0.1:port (port 0 picks a free one) and serve from a background thread
+bool LiveMonitor::Start() {
+    fSocket = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    if (fSocket >= 0) setsockopt(fSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(fPort);
+    if (fSocket < 0 || bind(fSocket, (sockaddr*)&address, sizeof(address)) != 0 || listen(fSocket, 16) != 0) {
+        cout << "WARNING: Cannot start the monitoring server on port " << fPort << ": " << strerror(errno)
+             << ", running without it" << endl;
+        if (fSocket >= 0) close(fSocket);
+        fSocket = -1;
+        return false;
+    }
+    socklen_t length = sizeof(address);
+    getsockname(fSocket, (sockaddr*)&address, &length);
+    fPort = ntohs(address.sin_port);
+
+    fStart = chrono::steady_clock::now();
+    fRunning = true;
+    fThread = thread(&LiveMonitor::Serve, this);
+    cout << "Monitoring at http://127.0.0.1:" << fPort << "/ (snapshots every " << fInterval << " s)" << endl;
+    return true;
+}
+
+void LiveMonitor::Stop() {
+    if (!fRunning) return;
+    fRunning = false;
+    fThread.join();
+    close(fSocket);
+    fSocket = -1;
+}
+
+// True if the reaction's next snapshot is due (read by the reaction's own thread only)
+bool LiveMonitor::Due(int reaction) const {
+    return chrono::duration<double>(chrono::steady_clock::now() - fStart).count() >= fNextOffer[reaction];
+}
+
+// Called by a reaction at block boundaries: copy its histograms if the interval has passed
+// (always if force is set). Never waits for the server unless forced.
+void LiveMonitor::Offer(int reaction, const vector<TH1*>& histograms, int events, int planned, bool force) {
+    double now = chrono::duration<double>(chrono::steady_clock::now() - fStart).count();
+    if (!force && now < fNextOffer[reaction]) return;
+
+    unique_lock<mutex> lock(fMutex, defer_lock);
+    if (force) lock.lock();
+    else if (!lock.try_lock()) return;  // Server is reading, try again next block
+    fNextOffer[reaction] = now + fInterval;
+
+    vector<TH1*>& snapshot = fSnapshots[reaction];
+    if (snapshot.empty()) {
+        for (int h = 0; h < histograms.size(); h++) {
+            TH1* copy = (TH1*)histograms[h]->Clone();
+            copy->SetDirectory(nullptr);
+            snapshot.push_back(copy);
+        }
+    } else {
+        for (int h = 0; h < histograms.size(); h++) {
+            snapshot[h]->Reset();
+            snapshot[h]->Add(histograms[h]);
+        }
+    }
+    if (now > fTime[reaction]) fRate[reaction] = (events - fEvents[reaction]) / (now - fTime[reaction]);
+    fEvents[reaction] = events;
+    fPlanned[reaction] = planned;
+    fTime[reaction] = now;
+}
+
+// Accept connections until Stop(); one request per connection
+void LiveMonitor::Serve() {
+    while (fRunning) {
+        pollfd listening = {fSocket, POLLIN, 0};
+        if (poll(&listening, 1, 200) <= 0) continue;
+        int fd = accept(fSocket, nullptr, nullptr);
+        if (fd < 0) continue;
+
+        // Request line "GET <path> HTTP/1.x"; the headers are not needed
+        string request;
+        char chunk[1024];
+        while (request.find('\n') == string::npos && request.size() < 8192) {
+            pollfd client = {fd, POLLIN, 0};
+            if (poll(&client, 1, 1000) <= 0) break;
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n <= 0) break;
+            request.append(chunk, n);
+        }
+        istringstream line(request);
+        string method, path;
+        line >> method >> path;
+
+        string reply;
+        if (method != "GET") {
+            reply = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        } else {
+            reply = Respond(path);
+        }
+        size_t done = 0;
+        while (done < reply.size()) {
+            ssize_t n = send(fd, reply.data() + done, reply.size() - done, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            done += n;
+        }
+        close(fd);
+    }
+}
+
+static string JsonString(const string& text) {
+    string quoted = "\"";
+    for (int i = 0; i < text.size(); i++) {
+        if (text[i] == '"' || text[i] == '\\') quoted += '\\';
+        quoted += text[i];
+    }
+    return quoted + "\"";
+}
+
+static string HttpReply(const char* status, const char* type, const string& body) {
+    ostringstream out;
+    out << "HTTP/1.0 " << status << "\r\nContent-Type: " << type << "\r\nContent-Length: " << body.size()
+        << "\r\nAccess-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n" << body;
+    return out.str();
+}
+
+bool SameBinning(const TH1* a, const TH1* b) {
+    if (a->GetDimension() != b->GetDimension()) return false;
+    const TAxis* ax[2] = {a->GetXaxis(), a->GetYaxis()};
+    const TAxis* bx[2] = {b->GetXaxis(), b->GetYaxis()};
+    for (int d = 0; d < a->GetDimension() && d < 2; d++) {
+        if (ax[d]->GetNbins() != bx[d]->GetNbins() || ax[d]->GetXmin() != bx[d]->GetXmin() ||
+            ax[d]->GetXmax() != bx[d]->GetXmax()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// "/": throughput and the statistics of the merged histograms (text);
+// "/hist/<name>": one merged histogram with its binning and contents (JSON)
+string LiveMonitor::Respond(const string& path) {
+    lock_guard<mutex> lock(fMutex);
+
+    // Same-named histograms of all reactions, in first-seen order (as the summed histograms
+    // of the results file)
+    vector<vector<TH1*> > merged;
+    for (int r = 0; r < fSnapshots.size(); r++) {
+        for (int h = 0; h < fSnapshots[r].size(); h++) {
+            TH1* his = fSnapshots[r][h];
+            int m = 0;
+            while (m < merged.size() && strcmp(merged[m][0]->GetName(), his->GetName()) != 0) m++;
+            if (m == merged.size()) merged.push_back(vector<TH1*>());
+            if (merged[m].empty() || SameBinning(merged[m][0], his)) merged[m].push_back(his);
+        }
+    }
+
+    ostringstream out;
+    out << setprecision(8);
+    if (path == "/") {
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - fStart).count();
+        long long events = 0, planned = 0;
+        double rate = 0.0;
+        out << "elapsed " << elapsed << " s" << endl;
+        for (int r = 0; r < fNames.size(); r++) {
+            out << fNames[r] << ": " << fEvents[r] << " / " << fPlanned[r] << " events, "
+                << fRate[r] << " events/s" << endl;
+            events += fEvents[r];
+            planned += fPlanned[r];
+            rate += fRate[r];
+        }
+        out << "total: " << events << " / " << planned << " events, " << rate << " events/s";
+        if (rate > 0.0 && planned > events) out << ", eta " << (planned - events) / rate << " s";
+        out << endl;
+        for (int m = 0; m < merged.size(); m++) {
+            double entries = 0.0, sums[13], total[4] = {0.0, 0.0, 0.0, 0.0};
+            for (int k = 0; k < merged[m].size(); k++) {
+                merged[m][k]->GetStats(sums);
+                for (int s = 0; s < 4; s++) total[s] += sums[s];
+                entries += merged[m][k]->GetEntries();
+            }
+            double mean = total[0] > 0.0 ? total[2] / total[0] : 0.0;
+            double rms = total[0] > 0.0 ? sqrt(max(total[3] / total[0] - mean * mean, 0.0)) : 0.0;
+            out << "hist " << merged[m][0]->GetName() << " " << entries << " " << mean << " " << rms << endl;
+        }
+        return HttpReply("200 OK", "text/plain", out.str());
+    }
+
+    if (path.compare(0, 6, "/hist/") == 0) {
+        string name = path.substr(6);
+        for (int m = 0; m < merged.size(); m++) {
+            const TH1* first = merged[m][0];
+            if (name != first->GetName()) continue;
+
+            // Contents of bins 1..nx (x fastest, then y for 2D), summed over reactions
+            int nx = first->GetNbinsX(), ny = first->GetDimension() > 1 ? first->GetNbinsY() : 1;
+            double entries = 0.0;
+            for (int k = 0; k < merged[m].size(); k++) entries += merged[m][k]->GetEntries();
+            out << "{\"name\":" << JsonString(first->GetName()) << ",\"title\":" << JsonString(first->GetTitle())
+                << ",\"entries\":" << entries << ",\"x\":{\"nbins\":" << nx << ",\"min\":" << first->GetXaxis()->GetXmin()
+                << ",\"max\":" << first->GetXaxis()->GetXmax() << "}";
+            if (first->GetDimension() > 1) {
+                out << ",\"y\":{\"nbins\":" << ny << ",\"min\":" << first->GetYaxis()->GetXmin()
+                    << ",\"max\":" << first->GetYaxis()->GetXmax() << "}";
+            }
+            out << ",\"contents\":[";
+            for (int by = 1; by <= ny; by++) {
+                for (int bx = 1; bx <= nx; bx++) {
+                    int bin = first->GetDimension() > 1 ? first->GetBin(bx, by) : bx;
+                    double content = 0.0;
+                    for (int k = 0; k < merged[m].size(); k++) content += merged[m][k]->GetBinContent(bin);
+                    out << (by == 1 && bx == 1 ? "" : ",") << content;
+                }
+            }
+            out << "]}";
+            return HttpReply("200 OK", "application/json", out.str());
+        }
+    }
+    return HttpReply("404 Not Found", "text/plain", "not found: " + path + "\n");
+}
+
+// Attach the reaction to a monitor as reaction index (call after InitializeHistograms)
+void FusionReaction::SetLiveMonitor(LiveMonitor* monitor, int index) {
+    live_monitor = monitor;
+    live_index = index;
+    live_his.clear();
+    if (monitor) CollectHistograms(live_his);
+}
@@ -0,0 +1,465 @@
+#include "FusionReaction.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Expression being compiled: text, read position, particle names and the op/member lists
+// it is appended to
+struct ObservableSource {
+    const string& text;
+    size_t pos;
+    const vector<string>& particles;  // Particle names, numbered as the event's particles
+    vector<ObservableOp>& ops;
+    vector<int>& members;
+    int depth, max_depth;             // Stack depth after the ops so far
+};
+
+// Functions of particles: name, op code, true 4-vectors, exactly one particle
+struct ParticleFunction {
+    const char* name;
+    int code;
+    bool truth;
+    bool single;
+};
+
+static const ParticleFunction kParticleFunctions[] = {
+    {"E", kObsEnergy, false, true},      {"E_true", kObsEnergy, true, true},
+    {"theta", kObsTheta, false, true},   {"theta_true", kObsTheta, true, true},
+    {"phi", kObsPhi, false, true},       {"phi_true", kObsPhi, true, true},
+    {"p", kObsMomentum, false, true},    {"p_true", kObsMomentum, true, true},
+    {"Ex", kObsExcitation, true, true},
+    {"M", kObsMass, false, false},       {"M_true", kObsMass, true, false},
+    {"MM", kObsMissingMass, false, false}, {"MM_true", kObsMissingMass, true, false}
+};
+
+// Comparison operators, two-character tokens first
+static const struct {
+    const char* token;
+    int code;
+} kComparisons[] = {
+    {"<=", kObsLessEqual}, {">=", kObsGreaterEqual}, {"==", kObsEqual}, {"!=", kObsNotEqual},
+    {"<", kObsLess}, {">", kObsGreater}
+};
+
+static void CompileError(const ObservableSource& source, const string& message) {
+    cout << "ERROR: Observable '" << source.text << "': " << message << " at position " << source.pos + 1 << endl;
+    exit(1);
+}
+
+static void SkipSpaces(ObservableSource& source) {
+    while (source.pos < source.text.size() && isspace((unsigned char)source.text[source.pos])) source.pos++;
+}
+
+// Consume the token if it comes next
+static bool Accept(ObservableSource& source, const char* token) {
+    SkipSpaces(source);
+    size_t n = strlen(token);
+    if (source.text.compare(source.pos, n, token) != 0) return false;
+    source.pos += n;
+    return true;
+}
+
+static void Expect(ObservableSource& source, const char* token) {
+    if (!Accept(source, token)) CompileError(source, string("expected '") + token + "'");
+}
+
+// Append an op that changes the stack depth by pushes
+static void Emit(ObservableSource& source, int code, int pushes, double value = 0.0, bool truth = false,
+                 int first = 0, int last = 0) {
+    ObservableOp op = {code, truth, first, last, value};
+    source.ops.push_back(op);
+    source.depth += pushes;
+    source.max_depth = max(source.max_depth, source.depth);
+}
+
+static void ParseOr(ObservableSource& source);
+
+// Particle list "(name, name, ...)" of a particle function
+static void ParseParticles(ObservableSource& source, const ParticleFunction& function) {
+    Expect(source, "(");
+    int first = source.members.size();
+    do {
+        SkipSpaces(source);
+        size_t start = source.pos;
+        while (source.pos < source.text.size() && source.text[source.pos] != ',' && source.text[source.pos] != ')') {
+            source.pos++;
+        }
+        string name = source.text.substr(start, source.pos - start);
+        while (!name.empty() && isspace((unsigned char)name[name.size() - 1])) name.erase(name.size() - 1);
+
+        int particle = find(source.particles.begin(), source.particles.end(), name) - source.particles.begin();
+        if (particle == source.particles.size()) {
+            source.pos = start;
+            CompileError(source, "'" + name + "' is neither a product nor a decay product");
+        }
+        source.members.push_back(particle);
+    } while (Accept(source, ","));
+    Expect(source, ")");
+
+    if (function.single && source.members.size() - first != 1) {
+        CompileError(source, string(function.name) + "() takes one particle");
+    }
+    Emit(source, function.code, 1, 0.0, function.truth, first, source.members.size());
+}
+
+// Number, (expression), E_beam, sqrt()/abs() or a particle function
+static void ParsePrimary(ObservableSource& source) {
+    if (Accept(source, "(")) {
+        ParseOr(source);
+        Expect(source, ")");
+        return;
+    }
+
+    const char* start = source.text.c_str() + source.pos;
+    if (isdigit((unsigned char)*start) || *start == '.') {
+        char* end;
+        double value = strtod(start, &end);
+        source.pos += end - start;
+        Emit(source, kObsConst, 1, value);
+        return;
+    }
+
+    size_t begin = source.pos;
+    while (source.pos < source.text.size() && (isalnum((unsigned char)source.text[source.pos]) || source.text[source.pos] == '_')) {
+        source.pos++;
+    }
+    string name = source.text.substr(begin, source.pos - begin);
+    if (name.empty()) CompileError(source, "expected a number, a name or '('");
+
+    if (name == "E_beam") {
+        Emit(source, kObsBeamEnergy, 1);
+        return;
+    }
+    if (name == "sqrt" || name == "abs") {
+        Expect(source, "(");
+        ParseOr(source);
+        Expect(source, ")");
+        Emit(source, name == "sqrt" ? kObsSqrt : kObsAbs, 0);
+        return;
+    }
+    for (int f = 0; f < sizeof(kParticleFunctions) / sizeof(kParticleFunctions[0]); f++) {
+        if (name != kParticleFunctions[f].name) continue;
+        ParseParticles(source, kParticleFunctions[f]);
+        return;
+    }
+    source.pos = begin;
+    CompileError(source, "unknown name '" + name + "'");
+}
+
+static void ParseUnary(ObservableSource& source) {
+    if (Accept(source, "-")) {
+        ParseUnary(source);
+        Emit(source, kObsNeg, 0);
+    } else if (Accept(source, "!")) {
+        ParseUnary(source);
+        Emit(source, kObsNot, 0);
+    } else {
+        ParsePrimary(source);
+    }
+}
+
+static void ParseProduct(ObservableSource& source) {
+    ParseUnary(source);
+    while (true) {
+        if (Accept(source, "*")) {
+            ParseUnary(source);
+            Emit(source, kObsMul, -1);
+        } else if (Accept(source, "/")) {
+            ParseUnary(source);
+            Emit(source, kObsDiv, -1);
+        } else {
+            return;
+        }
+    }
+}
+
+static void ParseSum(ObservableSource& source) {
+    ParseProduct(source);
+    while (true) {
+        if (Accept(source, "+")) {
+            ParseProduct(source);
+            Emit(source, kObsAdd, -1);
+        } else if (Accept(source, "-")) {
+            ParseProduct(source);
+            Emit(source, kObsSub, -1);
+        } else {
+            return;
+        }
+    }
+}
+
+// At most one comparison (a < b < c is an error)
+static void ParseComparison(ObservableSource& source) {
+    ParseSum(source);
+    for (int c = 0; c < sizeof(kComparisons) / sizeof(kComparisons[0]); c++) {
+        if (!Accept(source, kComparisons[c].token)) continue;
+        ParseSum(source);
+        Emit(source, kComparisons[c].code, -1);
+        return;
+    }
+}
+
+static void ParseAnd(ObservableSource& source) {
+    ParseComparison(source);
+    while (Accept(source, "&&")) {
+        ParseComparison(source);
+        Emit(source, kObsAnd, -1);
+    }
+}
+
+static void ParseOr(ObservableSource& source) {
+    ParseAnd(source);
+    while (Accept(source, "||")) {
+        ParseAnd(source);
+        Emit(source, kObsOr, -1);
+    }
+}
+
+// Declare a 1D histogram of an expression, filled for events passing the cut (empty: all)
+void FusionReaction::AddObservableHistogram(const string& name, const string& x_expression, int nx,
+                                            double x_min, double x_max, const string& cut) {
+    AddObservableHistogram(name, x_expression, nx, x_min, x_max, "", 0, 0.0, 0.0, cut);
+}
+
+// Declare a 2D histogram (y_expression against x_expression); an empty y_expression makes it 1D
+void FusionReaction::AddObservableHistogram(const string& name, const string& x_expression, int nx,
+                                            double x_min, double x_max, const string& y_expression, int ny,
+                                            double y_min, double y_max, const string& cut) {
+    if (name.empty() || x_expression.empty()) {
+        cout << "ERROR: Observable histogram needs a name and an expression!" << endl;
+        exit(1);
+    }
+    if (nx <= 0 || !(x_max > x_min) || (!y_expression.empty() && (ny <= 0 || !(y_max > y_min)))) {
+        cout << "ERROR: Invalid binning of observable histogram " << name << endl;
+        exit(1);
+    }
+    ObservableHistogram obs;
+    obs.name = name;
+    obs.x_expression = x_expression;
+    obs.y_expression = y_expression;
+    obs.cut = cut;
+    obs.nx = nx;
+    obs.x_min = x_min;
+    obs.x_max = x_max;
+    obs.ny = ny;
+    obs.y_min = y_min;
+    obs.y_max = y_max;
+    obs.x_ops = obs.y_ops = obs.cut_ops = obs.end_ops = 0;
+    obs.his_1d = nullptr;
+    obs.his_2d = nullptr;
+    observable_histograms.push_back(obs);
+}
+
+// Standard beam, product and decay histograms on/off (the reconstructions have their own flags)
+void FusionReaction::EnableStandardHistograms(bool enable) {
+    standard_histograms = enable;
+}
+
+// Compile an expression and append its ops to observable_ops
+void FusionReaction::CompileObservable(const string& expression, const vector<string>& particles) {
+    int first_member = observable_members.size();
+    ObservableSource source = {expression, 0, particles, observable_ops, observable_members, 0, 0};
+    ParseOr(source);
+    SkipSpaces(source);
+    if (source.pos != expression.size()) CompileError(source, "unexpected '" + expression.substr(source.pos) + "'");
+    if (source.max_depth > kMaxObservableStack) CompileError(source, "expression too deep");
+
+    // Every name must stand for at most one particle of an event
+    for (int k = first_member; k < observable_members.size(); k++) {
+        DecaySlotsNamed(particles[observable_members[k]], "Observable '" + expression + "'");
+    }
+}
+
+// Compile the declared observables and create their histograms (decay tree must be configured)
+void FusionReaction::InitializeObservableHistograms() {
+    int n_products = products.size();
+    vector<string> particles;
+    for (int i = 0; i < n_products; i++) particles.push_back(products[i].name);
+
+    // One particle per decay-product name: a name repeated across the channels of a node is
+    // filled from whichever of its slots the event produced
+    observable_slot_particle.assign(decay_names.size(), -1);
+    for (int slot = 0; slot < decay_names.size(); slot++) {
+        int particle = find(particles.begin() + n_products, particles.end(), decay_names[slot]) - particles.begin();
+        if (particle == particles.size()) particles.push_back(decay_names[slot]);
+        observable_slot_particle[slot] = particle;
+    }
+
+    // Current event's particles; products are present in every event
+    FourVector zero = {0.0, 0.0, 0.0, 0.0};
+    observable_p4_true.assign(particles.size(), zero);
+    observable_p4_meas.assign(particles.size(), zero);
+    observable_rest_mass.assign(particles.size(), 0.0);
+    observable_excitation.assign(particles.size(), 0.0);
+    observable_present.assign(particles.size(), 0);
+    for (int i = 0; i < n_products; i++) observable_present[i] = 1;
+
+    // Names of the other saved histograms (a declared name must not replace one)
+    vector<TH1*> saved;
+    CollectHistograms(saved, false);
+    vector<string> taken;
+    for (int h = 0; h < saved.size(); h++) taken.push_back(saved[h]->GetName());
+    vector<SparseHist2D*> sparse(his_product_E_theta.begin(), his_product_E_theta.end());
+    sparse.insert(sparse.end(), his_decay_E_theta.begin(), his_decay_E_theta.end());
+
+    observable_ops.clear();
+    observable_members.clear();
+    for (int h = 0; h < observable_histograms.size(); h++) {
+        ObservableHistogram& obs = observable_histograms[h];
+        bool used = find(taken.begin(), taken.end(), obs.name) != taken.end();
+        for (int s = 0; s < sparse.size(); s++) used = used || sparse[s]->FindOutput(obs.name) >= 0;
+        if (used) {
+            cout << "ERROR: Observable histogram name already used: " << obs.name << endl;
+            exit(1);
+        }
+        taken.push_back(obs.name);
+
+        obs.x_ops = observable_ops.size();
+        CompileObservable(obs.x_expression, particles);
+        obs.y_ops = observable_ops.size();
+        if (!obs.y_expression.empty()) CompileObservable(obs.y_expression, particles);
+        obs.cut_ops = observable_ops.size();
+        if (!obs.cut.empty()) CompileObservable(obs.cut, particles);
+        obs.end_ops = observable_ops.size();
+
+        string title = obs.y_expression.empty() ? obs.x_expression : obs.y_expression + " vs " + obs.x_expression;
+        if (!obs.cut.empty()) title += " {" + obs.cut + "}";
+        if (obs.y_expression.empty()) {
+            obs.his_1d = new TH1D(obs.name.c_str(), title.c_str(), obs.nx, obs.x_min, obs.x_max);
+        } else {
+            obs.his_2d = new TH2F(obs.name.c_str(), title.c_str(), obs.nx, obs.x_min, obs.x_max, obs.ny, obs.y_min, obs.y_max);
+            obs.his_2d->SetOption("COL");
+        }
+    }
+    if (!observable_histograms.empty()) {
+        cout << "Observable histograms: " << observable_histograms.size() << " (" << observable_ops.size()
+             << " operations)" << endl;
+    }
+}
+
+// Evaluate the ops [first, last) on the current event. Returns false if a particle used is
+// not produced in this event. Energies in MeV, angles in degrees; a negative mass squared
+// gives a negative mass.
+bool FusionReaction::EvaluateObservable(int first, int last, double& value) const {
+    double stack[kMaxObservableStack];
+    int n = 0;
+    for (int k = first; k < last; k++) {
+        const ObservableOp& op = observable_ops[k];
+        switch (op.code) {
+        case kObsConst:
+            stack[n++] = op.value;
+            break;
+        case kObsBeamEnergy:
+            stack[n++] = E_beam_current;
+            break;
+        case kObsEnergy:
+        case kObsTheta:
+        case kObsPhi:
+        case kObsMomentum:
+        case kObsExcitation: {
+            int particle = observable_members[op.first];
+            if (!observable_present[particle]) return false;
+            const FourVector& v = op.truth ? observable_p4_true[particle] : observable_p4_meas[particle];
+            double p = sqrt(v.px * v.px + v.py * v.py + v.pz * v.pz);
+            if (op.code == kObsEnergy) stack[n] = KineticEnergy(v, observable_rest_mass[particle]);
+            else if (op.code == kObsTheta) stack[n] = (p > 0.0 ? acos(v.pz / p) : 0.0) * 180.0 / TMath::Pi();
+            else if (op.code == kObsPhi) stack[n] = atan2(v.py, v.px) * 180.0 / TMath::Pi();
+            else if (op.code == kObsMomentum) stack[n] = p;
+            else stack[n] = observable_excitation[particle];
+            n++;
+            break;
+        }
+        case kObsMass:
+        case kObsMissingMass: {
+            double E = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+            for (int m = op.first; m < op.last; m++) {
+                int particle = observable_members[m];
+                if (!observable_present[particle]) return false;
+                const FourVector& v = op.truth ? observable_p4_true[particle] : observable_p4_meas[particle];
+                E += v.E;
+                px += v.px;
+                py += v.py;
+                pz += v.pz;
+            }
+            if (op.code == kObsMissingMass) {
+                // Beam plus target minus the listed particles; measured: beam energy as for missing_mass
+                double beam_T = (op.truth || missing_mass_event_beam) ? E_beam_current : prepared->nominal_beam_T;
+                E = beam_T + prepared->M0 - E;
+                pz = prepared->BeamMomentum(beam_T) - pz;
+            }
+            double m2 = E * E - px * px - py * py - pz * pz;
+            stack[n++] = copysign(sqrt(fabs(m2)), m2);
+            break;
+        }
+        case kObsNeg:
+            stack[n - 1] = -stack[n - 1];
+            break;
+        case kObsNot:
+            stack[n - 1] = (stack[n - 1] == 0.0);
+            break;
+        case kObsSqrt:
+            stack[n - 1] = sqrt(stack[n - 1]);
+            break;
+        case kObsAbs:
+            stack[n - 1] = fabs(stack[n - 1]);
+            break;
+        default: {
+            // Binary operators
+            double b = stack[--n];
+            double& a = stack[n - 1];
+            if (op.code == kObsAdd) a = a + b;
+            else if (op.code == kObsSub) a = a - b;
+            else if (op.code == kObsMul) a = a * b;
+            else if (op.code == kObsDiv) a = a / b;
+            else if (op.code == kObsLess) a = (a < b);
+            else if (op.code == kObsGreater) a = (a > b);
+            else if (op.code == kObsLessEqual) a = (a <= b);
+            else if (op.code == kObsGreaterEqual) a = (a >= b);
+            else if (op.code == kObsEqual) a = (a == b);
+            else if (op.code == kObsNotEqual) a = (a != b);
+            else if (op.code == kObsAnd) a = (a != 0.0 && b != 0.0);
+            else a = (a != 0.0 || b != 0.0);
+            break;
+        }
+        }
+    }
+    value = stack[0];
+    return true;
+}
+
+// Gather the event's particles and fill every declared histogram whose cut passes
+void FusionReaction::FillObservables() {
+    int n_products = products.size();
+    for (int i = 0; i < n_products; i++) {
+        observable_p4_true[i] = product_p4_true[i];
+        observable_p4_meas[i] = product_p4_meas[i];
+        observable_excitation[i] = product_kin.excitation_energy[i];
+        observable_rest_mass[i] = products[i].mass + product_kin.excitation_energy[i];
+    }
+    for (int i = n_products; i < observable_present.size(); i++) {
+        observable_present[i] = 0;
+    }
+    if (decay_enabled) {
+        for (int e = 0; e < n_decay_tree; e++) {
+            const DecayTreeEntry& entry = decay_tree[e];
+            if (entry.slot < 0) continue;
+            int particle = observable_slot_particle[entry.slot];
+            observable_p4_true[particle] = decay_p4_true[entry.slot];
+            observable_p4_meas[particle] = decay_p4_meas[entry.slot];
+            observable_excitation[particle] = entry.excitation_energy;
+            observable_rest_mass[particle] = entry.mass + entry.excitation_energy;
+            observable_present[particle] = 1;
+        }
+    }
+
+    for (int h = 0; h < observable_histograms.size(); h++) {
+        ObservableHistogram& obs = observable_histograms[h];
+        double pass, x, y;
+        if (obs.cut_ops < obs.end_ops && (!EvaluateObservable(obs.cut_ops, obs.end_ops, pass) || pass == 0.0)) continue;
+        if (!EvaluateObservable(obs.x_ops, obs.y_ops, x)) continue;
+        if (obs.his_1d) obs.his_1d->Fill(x);
+        else if (EvaluateObservable(obs.y_ops, obs.cut_ops, y)) obs.his_2d->Fill(x, y);
+    }
+}
@@ -0,0 +1,92 @@
+#include "FusionReaction.h"
+
+BulkRandom::BulkRandom(TRandom3* random) {
+    fRandom = random;
+    Reset();
+}
+
+void BulkRandom::FillUniform() {
+    fRandom->RndmArray(kBulkRandomSize, fUniform);
+    fNextUniform = 0;
+}
+
+// Box-Muller in place: the first half of the uniforms gives the radii, the second half the angles
+void BulkRandom::FillGaus() {
+    const int half = kBulkRandomSize / 2;
+    fRandom->RndmArray(kBulkRandomSize, fGaus);
+    VectorGaussian(half, fGaus, fGaus + half, fGaus, fGaus + half);
+    fNextGaus = 0;
+}
+
+// Draw random variates in blocks (uniforms and Box-Muller Gaussians) instead of one TRandom3
+// call each. Seeded runs stay reproducible but use the random stream differently from the
+// default, so they do not reproduce event by event.
+void FusionReaction::EnableBulkRandom(bool enable) {
+    delete bulk_random;
+    bulk_random = nullptr;
+    if (!enable) return;
+    
+    bulk_random = new BulkRandom(fRandom);
+    cout << "Bulk random: " << kBulkRandomSize << " uniforms / Gaussians per refill (" << VectorISA() << ")" << endl;
+}
+
+// Sample the beam energy from a table of n_points values of its inverse CDF (one uniform per
+// event instead of two Gaussians and a uniform); 0 turns the table off. Takes effect at
+// PrepareReaction().
+void FusionReaction::SetBeamEnergyTable(int n_points) {
+    if (n_points != 0 && n_points < 2) {
+        cout << "ERROR: Beam energy table needs at least 2 points!" << endl;
+        exit(1);
+    }
+    beam_table_points = n_points;
+    if (n_points > 0) cout << "Beam energy: tabulated inverse CDF, " << n_points << " points" << endl;
+}
+
+// Beam kinetic energy of one event: spread E_beam_re around E_beam_initial, a uniform energy
+// loss in the target, then straggling E_strag (or the tabulated inverse CDF of that sum)
+double FusionReaction::DrawBeamEnergy() {
+    const vector<double>& table = prepared->beam_inverse_cdf;
+    if (!table.empty()) {
+        double x = RandomUniform() * (table.size() - 1);
+        int k = min((int)x, (int)table.size() - 2);
+        return table[k] + (x - k) * (table[k + 1] - table[k]);
+    }
+    double E_beam = RandomGaus(E_beam_initial, E_beam_re) - E_loss * RandomUniform();
+    return RandomGaus(E_beam, E_strag);
+}
+
+// Cumulative distribution of E_beam_initial + N(0, sigma) - E_loss U(0, 1):
+// F(x) = sigma / E_loss [G((x - E0 + E_loss) / sigma) - G((x - E0) / sigma)], G(z) = z Phi(z) + phi(z)
+static double BeamEnergyCDF(double x, double E0, double sigma, double E_loss) {
+    if (sigma <= 0) return min(1.0, max(0.0, (x - E0 + E_loss) / E_loss));
+    double b = (x - E0) / sigma;
+    if (E_loss <= 1e-9 * sigma) return 0.5 * erfc(-b / sqrt(2.0));
+    
+    double a = b + E_loss / sigma;
+    double Ga = a * 0.5 * erfc(-a / sqrt(2.0)) + exp(-0.5 * a * a) / sqrt(2.0 * TMath::Pi());
+    double Gb = b * 0.5 * erfc(-b / sqrt(2.0)) + exp(-0.5 * b * b) / sqrt(2.0 * TMath::Pi());
+    return sigma / E_loss * (Ga - Gb);
+}
+
+// Inverse CDF of the beam energy at beam_table_points equally spaced probabilities, by bisection.
+// The end points are the 1e-9 and 1 - 1e-9 quantiles; sampling interpolates linearly, so only
+// the outermost interval on each side (probability 1 / (points - 1)) loses the Gaussian tail shape.
+void FusionReaction::BuildBeamEnergyTable(vector<double>& table) const {
+    double sigma = sqrt(E_beam_re * E_beam_re + E_strag * E_strag);
+    int n = beam_table_points;
+    table.assign(n, E_beam_initial);
+    if (sigma <= 0 && E_loss <= 0) return;
+    
+    double x_min = E_beam_initial - E_loss - 7.0 * sigma;
+    double x_max = E_beam_initial + 7.0 * sigma;
+    for (int k = 0; k < n; k++) {
+        double u = min(max((double)k / (n - 1), 1e-9), 1.0 - 1e-9);
+        double lo = x_min, hi = x_max;
+        for (int iter = 0; iter < 100 && hi - lo > 1e-12 * (fabs(lo) + fabs(hi)); iter++) {
+            double mid = 0.5 * (lo + hi);
+            if (BeamEnergyCDF(mid, E_beam_initial, sigma, E_loss) < u) lo = mid;
+            else hi = mid;
+        }
+        table[k] = 0.5 * (lo + hi);
+    }
+}
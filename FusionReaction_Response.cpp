@@ -0,0 +1,168 @@
+#include "FusionReaction.h"
+
+// Initial slots of the response table (a power of two); typical runs fill a few hundred bins
+const int kResponseSlots = 4096;
+
+// Set the grid and clear all counts
+void ResponseAccumulator::Configure(int n_Ex_bins, double Ex_lo, double Ex_hi, int n_theta_bins) {
+    n_Ex = n_Ex_bins;
+    n_theta = n_theta_bins;
+    Ex_min = Ex_lo;
+    Ex_max = Ex_hi;
+    response.Reset(kResponseSlots);
+    generated.assign((n_Ex + 2) * (n_theta + 2), 0.0);
+    accepted.assign((n_Ex + 2) * (n_theta + 2), 0.0);
+}
+
+// Ex bin (0 = underflow, n_Ex + 1 = overflow)
+int ResponseAccumulator::ExBin(double Ex) const {
+    if (Ex < Ex_min) return 0;
+    if (!(Ex < Ex_max)) return n_Ex + 1;
+    return 1 + int((Ex - Ex_min) / (Ex_max - Ex_min) * n_Ex);
+}
+
+// theta_cm bin over 0-180 degrees
+int ResponseAccumulator::ThetaBin(double theta_deg) const {
+    if (theta_deg < 0.0) return 0;
+    if (!(theta_deg < 180.0)) return n_theta + 1;
+    return 1 + int(theta_deg / 180.0 * n_theta);
+}
+
+// Count one generated event; accepted events also enter the response matrix
+void ResponseAccumulator::Fill(double Ex_true, double theta_true, bool is_accepted, double Ex_reco, double theta_reco) {
+    int bt = ExBin(Ex_true) + (n_Ex + 2) * ThetaBin(theta_true);
+    generated[bt] += 1.0;
+    if (!is_accepted) return;
+    accepted[bt] += 1.0;
+    
+    long long cells = (long long)(n_Ex + 2) * (n_theta + 2);
+    long long br = ExBin(Ex_reco) + (n_Ex + 2) * ThetaBin(theta_reco);
+    response.Add(bt + cells * br, 1.0);
+}
+
+// Same (Ex, theta_cm) binning
+bool ResponseAccumulator::SameGrid(const ResponseAccumulator& other) const {
+    return other.n_Ex == n_Ex && other.n_theta == n_theta && other.Ex_min == Ex_min && other.Ex_max == Ex_max;
+}
+
+// Add the counts of another accumulator with the same grid
+void ResponseAccumulator::Merge(const ResponseAccumulator& other) {
+    if (!SameGrid(other)) {
+        cout << "ERROR: Cannot merge response accumulators with different binning!" << endl;
+        exit(1);
+    }
+    for (int c = 0; c < generated.size(); c++) {
+        generated[c] += other.generated[c];
+        accepted[c] += other.accepted[c];
+    }
+    for (int s = 0; s < other.response.bins.size(); s++) {
+        if (other.response.bins[s] >= 0) response.Add(other.response.bins[s], other.response.counts[s]);
+    }
+}
+
+// Lab frame acceptance of a measured particle
+bool FusionReaction::InAcceptance(const FourVector& p4, double mass) const {
+    double theta = atan2(sqrt(p4.px * p4.px + p4.py * p4.py), p4.pz);
+    if (theta < acceptance_theta_min || theta > acceptance_theta_max) return false;
+    return KineticEnergy(p4, mass) >= acceptance_E_threshold;
+}
+
+// CM polar angle (degrees) of a Lab 4-vector for a beam of kinetic energy beam_T
+static double ThetaCM(const FourVector& p4, double beam_T, const PreparedReaction& r) {
+    double beta = r.BeamMomentum(beam_T) / (beam_T + r.M0);
+    double gamma = 1.0 / sqrt(1.0 - beta * beta);
+    double pz_cm = gamma * (p4.pz - beta * p4.E);
+    return atan2(sqrt(p4.px * p4.px + p4.py * p4.py), pz_cm) * 180.0 / TMath::Pi();
+}
+
+// Record true vs reconstructed (Ex, theta_cm) of the response product for this event
+void FusionReaction::FillResponse() {
+    const FourVector& tru = product_p4_true[response_product];
+    const FourVector& meas = product_p4_meas[response_product];
+    
+    // True Ex: invariant mass of the missing system minus its ground-state mass
+    double E = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+    for (int n = 0; n < response_undetected.size(); n++) {
+        const FourVector& v = product_p4_true[response_undetected[n]];
+        E += v.E;
+        px += v.px;
+        py += v.py;
+        pz += v.pz;
+    }
+    double Ex_true = sqrt(E * E - px * px - py * py - pz * pz) - response_reference_mass;
+    double theta_true = ThetaCM(tru, E_beam_current, *prepared);
+    
+    // Reconstructed Ex from the missing mass with the analysis beam energy
+    double beam_T = missing_mass_event_beam ? E_beam_current : prepared->nominal_beam_T;
+    double E_miss = beam_T + prepared->M0 - meas.E;
+    double pz_miss = prepared->BeamMomentum(beam_T) - meas.pz;
+    double m2 = E_miss * E_miss - meas.px * meas.px - meas.py * meas.py - pz_miss * pz_miss;
+    double Ex_reco = copysign(sqrt(fabs(m2)), m2) - response_reference_mass;
+    double theta_reco = ThetaCM(meas, beam_T, *prepared);
+    
+    bool is_accepted = InAcceptance(meas, products[response_product].mass + product_kin.excitation_energy[response_product]);
+    response_acc.Fill(Ex_true, theta_true, is_accepted, Ex_reco, theta_reco);
+}
+
+// Write the response matrix and efficiency maps of this reaction to the current file
+void FusionReaction::WriteResponse() {
+    response_acc.Write();
+}
+
+// Write the response matrix and efficiency maps to the current directory
+void ResponseAccumulator::Write() const {
+    const ResponseAccumulator& acc = *this;
+    int nx = acc.n_Ex + 2;
+    int ny = acc.n_theta + 2;
+    
+    int n_bins[4] = {acc.n_Ex, acc.n_theta, acc.n_Ex, acc.n_theta};
+    double lo[4] = {acc.Ex_min, 0.0, acc.Ex_min, 0.0};
+    double hi[4] = {acc.Ex_max, 180.0, acc.Ex_max, 180.0};
+    THnSparseD* his_response = new THnSparseD("his_response",
+        "Response (Ex true, theta_cm true, Ex reco, theta_cm reco)", 4, n_bins, lo, hi);
+    
+    double entries = 0.0;
+    for (int s = 0; s < acc.response.bins.size(); s++) {
+        if (acc.response.bins[s] < 0) continue;
+        long long cells = (long long)nx * ny;
+        long long bt = acc.response.bins[s] % cells;
+        long long br = acc.response.bins[s] / cells;
+        int index[4] = {int(bt % nx), int(bt / nx), int(br % nx), int(br / nx)};
+        his_response->SetBinContent(index, acc.response.counts[s]);
+        entries += acc.response.counts[s];
+    }
+    his_response->SetEntries(entries);
+    
+    TH2D* his_generated = new TH2D("his_response_generated", "Generated (Ex true vs theta_cm true)",
+                                   acc.n_Ex, acc.Ex_min, acc.Ex_max, acc.n_theta, 0, 180);
+    TH2D* his_accepted = new TH2D("his_response_accepted", "Accepted (Ex true vs theta_cm true)",
+                                  acc.n_Ex, acc.Ex_min, acc.Ex_max, acc.n_theta, 0, 180);
+    TH2D* his_efficiency = new TH2D("his_response_efficiency", "Efficiency (Ex true vs theta_cm true)",
+                                    acc.n_Ex, acc.Ex_min, acc.Ex_max, acc.n_theta, 0, 180);
+    double n_generated = 0.0, n_accepted = 0.0;
+    for (int bx = 0; bx < nx; bx++) {
+        for (int by = 0; by < ny; by++) {
+            double g = acc.generated[bx + nx * by];
+            double a = acc.accepted[bx + nx * by];
+            his_generated->SetBinContent(bx, by, g);
+            his_accepted->SetBinContent(bx, by, a);
+            n_generated += g;
+            n_accepted += a;
+            if (g > 0) {
+                double eff = a / g;
+                his_efficiency->SetBinContent(bx, by, eff);
+                his_efficiency->SetBinError(his_efficiency->GetBin(bx, by), sqrt(eff * (1.0 - eff) / g));
+            }
+        }
+    }
+    his_generated->SetEntries(n_generated);
+    his_accepted->SetEntries(n_accepted);
+    
+    his_response->Write();
+    his_generated->Write();
+    his_accepted->Write();
+    his_efficiency->Write();
+    
+    cout << "Response: " << (long long)n_accepted << " / " << (long long)n_generated << " events accepted, "
+         << acc.response.n_filled << " filled response bins" << endl;
+}
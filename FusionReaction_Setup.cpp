@@ -5,7 +5,8 @@ FusionReaction::FusionReaction() {
     fRandom = new TRandom3();
     fRandom->SetSeed(time(0));
     
-    fPhaseSpace = new TGenPhaseSpace();
+    fPhaseSpace = new PhaseSpaceGenerator();
+    fDecayPhaseSpace = new PhaseSpaceGenerator();
     
     // Default parameters (can be overridden by SetExperimentalParameters)
     E_loss = 1.0;
@@ -15,9 +16,6 @@ FusionReaction::FusionReaction() {
     th_res = 0.1 * TMath::Pi() / 180.0; // radians
     
     products.clear();
-    product_masses.clear();
-    product_A.clear();
-    product_Z.clear();
     
     // Initialize decay configuration
     decay_enabled = false;
@@ -26,11 +24,56 @@ FusionReaction::FusionReaction() {
     decay_Z.clear();
     decay_names.clear();
     decay_masses.clear();
-    decay_energies.clear();
-    decay_momenta.clear();
-    decay_angles.clear();
-    decay_angles_lab.clear();
+    decay_excitation.clear();
+    decay_slot_node.clear();
+    product_decay_node.clear();
+    decay_nodes.clear();
+    current_decay_node = -1;
+    current_decay_channel = -1;
+    n_decay_tree = 0;
+    decay_tree_overflow_warned = false;
+    event_sums.final_valid = false;
+    event_sums.decay_valid = false;
+    event_sums.decay_present = false;
+    product_p4_true.clear();
+    product_p4_meas.clear();
+    decay_p4_true.clear();
+    decay_p4_meas.clear();
     original_parent_energy = 0.0;
+    missing_mass_sets.clear();
+    missing_mass_event_beam = false;
+    invariant_mass_all_pairs = false;
+    invariant_mass_requests.clear();
+    combo_members.clear();
+    combo_offset.clear();
+    enable_kinematic_fit = false;
+    fit_block = nullptr;
+    fit_overflow_warned = false;
+    hepmc_writer = nullptr;
+    event_weight = 1.0;
+    float_batch = nullptr;
+    bulk_random = nullptr;
+    beam_table_points = 0;
+    convergence = nullptr;
+    convergence_index = 0;
+    convergence_sparse = false;
+    live_monitor = nullptr;
+    live_index = 0;
+    checkpoint_hash = 0;
+    standard_histograms = true;
+    observable_histograms.clear();
+    check_allocations = false;
+    allocation_counter = nullptr;
+    event_allocations = 0;
+    counted_events = 0;
+    sparse_settled = false;
+    response_product = -1;
+    response_undetected.clear();
+    response_reference_mass = 0.0;
+    response_acc.Configure(50, 0.0, 25.0, 36);
+    acceptance_theta_min = 0.0;
+    acceptance_theta_max = TMath::Pi();
+    acceptance_E_threshold = 0.0;
     
     // Initialize reconstruction control flags
     enable_energy_reconstruction = false;
@@ -69,18 +112,30 @@ FusionReaction::FusionReaction() {
     his_product1_energy_reconstructed = nullptr;
     his_product1_energy_actual = nullptr;
     his_product1_energy_difference = nullptr;
-    his_product2_mass_reconstructed = nullptr;
-    his_product2_mass_actual = nullptr;
-    his_product2_mass_difference = nullptr;
-    his_product2_energy_reconstructed = nullptr;
-    his_product2_energy_actual = nullptr;
-    his_product2_energy_difference = nullptr;
+    his_fit_chi2 = nullptr;
+    his_fit_probability = nullptr;
+    his_fit_beam_energy_difference = nullptr;
+    his_fit_parent_mass = nullptr;
+    his_fit_parent_mass_difference = nullptr;
 }
 
 // Destructor
 FusionReaction::~FusionReaction() {
     delete fRandom;
     delete fPhaseSpace;
+    delete fDecayPhaseSpace;
+    delete fit_block;
+    delete hepmc_writer;
+    delete float_batch;
+    delete bulk_random;
+    for (int i = 0; i < his_product_E_theta.size(); i++) delete his_product_E_theta[i];
+    for (int i = 0; i < his_decay_E_theta.size(); i++) delete his_decay_E_theta[i];
+}
+
+// Seed the random number generator (default: time-based)
+void FusionReaction::SetSeed(unsigned int seed) {
+    fRandom->SetSeed(seed);
+    if (bulk_random) bulk_random->Reset();
 }
 
 // Set beam parameters (Energy, A, Z)
@@ -98,17 +153,18 @@ void FusionReaction::SetTargetParameters(int A, int Z) {
 
 // Add product (A, Z, name, excitation_energy)
 void FusionReaction::AddProduct(int A, int Z, const string& name, double excitation_energy) {
-    product_A.push_back(A);
-    product_Z.push_back(Z);
-    product_masses.push_back(0.0); // Will be filled from mass.dat
-    product_names.push_back(name);
+    if (products.size() >= kMaxProducts) {
+        cout << "ERROR: At most " << kMaxProducts << " reaction products are supported!" << endl;
+        exit(1);
+    }
+    product_decay_node.push_back(-1);
     
-    Particle p;
+    Species p;
     p.A = A;
     p.Z = Z;
     p.mass = 0.0; // Will be filled from mass.dat
+    p.excitation_energy = excitation_energy;
     p.name = name;
-    p.excitation_energy = excitation_energy; // Store excitation energy
     products.push_back(p);
     
     // Store product index for excited states if multiple excited states are enabled
@@ -147,9 +203,9 @@ bool FusionReaction::CheckConservation() {
     int A_final = 0;
     int Z_final = 0;
     
-    for (int i = 0; i < product_A.size(); i++) {
-        A_final += product_A[i];
-        Z_final += product_Z[i];
+    for (int i = 0; i < products.size(); i++) {
+        A_final += products[i].A;
+        Z_final += products[i].Z;
     }
     
     // Check conservation
@@ -163,6 +219,7 @@ bool FusionReaction::CheckConservation() {
     cout << "Z conservation: " << (Z_conserved ? "✓ PASS" : "✗ FAIL") << endl;
     
     if (A_conserved && Z_conserved) {
+        CheckDecayConservation();
         cout << "Overall: ✓ ALL CONSERVATION LAWS SATISFIED" << endl;
         return true;
     } else {
@@ -172,31 +229,130 @@ bool FusionReaction::CheckConservation() {
     }
 }
 
-// Enable decay for a specific product
+// Enable decay for a specific product (single channel, legacy interface)
 void FusionReaction::EnableDecay(int product_index) {
     if (product_index < 0 || product_index >= products.size()) {
         cout << "ERROR: Invalid product index for decay!" << endl;
         exit(1);
     }
     
-    decay_enabled = true;
+    int node = AddDecayNode(products[product_index].name);
+    AddDecayChannel(node, 1.0);
     decay_product_index = product_index;
-    cout << "Decay enabled for product: " << product_names[product_index] << endl;
+    cout << "Decay enabled for product: " << products[product_index].name << endl;
+}
+
+// Add a decay node for a product or an already declared decay product
+// Returns the existing node if the parent already has one
+int FusionReaction::AddDecayNode(const string& parent_name) {
+    int parent_product = -1;
+    int parent_slot = -1;
+    
+    for (int i = 0; i < products.size(); i++) {
+        if (products[i].name == parent_name) {
+            parent_product = i;
+            break;
+        }
+    }
+    if (parent_product < 0) {
+        for (int i = 0; i < decay_names.size(); i++) {
+            if (decay_names[i] == parent_name) {
+                parent_slot = i;
+                break;
+            }
+        }
+    }
+    
+    if (parent_product < 0 && parent_slot < 0) {
+        cout << "ERROR: Decay parent '" << parent_name << "' is neither a product nor a declared decay product!" << endl;
+        exit(1);
+    }
+    
+    // Reuse the node if this parent already decays
+    int existing = (parent_product >= 0) ? product_decay_node[parent_product] : decay_slot_node[parent_slot];
+    if (existing >= 0) {
+        current_decay_node = existing;
+        return existing;
+    }
+    
+    DecayNode node;
+    node.parent_product = parent_product;
+    node.parent_slot = parent_slot;
+    node.total_branching = 0.0;
+    decay_nodes.push_back(node);
+    
+    int node_index = decay_nodes.size() - 1;
+    if (parent_product >= 0) {
+        product_decay_node[parent_product] = node_index;
+        // The first decaying product is the one used for parent reconstruction
+        if (decay_product_index < 0) decay_product_index = parent_product;
+    } else {
+        decay_slot_node[parent_slot] = node_index;
+    }
+    
+    decay_enabled = true;
+    current_decay_node = node_index;
+    current_decay_channel = -1;
+    cout << "Decay node " << node_index << " added for: " << parent_name << endl;
+    return node_index;
+}
+
+// Add a decay channel to a node; subsequent AddDecayProduct() calls fill this channel
+int FusionReaction::AddDecayChannel(int node_index, double branching) {
+    if (node_index < 0 || node_index >= decay_nodes.size()) {
+        cout << "ERROR: Invalid decay node index!" << endl;
+        exit(1);
+    }
+    if (branching < 0.0) {
+        cout << "ERROR: Decay branching ratio must not be negative!" << endl;
+        exit(1);
+    }
+    
+    DecayChannel channel;
+    channel.branching = branching;
+    channel.first_slot = decay_A.size();
+    channel.n_daughters = 0;
+    channel.closed_warned = false;
+    
+    decay_nodes[node_index].channels.push_back(channel);
+    decay_nodes[node_index].total_branching += branching;
+    
+    current_decay_node = node_index;
+    current_decay_channel = decay_nodes[node_index].channels.size() - 1;
+    return current_decay_channel;
 }
 
-// Add decay product
-void FusionReaction::AddDecayProduct(int A, int Z, const string& name) {
-    if (!decay_enabled) {
+// Add decay product to the current decay channel
+void FusionReaction::AddDecayProduct(int A, int Z, const string& name, double excitation_energy) {
+    if (!decay_enabled || current_decay_node < 0 || current_decay_channel < 0) {
         cout << "ERROR: Decay not enabled! Call EnableDecay() first." << endl;
         exit(1);
     }
     
+    DecayChannel& channel = decay_nodes[current_decay_node].channels[current_decay_channel];
+    if (channel.first_slot + channel.n_daughters != decay_A.size()) {
+        cout << "ERROR: Decay products must be added right after their channel!" << endl;
+        exit(1);
+    }
+    if (channel.n_daughters >= kMaxDecayDaughters) {
+        cout << "ERROR: A decay channel supports at most " << kMaxDecayDaughters << " decay products!" << endl;
+        exit(1);
+    }
+    
     decay_A.push_back(A);
     decay_Z.push_back(Z);
     decay_names.push_back(name);
     decay_masses.push_back(0.0); // Will be filled from mass.dat
+    decay_excitation.push_back(excitation_energy);
+    decay_slot_node.push_back(-1);
+    channel.n_daughters++;
     
-    cout << "Added decay product: " << name << " (A=" << A << ", Z=" << Z << ")" << endl;
+    if (excitation_energy > 0.0) {
+        cout << "Added decay product: " << name << " (A=" << A << ", Z=" << Z << ") with excitation energy: "
+             << excitation_energy << " MeV" << endl;
+    } else {
+        cout << "Added decay product: " << name << " (A=" << A << ", Z=" << Z << ")" << endl;
+    }
 }
 
 // Disable decay
@@ -207,9 +363,55 @@ void FusionReaction::DisableDecay() {
     decay_Z.clear();
     decay_names.clear();
     decay_masses.clear();
+    decay_excitation.clear();
+    decay_slot_node.clear();
+    decay_nodes.clear();
+    for (int i = 0; i < product_decay_node.size(); i++) {
+        product_decay_node[i] = -1;
+    }
+    current_decay_node = -1;
+    current_decay_channel = -1;
     cout << "Decay disabled." << endl;
 }
 
+// Check A and Z conservation for every decay channel
+void FusionReaction::CheckDecayConservation() {
+    for (int n = 0; n < decay_nodes.size(); n++) {
+        const DecayNode& node = decay_nodes[n];
+        int A_parent = (node.parent_product >= 0) ? products[node.parent_product].A : decay_A[node.parent_slot];
+        int Z_parent = (node.parent_product >= 0) ? products[node.parent_product].Z : decay_Z[node.parent_slot];
+        string name = (node.parent_product >= 0) ? products[node.parent_product].name : decay_names[node.parent_slot];
+        
+        if (node.channels.empty() || node.total_branching <= 0.0) {
+            cout << "ERROR: Decay node for " << name << " has no channel with positive branching!" << endl;
+            exit(1);
+        }
+        
+        for (int c = 0; c < node.channels.size(); c++) {
+            const DecayChannel& channel = node.channels[c];
+            if (channel.n_daughters == 0) {
+                cout << "WARNING: Decay " << name << " channel " << c << " has no decay products (no decay)" << endl;
+                continue;
+            }
+            
+            int A_sum = 0, Z_sum = 0;
+            for (int k = 0; k < channel.n_daughters; k++) {
+                A_sum += decay_A[channel.first_slot + k];
+                Z_sum += decay_Z[channel.first_slot + k];
+            }
+            
+            bool ok = (channel.n_daughters >= 2 && A_sum == A_parent && Z_sum == Z_parent);
+            cout << "Decay " << name << " channel " << c << " (" << channel.n_daughters << " daughters, ratio "
+                 << channel.branching / node.total_branching << "): " << (ok ? "✓ PASS" : "✗ FAIL") << endl;
+            if (!ok) {
+                cout << "ERROR: Decay channel needs at least 2 daughters conserving A=" << A_parent
+                     << ", Z=" << Z_parent << " (got A=" << A_sum << ", Z=" << Z_sum << ")" << endl;
+                exit(1);
+            }
+        }
+    }
+}
+
 // Enable/disable energy reconstruction
 void FusionReaction::EnableEnergyReconstruction(bool enable) {
     enable_energy_reconstruction = enable;
@@ -251,15 +453,15 @@ void FusionReaction::EnableProductReconstruction(bool enable) {
             selected_product1 < products.size() && selected_product2 < products.size()) {
             
             // Sum A and Z of selected products
-            parent_A = product_A[selected_product1] + product_A[selected_product2];
-            parent_Z = product_Z[selected_product1] + product_Z[selected_product2];
+            parent_A = products[selected_product1].A + products[selected_product2].A;
+            parent_Z = products[selected_product1].Z + products[selected_product2].Z;
             parent_name = "Parent_" + selected_product1_name + "_" + selected_product2_name;
             parent_mass = 0.0;  // Will be loaded from mass file
             
             cout << "Auto-calculated parent particle info:" << endl;
             cout << "  Parent: " << parent_name << " (A=" << parent_A << ", Z=" << parent_Z << ")" << endl;
-            cout << "  From: " << selected_product1_name << " (A=" << product_A[selected_product1] << ", Z=" << product_Z[selected_product1] << ")" << endl;
-            cout << "       + " << selected_product2_name << " (A=" << product_A[selected_product2] << ", Z=" << product_Z[selected_product2] << ")" << endl;
+            cout << "  From: " << selected_product1_name << " (A=" << products[selected_product1].A << ", Z=" << products[selected_product1].Z << ")" << endl;
+            cout << "       + " << selected_product2_name << " (A=" << products[selected_product2].A << ", Z=" << products[selected_product2].Z << ")" << endl;
         }
     } else {
         cout << "Product reconstruction disabled" << endl;
@@ -278,12 +480,12 @@ void FusionReaction::SelectProductsForReconstruction(int product1_index, int pro
     
     selected_product1 = product1_index;
     selected_product2 = product2_index;
-    selected_product1_name = product_names[product1_index];
-    selected_product2_name = product_names[product2_index];
+    selected_product1_name = products[product1_index].name;
+    selected_product2_name = products[product2_index].name;
     
     cout << "Selected products for reconstruction:" << endl;
-    cout << "  Product 1: " << product_names[product1_index] << " (index " << product1_index << ")" << endl;
-    cout << "  Product 2: " << product_names[product2_index] << " (index " << product2_index << ")" << endl;
+    cout << "  Product 1: " << products[product1_index].name << " (index " << product1_index << ")" << endl;
+    cout << "  Product 2: " << products[product2_index].name << " (index " << product2_index << ")" << endl;
 }
 
 // Select products for reconstruction by name
@@ -292,11 +494,11 @@ void FusionReaction::SelectProductsForReconstruction(const string& product1_name
     int product2_index = -1;
     
     // Find indices by name
-    for (int i = 0; i < product_names.size(); i++) {
-        if (product_names[i] == product1_name) {
+    for (int i = 0; i < products.size(); i++) {
+        if (products[i].name == product1_name) {
             product1_index = i;
         }
-        if (product_names[i] == product2_name) {
+        if (products[i].name == product2_name) {
             product2_index = i;
         }
     }
@@ -305,9 +507,9 @@ void FusionReaction::SelectProductsForReconstruction(const string& product1_name
     if (product1_index == -1) {
         cout << "ERROR: Product '" << product1_name << "' not found!" << endl;
         cout << "Available products: ";
-        for (int i = 0; i < product_names.size(); i++) {
-            cout << product_names[i];
-            if (i < product_names.size() - 1) cout << ", ";
+        for (int i = 0; i < products.size(); i++) {
+            cout << products[i].name;
+            if (i < products.size() - 1) cout << ", ";
         }
         cout << endl;
         return;
@@ -316,9 +518,9 @@ void FusionReaction::SelectProductsForReconstruction(const string& product1_name
     if (product2_index == -1) {
         cout << "ERROR: Product '" << product2_name << "' not found!" << endl;
         cout << "Available products: ";
-        for (int i = 0; i < product_names.size(); i++) {
-            cout << product_names[i];
-            if (i < product_names.size() - 1) cout << ", ";
+        for (int i = 0; i < products.size(); i++) {
+            cout << products[i].name;
+            if (i < products.size() - 1) cout << ", ";
         }
         cout << endl;
         return;
@@ -340,6 +542,242 @@ void FusionReaction::SelectProductsForReconstruction(const string& product1_name
     cout << "  Product 2: " << product2_name << " (index " << product2_index << ")" << endl;
 }
 
+// Add a missing-mass set: the listed products are detected, the rest form the missing system
+void FusionReaction::AddMissingMassSet(const vector<string>& detected_names) {
+    MissingMassSet set;
+    set.label = "";
+    vector<bool> is_detected(products.size(), false);
+    
+    for (int n = 0; n < detected_names.size(); n++) {
+        int index = -1;
+        for (int i = 0; i < products.size(); i++) {
+            if (products[i].name == detected_names[n]) {
+                index = i;
+                break;
+            }
+        }
+        if (index == -1) {
+            cout << "ERROR: Missing-mass product '" << detected_names[n] << "' not found!" << endl;
+            exit(1);
+        }
+        if (is_detected[index]) {
+            cout << "ERROR: Missing-mass product '" << detected_names[n] << "' listed twice!" << endl;
+            exit(1);
+        }
+        is_detected[index] = true;
+        set.detected.push_back(index);
+        if (!set.label.empty()) set.label += "+";
+        set.label += detected_names[n];
+    }
+    
+    for (int i = 0; i < products.size(); i++) {
+        if (!is_detected[i]) set.undetected.push_back(i);
+    }
+    if (set.detected.empty() || set.undetected.empty()) {
+        cout << "ERROR: Missing-mass set needs at least one detected and one undetected product!" << endl;
+        exit(1);
+    }
+    
+    // Masses and block buffers are set in InitializeMissingMassHistograms (after ReadMassFile)
+    set.detected_mass = 0.0;
+    set.reference_mass = 0.0;
+    set.n_block = 0;
+    set.his_mass = nullptr;
+    set.his_Ex = nullptr;
+    set.his_Q = nullptr;
+    set.his_Ex_difference = nullptr;
+    missing_mass_sets.push_back(set);
+    
+    cout << "Missing-mass set " << missing_mass_sets.size() - 1 << ": detected " << set.label << endl;
+}
+
+// Beam energy used for missing mass: nominal (false) or per-event (true)
+void FusionReaction::SetMissingMassBeam(bool per_event) {
+    missing_mass_event_beam = per_event;
+}
+
+// Histogram the invariant mass of every pair of products and decay products
+void FusionReaction::EnableInvariantMassPairs(bool enable) {
+    invariant_mass_all_pairs = enable;
+}
+
+// Histogram the invariant mass of a chosen subset (product or decay product names)
+void FusionReaction::AddInvariantMassSubset(const vector<string>& names) {
+    if (names.size() < 2) {
+        cout << "ERROR: Invariant-mass subset needs at least two particles!" << endl;
+        exit(1);
+    }
+    invariant_mass_requests.push_back(names);
+}
+
+// Decay slots carrying a particle name. A name may repeat across the channels of one decay
+// node, since only one channel fires per event; a name that could stand for two particles of
+// the same event (or also for a product) is rejected.
+vector<int> FusionReaction::DecaySlotsNamed(const string& name, const string& context) const {
+    vector<int> slots, channel_of;
+    int node = -1;
+    bool exclusive = true;
+    for (int n = 0; n < decay_nodes.size(); n++) {
+        for (int c = 0; c < decay_nodes[n].channels.size(); c++) {
+            const DecayChannel& channel = decay_nodes[n].channels[c];
+            for (int k = 0; k < channel.n_daughters; k++) {
+                if (decay_names[channel.first_slot + k] != name) continue;
+                if (node >= 0 && node != n) exclusive = false;
+                for (int j = 0; j < channel_of.size(); j++) {
+                    if (channel_of[j] == c) exclusive = false;
+                }
+                node = n;
+                slots.push_back(channel.first_slot + k);
+                channel_of.push_back(c);
+            }
+        }
+    }
+    for (int i = 0; i < products.size(); i++) {
+        if (products[i].name == name && !slots.empty()) exclusive = false;
+    }
+    if (!exclusive) {
+        cout << "ERROR: " << context << ": particle name '" << name
+             << "' is ambiguous (used by several particles of the same event)!" << endl;
+        exit(1);
+    }
+    return slots;
+}
+
+// Flatten the requested subsets into combo_members/combo_offset (decay tree must be configured)
+void FusionReaction::BuildInvariantMassSubsets() {
+    int n_products = products.size();
+    int n_particles = n_products + decay_A.size();
+    
+    // Parent particle and decay node/channel of every particle
+    vector<int> parent(n_particles, -1), node_of(n_particles, -1), channel_of(n_particles, -1);
+    for (int n = 0; n < decay_nodes.size(); n++) {
+        const DecayNode& node = decay_nodes[n];
+        int parent_particle = (node.parent_product >= 0) ? node.parent_product : n_products + node.parent_slot;
+        for (int c = 0; c < node.channels.size(); c++) {
+            for (int k = 0; k < node.channels[c].n_daughters; k++) {
+                int particle = n_products + node.channels[c].first_slot + k;
+                parent[particle] = parent_particle;
+                node_of[particle] = n;
+                channel_of[particle] = c;
+            }
+        }
+    }
+    
+    combo_members.clear();
+    combo_offset.assign(1, 0);
+    
+    if (invariant_mass_all_pairs) {
+        for (int a = 0; a < n_particles; a++) {
+            for (int b = a + 1; b < n_particles; b++) {
+                // Skip pairs that never coexist: a particle and its own decay products, or
+                // particles descending from different channels of the same node
+                bool exclusive = false;
+                for (int q = parent[b]; q >= 0; q = parent[q]) {
+                    if (q == a) exclusive = true;
+                }
+                for (int x = a; x >= 0 && !exclusive; x = parent[x]) {
+                    for (int y = b; y >= 0; y = parent[y]) {
+                        if (node_of[x] >= 0 && node_of[x] == node_of[y] && channel_of[x] != channel_of[y]) {
+                            exclusive = true;
+                        }
+                    }
+                }
+                if (exclusive) continue;
+                
+                combo_members.push_back(a);
+                combo_members.push_back(b);
+                combo_offset.push_back(combo_members.size());
+            }
+        }
+    }
+    
+    // A name carried by several decay slots (one per channel of a node) becomes an alias
+    // particle after the slots, standing for whichever of them the event produced
+    combo_slot_alias.assign(decay_A.size(), -1);
+    int n_aliases = 0;
+    for (int r = 0; r < invariant_mass_requests.size(); r++) {
+        const vector<string>& names = invariant_mass_requests[r];
+        for (int n = 0; n < names.size(); n++) {
+            int particle = -1;
+            for (int i = 0; i < products.size() && particle < 0; i++) {
+                if (products[i].name == names[n]) particle = i;
+            }
+            vector<int> slots = DecaySlotsNamed(names[n], "Invariant-mass subset");
+            if (slots.size() == 1) {
+                particle = n_products + slots[0];
+            } else if (slots.size() > 1) {
+                if (combo_slot_alias[slots[0]] < 0) {
+                    for (int i = 0; i < slots.size(); i++) combo_slot_alias[slots[i]] = n_particles + n_aliases;
+                    n_aliases++;
+                }
+                particle = combo_slot_alias[slots[0]];
+            }
+            if (particle < 0) {
+                cout << "ERROR: Invariant-mass particle '" << names[n] << "' is neither a product nor a decay product!" << endl;
+                exit(1);
+            }
+            combo_members.push_back(particle);
+        }
+        combo_offset.push_back(combo_members.size());
+    }
+    
+    combo_p4.assign(n_particles + n_aliases, FourVector());
+    combo_present.assign(n_particles + n_aliases, 0);
+}
+
+// Enable/disable the event-by-event kinematic fit
+void FusionReaction::EnableKinematicFit(bool enable) {
+    enable_kinematic_fit = enable;
+}
+
+// Response mode: the named product is detected, the other products form the missing system
+void FusionReaction::EnableResponse(const string& detected_name) {
+    response_product = -1;
+    for (int i = 0; i < products.size(); i++) {
+        if (products[i].name == detected_name) {
+            response_product = i;
+            break;
+        }
+    }
+    if (response_product < 0) {
+        cout << "ERROR: Response product '" << detected_name << "' not found!" << endl;
+        exit(1);
+    }
+    
+    response_undetected.clear();
+    for (int i = 0; i < products.size(); i++) {
+        if (i != response_product) response_undetected.push_back(i);
+    }
+    cout << "Response mode: detected " << detected_name << endl;
+}
+
+// Stream the generated events to a HepMC3 ASCII file (gzip-compressed if the name ends in .gz)
+void FusionReaction::EnableHepMCExport(const char* filename) {
+    delete hepmc_writer;
+    hepmc_writer = new HepMCWriter();
+    if (!hepmc_writer->Open(filename)) {
+        cout << "ERROR: Cannot open HepMC output: " << filename << endl;
+        exit(1);
+    }
+    cout << "HepMC3 export: " << filename << endl;
+}
+
+// Response grid: true and reconstructed Ex (MeV) and theta_cm (0-180 deg)
+void FusionReaction::SetResponseBinning(int n_Ex, double Ex_min, double Ex_max, int n_theta) {
+    if (n_Ex < 1 || n_theta < 1 || Ex_max <= Ex_min) {
+        cout << "ERROR: Invalid response binning!" << endl;
+        exit(1);
+    }
+    response_acc.Configure(n_Ex, Ex_min, Ex_max, n_theta);
+}
+
+// Detector acceptance in Lab polar angle (degrees) and kinetic energy threshold (MeV)
+void FusionReaction::SetAcceptance(double theta_min_deg, double theta_max_deg, double E_threshold) {
+    acceptance_theta_min = theta_min_deg * TMath::Pi() / 180.0;
+    acceptance_theta_max = theta_max_deg * TMath::Pi() / 180.0;
+    acceptance_E_threshold = E_threshold;
+}
+
 // Set parent particle info for reconstruction
 void FusionReaction::SetParentParticleInfo(int A, int Z, const string& name) {
     parent_A = A;
@@ -0,0 +1,172 @@
+#include "FusionReaction.h"
+
+// Initial slots of a sparse 2D histogram (a power of two, 16 KB): 768 filled cells before the
+// table grows; two-body loci fill a few hundred
+const int kSparseHistSlots = 1024;
+
+// Empty table of n_slots slots
+void SparseCounts::Reset(int n_slots) {
+    bins.assign(n_slots, -1);
+    counts.assign(n_slots, 0.0);
+    n_filled = 0;
+}
+
+// Add w to a linear bin; the table doubles when it gets 3/4 full
+void SparseCounts::Add(long long bin, double w) {
+    if (4 * (n_filled + 1) > 3 * (int)bins.size()) {
+        vector<long long> old_bins;
+        vector<double> old_counts;
+        old_bins.swap(bins);
+        old_counts.swap(counts);
+        Reset(2 * old_bins.size());
+        for (int s = 0; s < old_bins.size(); s++) {
+            if (old_bins[s] >= 0) Add(old_bins[s], old_counts[s]);
+        }
+    }
+
+    size_t mask = bins.size() - 1;
+    size_t s = (size_t)(bin * 0x9E3779B97F4A7C15ULL >> 17) & mask;
+    while (bins[s] >= 0 && bins[s] != bin) s = (s + 1) & mask;
+    if (bins[s] < 0) {
+        bins[s] = bin;
+        n_filled++;
+    }
+    counts[s] += w;
+}
+
+SparseHist2D::SparseHist2D(int nx, double x_min, double x_max, int ny, double y_min, double y_max)
+    : fXaxis(nx, x_min, x_max), fYaxis(ny, y_min, y_max) {
+    fCells = (nx + 2) * (ny + 2);
+    fSparse.Reset(kSparseHistSlots);
+    fSettled = false;
+    fEntries = 0.0;
+    for (int k = 0; k < 7; k++) fStats[k] = 0.0;
+}
+
+SparseHist2D::~SparseHist2D() {
+    for (int k = 0; k < fOutputs.size(); k++) delete fOutputs[k];
+}
+
+// Add an output histogram (name, title) showing the contents; returns its index
+int SparseHist2D::AddOutput(const char* name, const char* title) {
+    fNames.push_back(name);
+    fTitles.push_back(title);
+    fOutputs.push_back(nullptr);
+    return fNames.size() - 1;
+}
+
+// Index of the output with this name, -1 if none
+int SparseHist2D::FindOutput(const string& name) const {
+    for (int k = 0; k < fNames.size(); k++) {
+        if (fNames[k] == name) return k;
+    }
+    return -1;
+}
+
+// Same bins and statistics as TH2::Fill(x, y) (under/overflow counted, but not in the statistics)
+void SparseHist2D::Fill(double x, double y) {
+    fEntries++;
+    int nx = fXaxis.GetNbins(), ny = fYaxis.GetNbins();
+    int bx = fXaxis.FindFixBin(x), by = fYaxis.FindFixBin(y);
+    long long bin = bx + (long long)(nx + 2) * by;
+
+    if (fDense.empty()) {
+        // Dense once the grown table would need more memory than the dense array, or after
+        // warm-up, when the table no longer grows (the dense array is reserved by Settle())
+        bool grows = 4 * (fSparse.n_filled + 1) > 3 * (int)fSparse.bins.size();
+        if (grows && (fSettled || 2 * fSparse.bins.size() * (sizeof(long long) + sizeof(double)) > fCells * sizeof(float))) {
+            fDense.assign(fCells, 0.0f);
+            for (int s = 0; s < fSparse.bins.size(); s++) {
+                if (fSparse.bins[s] >= 0) fDense[fSparse.bins[s]] = fSparse.counts[s];
+            }
+            SparseCounts empty;
+            empty.n_filled = 0;
+            swap(fSparse, empty);
+        } else {
+            fSparse.Add(bin, 1.0);
+        }
+    }
+    if (!fDense.empty()) fDense[bin] += 1.0f;
+
+    if (bx == 0 || bx > nx || by == 0 || by > ny) return;
+    fStats[0] += 1.0;
+    fStats[1] += 1.0;
+    fStats[2] += x;
+    fStats[3] += x * x;
+    fStats[4] += y;
+    fStats[5] += y * y;
+    fStats[6] += x * y;
+}
+
+// End of warm-up: a histogram that is still sparse reserves its dense array (untouched memory,
+// so it costs address space only) and later switches to it instead of growing the table, so
+// filling never allocates from now on
+void SparseHist2D::Settle() {
+    if (fDense.empty()) fDense.reserve(fCells);
+    fSettled = true;
+}
+
+// Center of the highest y bin with counts (x and y inside the axes), 0 if there is none
+double SparseHist2D::MaxFilledY() const {
+    int nx = fXaxis.GetNbins(), ny = fYaxis.GetNbins();
+    int max_by = 0;
+    int n = fDense.empty() ? fSparse.bins.size() : fCells;
+    for (int k = 0; k < n; k++) {
+        long long cell = fDense.empty() ? fSparse.bins[k] : k;
+        if (cell < 0 || !((fDense.empty() ? fSparse.counts[k] : fDense[k]) > 0)) continue;
+        int bx = cell % (nx + 2), by = cell / (nx + 2);
+        if (bx >= 1 && bx <= nx && by >= 1 && by <= ny) max_by = max(max_by, by);
+    }
+    return max_by > 0 ? fYaxis.GetBinCenter(max_by) : 0.0;
+}
+
+// Output histogram with the current contents (created on the first call, then refreshed)
+TH2F* SparseHist2D::Dense(int output) {
+    if (!fOutputs[output]) {
+        fOutputs[output] = new TH2F(fNames[output].c_str(), fTitles[output].c_str(),
+                                    fXaxis.GetNbins(), fXaxis.GetXmin(), fXaxis.GetXmax(),
+                                    fYaxis.GetNbins(), fYaxis.GetXmin(), fYaxis.GetXmax());
+        fOutputs[output]->SetDirectory(nullptr);
+        fOutputs[output]->SetOption("COL");
+    }
+    CopyTo(fOutputs[output]);
+    return fOutputs[output];
+}
+
+// Bring the output histograms created so far up to date
+void SparseHist2D::Refresh() {
+    for (int k = 0; k < fOutputs.size(); k++) {
+        if (fOutputs[k]) CopyTo(fOutputs[k]);
+    }
+}
+
+void SparseHist2D::CopyTo(TH2F* his) const {
+    // Contents first (SetBinContent touches the statistics), then the statistics
+    his->Reset();
+    if (fDense.empty()) {
+        for (int s = 0; s < fSparse.bins.size(); s++) {
+            if (fSparse.bins[s] >= 0) his->SetBinContent(fSparse.bins[s], fSparse.counts[s]);
+        }
+    } else {
+        for (int bin = 0; bin < fCells; bin++) {
+            if (fDense[bin] != 0.0f) his->SetBinContent(bin, fDense[bin]);
+        }
+    }
+    double stats[7];
+    for (int k = 0; k < 7; k++) stats[k] = fStats[k];
+    his->PutStats(stats);
+    his->SetEntries(fEntries);
+}
+
+// Settle all sparse histograms at the end of warm-up (see SparseHist2D::Settle)
+void FusionReaction::SettleSparseHistograms() {
+    for (int i = 0; i < his_product_E_theta.size(); i++) his_product_E_theta[i]->Settle();
+    for (int i = 0; i < his_decay_E_theta.size(); i++) his_decay_E_theta[i]->Settle();
+    sparse_settled = true;
+}
+
+// Bring the dense copies of the sparse histograms (monitoring, stop targets) up to date
+void FusionReaction::RefreshSparseHistograms() {
+    for (int i = 0; i < his_product_E_theta.size(); i++) his_product_E_theta[i]->Refresh();
+    for (int i = 0; i < his_decay_E_theta.size(); i++) his_decay_E_theta[i]->Refresh();
+}
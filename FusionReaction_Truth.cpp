@@ -0,0 +1,279 @@
+#include "FusionReaction.h"
+#include <cstdio>
+#include <cstring>
+
+// Truth file: magic, configuration layout (int count + ints), then blocks of
+// (n_events, n_values, n_tree) followed by the value and tree arrays
+static const char kTruthMagic[8] = {'F', 'R', 'T', 'R', 'U', 'T', 'H', '1'};
+
+static void WriteTruthHeader(FILE* file, const vector<int>& layout) {
+    int n = layout.size();
+    fwrite(kTruthMagic, 1, sizeof(kTruthMagic), file);
+    fwrite(&n, sizeof(int), 1, file);
+    fwrite(layout.data(), sizeof(int), n, file);
+}
+
+static bool ReadTruthHeader(FILE* file, vector<int>& layout) {
+    char magic[sizeof(kTruthMagic)];
+    int n;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)) return false;
+    if (memcmp(magic, kTruthMagic, sizeof(magic)) != 0) return false;
+    if (fread(&n, sizeof(int), 1, file) != 1 || n < 0 || n > 65536) return false;
+    layout.resize(n);
+    return fread(layout.data(), sizeof(int), n, file) == (size_t)n;
+}
+
+static void WriteTruthBlock(FILE* file, const TruthBlock& block) {
+    int header[3] = {block.n_events, (int)block.values.size(), (int)block.tree.size()};
+    fwrite(header, sizeof(int), 3, file);
+    fwrite(block.values.data(), sizeof(double), block.values.size(), file);
+    fwrite(block.tree.data(), sizeof(int), block.tree.size(), file);
+}
+
+// Read the next block into the (reused) buffers; false at the end of the file.
+// A partial block (interrupted generation) ends the replay with a warning.
+static bool ReadTruthBlock(FILE* file, TruthBlock& block) {
+    int header[3];
+    size_t n = fread(header, sizeof(int), 3, file);
+    if (n == 0) return false;
+    if (n == 3 && header[0] >= 0 && header[1] >= 0 && header[2] >= 0) {
+        block.values.resize(header[1]);
+        block.tree.resize(header[2]);
+        if (fread(block.values.data(), sizeof(double), header[1], file) == (size_t)header[1] &&
+            fread(block.tree.data(), sizeof(int), header[2], file) == (size_t)header[2]) {
+            block.n_events = header[0];
+            return true;
+        }
+    }
+    cout << "WARNING: Truncated truth file, replay stops after the last complete block" << endl;
+    return false;
+}
+
+// Configuration a truth file depends on: beam, target, products, decay slots and channels
+void FusionReaction::TruthLayout(vector<int>& layout) const {
+    layout.clear();
+    layout.push_back(A_beam);
+    layout.push_back(Z_beam);
+    layout.push_back(A_target);
+    layout.push_back(Z_target);
+    layout.push_back(products.size());
+    for (int i = 0; i < products.size(); i++) {
+        layout.push_back(products[i].A);
+        layout.push_back(products[i].Z);
+    }
+    layout.push_back(decay_A.size());
+    for (int slot = 0; slot < decay_A.size(); slot++) {
+        layout.push_back(decay_A[slot]);
+        layout.push_back(decay_Z[slot]);
+    }
+    layout.push_back(decay_nodes.size());
+    for (int n = 0; n < decay_nodes.size(); n++) {
+        layout.push_back(decay_nodes[n].parent_product);
+        layout.push_back(decay_nodes[n].parent_slot);
+        layout.push_back(decay_nodes[n].channels.size());
+        for (int c = 0; c < decay_nodes[n].channels.size(); c++) {
+            layout.push_back(decay_nodes[n].channels[c].first_slot);
+            layout.push_back(decay_nodes[n].channels[c].n_daughters);
+        }
+    }
+}
+
+// Append the true kinematics of the current event to the block
+void FusionReaction::StoreTruth(TruthBlock& block) {
+    vector<double>& values = block.values;
+    values.push_back(event_weight);
+    values.push_back(E_beam_current);
+    for (int i = 0; i < products.size(); i++) {
+        const FourVector& p4 = product_p4_true[i];
+        values.push_back(product_kin.excitation_energy[i]);
+        values.push_back(p4.px);
+        values.push_back(p4.py);
+        values.push_back(p4.pz);
+        values.push_back(p4.E);
+    }
+
+    int n_tree = decay_enabled ? n_decay_tree : 0;
+    block.tree.push_back(n_tree);
+    for (int e = 0; e < n_tree; e++) {
+        const DecayTreeEntry& entry = decay_tree[e];
+        block.tree.push_back(entry.slot);
+        block.tree.push_back(entry.parent);
+        block.tree.push_back(entry.channel);
+        block.tree.push_back(entry.first_daughter);
+        block.tree.push_back(entry.n_daughters);
+        if (entry.slot < 0) continue;
+
+        const FourVector& p4 = decay_p4_true[entry.slot];
+        values.push_back(p4.px);
+        values.push_back(p4.py);
+        values.push_back(p4.pz);
+        values.push_back(p4.E);
+    }
+    block.n_events++;
+}
+
+// Make the next event of the block the current event (true kinematics, no resolution)
+void FusionReaction::RestoreTruth(const TruthBlock& block, int& value_pos, int& tree_pos) {
+    const double* v = block.values.data() + value_pos;
+    const int* t = block.tree.data() + tree_pos;
+
+    event_weight = *v++;
+    E_beam_current = *v++;
+    event_sums.final_valid = false;
+    event_sums.decay_valid = false;
+
+    // Products: angles in one batch, kinetic energy as p^2 / (E + m)
+    int n_products = products.size();
+    double px[kMaxProducts], py[kMaxProducts], pz[kMaxProducts], E[kMaxProducts], p[kMaxProducts], theta_deg[kMaxProducts], phi_deg[kMaxProducts];
+    if (n_products < 2) return;  // No event is stored without phase space
+    for (int i = 0; i < n_products; i++) {
+        product_kin.excitation_energy[i] = *v++;
+        px[i] = *v++;
+        py[i] = *v++;
+        pz[i] = *v++;
+        E[i] = *v++;
+    }
+    VectorAngles(n_products, px, py, pz, p, theta_deg, phi_deg);
+    for (int i = 0; i < n_products; i++) {
+        double m = products[i].mass + product_kin.excitation_energy[i];
+        SetProductKinematics(i, px[i], py[i], pz[i], E[i], p[i] * p[i] / (E[i] + m), p[i], theta_deg[i], phi_deg[i]);
+    }
+
+    // Decay tree: products are the first entries, decay products carry their 4-vectors
+    n_decay_tree = *t++;
+    for (int e = 0; e < n_decay_tree; e++) {
+        DecayTreeEntry& entry = decay_tree[e];
+        entry.slot = *t++;
+        entry.parent = *t++;
+        entry.channel = *t++;
+        entry.first_daughter = *t++;
+        entry.n_daughters = *t++;
+        if (entry.slot < 0) {
+            entry.product = e;
+            entry.mass = products[e].mass;
+            entry.excitation_energy = product_kin.excitation_energy[e];
+            continue;
+        }
+
+        entry.product = -1;
+        entry.mass = decay_masses[entry.slot];
+        entry.excitation_energy = decay_excitation[entry.slot];
+        FourVector& p4 = decay_p4_true[entry.slot];
+        p4.px = *v++;
+        p4.py = *v++;
+        p4.pz = *v++;
+        p4.E = *v++;
+    }
+    if (decay_enabled && decay_product_index >= 0) {
+        original_parent_energy = product_kin.energy[decay_product_index];
+    }
+
+    value_pos = v - block.values.data();
+    tree_pos = t - block.tree.data();
+}
+
+// Truth-generation stage: products and decays without resolution, histograms or
+// reconstruction, written to filename in blocks. Events below threshold are not stored.
+void FusionReaction::GenerateTruth(int n_events, const char* filename) {
+    if (!prepared) {
+        cout << "ERROR: InitializeHistograms() must be called before GenerateTruth()!" << endl;
+        exit(1);
+    }
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        cout << "ERROR: Cannot open truth output: " << filename << endl;
+        exit(1);
+    }
+    vector<int> layout;
+    TruthLayout(layout);
+    WriteTruthHeader(file, layout);
+
+    cout << "Generating truth-level events..." << endl;
+    PrintProductSummary();
+    cout << "Number of events: " << n_events << endl;
+
+    TruthBlock block;
+    block.n_events = 0;
+    block.values.reserve(kEventBlockSize * (2 + 5 * products.size() + 4 * kMaxDecayEntries));
+    block.tree.reserve(kEventBlockSize * (1 + 5 * kMaxDecayEntries));
+
+    int n_failed = 0;
+    for (int event = 0; event < n_events; event++) {
+        if (event % 10000 == 0) {
+            cout << "Processing event " << event << endl;
+        }
+        event_weight = GenerateProducts();
+        if (event_weight < 0) {
+            n_failed++;
+            continue;
+        }
+        if (decay_enabled) {
+            event_weight *= SimulateDecay(false);
+        }
+        StoreTruth(block);
+
+        if (block.n_events == kEventBlockSize) {
+            WriteTruthBlock(file, block);
+            block.n_events = 0;
+            block.values.clear();
+            block.tree.clear();
+        }
+    }
+    if (block.n_events > 0) WriteTruthBlock(file, block);
+    fclose(file);
+
+    cout << "Truth events written to " << filename << ": " << n_events - n_failed;
+    if (n_failed > 0) cout << " (" << n_failed << " without phase space skipped)";
+    cout << endl;
+}
+
+// Smearing and reconstruction stage: replay a truth file through the current resolutions
+// (th_res, E_beam_re for the decay energies, tar_res) and reconstruction settings. The beam
+// energy spread is part of the stored truth.
+void FusionReaction::ReplayTruth(const char* filename, bool verbose) {
+    if (!prepared) {
+        cout << "ERROR: InitializeHistograms() must be called before ReplayTruth()!" << endl;
+        exit(1);
+    }
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        cout << "ERROR: Cannot open truth input: " << filename << endl;
+        exit(1);
+    }
+    vector<int> layout, expected;
+    TruthLayout(expected);
+    if (!ReadTruthHeader(file, layout) || layout != expected) {
+        cout << "ERROR: " << filename << " is not a truth file of this reaction "
+             << "(beam, target, products and decay channels must match)!" << endl;
+        exit(1);
+    }
+
+    cout << "Replaying truth-level events from " << filename << endl;
+    PrintProductSummary();
+    cout << "Vector kernels: " << VectorISA() << endl;
+
+    TruthBlock block;
+    block.n_events = 0;
+    int event = 0;
+    while (ReadTruthBlock(file, block)) {
+        int value_pos = 0, tree_pos = 0;
+        for (int k = 0; k < block.n_events; k++, event++) {
+            if (event % 10000 == 0) {
+                cout << "Processing event " << event << endl;
+            }
+            RestoreTruth(block, value_pos, tree_pos);
+            MeasureProducts();
+            for (int e = 0; e < n_decay_tree; e++) {
+                const DecayTreeEntry& entry = decay_tree[e];
+                if (entry.channel < 0) continue;
+                int node_index = (entry.product >= 0) ? product_decay_node[entry.product] : decay_slot_node[entry.slot];
+                MeasureDecayProducts(e, node_index);
+            }
+            CompleteEvent(event, verbose);
+        }
+    }
+    fclose(file);
+
+    FinishSimulation();
+    cout << "Replay completed: " << event << " events" << endl;
+}